@@ -6,7 +6,10 @@
 #include "rad.h"
 #include "vis.h"
 #include "remap.h"
+#include "trace.h"
 #include <set>
+#include <unordered_map>
+#include <atomic>
 
 typedef map< string, vec3 > mapStringToVector;
 
@@ -17,19 +20,13 @@ vec3 default_hull_extents[MAX_MAP_HULLS] = {
 	vec3(16, 16, 18)	// hull 3
 };
 
-int g_sort_mode = SORT_CLIPNODES;
+thread_local int g_sort_mode = SORT_CLIPNODES; // per thread so batch jobs can sort model stats at the same time
 
 Bsp::Bsp() {
-	lumps = new byte * [HEADER_LUMPS];
+	init_lumps();
 
 	header.nVersion = 30;
 
-	for (int i = 0; i < HEADER_LUMPS; i++) {
-		header.lump[i].nLength = 0;
-		header.lump[i].nOffset = 0;
-		lumps[i] = NULL;
-	}
-
 	update_lump_pointers();
 	name = "merged";
 	valid = true;
@@ -44,6 +41,8 @@ Bsp::Bsp(std::string fpath)
 	this->name = stripExt(basename(fpath));
 	valid = false;
 
+	init_lumps();
+
 	bool exists = true;
 	if (!fileExists(fpath)) {
 		logf("ERROR: %s not found\n", fpath.c_str());
@@ -64,12 +63,15 @@ Bsp::Bsp(std::string fpath)
 Bsp::~Bsp()
 {	 
 	for (int i = 0; i < HEADER_LUMPS; i++)
-		if (lumps[i])
-			delete [] lumps[i];
+		free_lump(i);
 	delete [] lumps;
 
+	unmapFile(fileMapping, fileMappingSize, fileMappingHandle);
+
 	for (int i = 0; i < ents.size(); i++)
 		delete ents[i];
+
+	invalidate_model_usage();
 }
 
 void Bsp::get_bounding_box(vec3& mins, vec3& maxs) {
@@ -474,6 +476,7 @@ bool Bsp::vertex_manipulation_sync(int modelIdx, vector<TransformVert>& hullVert
 }
 
 bool Bsp::move(vec3 offset, int modelIdx) {
+	TraceSpan trace("move");
 	if (modelIdx < 0 || modelIdx >= modelCount) {
 		logf("Invalid modelIdx moved");
 		return false;
@@ -537,7 +540,7 @@ bool Bsp::move(vec3 offset, int modelIdx) {
 
 			vec3 ori;
 			if (ents[i]->hasKey("origin")) {
-				ori = parseVector(ents[i]->keyvalues["origin"]);
+				ori = parseVector(ents[i]->getKeyvalue("origin"));
 			}
 			ori += offset;
 
@@ -673,7 +676,11 @@ bool Bsp::move(vec3 offset, int modelIdx) {
 }
 
 void Bsp::move_texinfo(int idx, vec3 offset) {
-	BSPTEXTUREINFO& info = texinfos[idx];
+	texinfos[idx] = get_moved_texinfo(idx, offset);
+}
+
+BSPTEXTUREINFO Bsp::get_moved_texinfo(int idx, vec3 offset) {
+	BSPTEXTUREINFO info = texinfos[idx];
 
 	int32_t texOffset = ((int32_t*)textures)[info.iMiptex + 1];
 	BSPMIPTEX& tex = *((BSPMIPTEX*)(textures + texOffset));
@@ -708,9 +715,12 @@ void Bsp::move_texinfo(int idx, vec3 offset) {
 	while (fabs(info.shiftT) > tex.nHeight) {
 		info.shiftT += (info.shiftT < 0) ? (int)tex.nHeight : -(int)(tex.nHeight);
 	}
+
+	return info;
 }
 
 void Bsp::resize_lightmaps(LIGHTMAP* oldLightmaps, LIGHTMAP* newLightmaps) {
+	TraceSpan trace("resize_lightmaps");
 	g_progress.update("Recalculate lightmaps", faceCount);
 
 	// calculate new lightmap sizes
@@ -834,52 +844,31 @@ void Bsp::split_shared_model_structures(int modelIdx) {
 	STRUCTUSAGE shouldMove(this);
 	STRUCTUSAGE shouldNotMove(this);
 
-	g_progress.update("Split model structures", modelCount);
-
 	mark_model_structures(modelIdx, &shouldMove, modelIdx == 0);
-	for (int i = 0; i < modelCount; i++) {
-		if (i != modelIdx)
-			mark_model_structures(i, &shouldNotMove, false);
-
-		g_progress.tick();
-	}
-
-	STRUCTREMAP remappedStuff(this);
+	mark_other_model_structures(modelIdx, &shouldNotMove);
 
 	// TODO: handle all of these, assuming it's possible these are ever shared
-	for (int i = 1; i < shouldNotMove.count.leaves; i++) { // skip solid leaf - it doesn't matter
-		if (shouldMove.leaves[i] && shouldNotMove.leaves[i]) {
-			logf("\nWarning: leaf shared with multiple models. Something might break.\n");
-			break;
-		}
+	bool sharesSolidLeaf = shouldNotMove.count.leaves > 0 && shouldMove.leaves[0] && shouldNotMove.leaves[0];
+	if (shouldMove.leaves.count_common(shouldNotMove.leaves) > sharesSolidLeaf) { // solid leaf doesn't matter
+		logf("\nWarning: leaf shared with multiple models. Something might break.\n");
 	}
-	for (int i = 0; i < shouldNotMove.count.nodes; i++) {
-		if (shouldMove.nodes[i] && shouldNotMove.nodes[i]) {
-			logf("\nError: node shared with multiple models. Something will break.\n");
-			break;
-		}
+	if (shouldMove.nodes.intersects(shouldNotMove.nodes)) {
+		logf("\nError: node shared with multiple models. Something will break.\n");
 	}
-	for (int i = 0; i < shouldNotMove.count.verts; i++) {
-		if (shouldMove.verts[i] && shouldNotMove.verts[i]) {
-			logf("\nError: vertex shared with multiple models. Something will break.\n");
-			break;
-		}
+	if (shouldMove.verts.intersects(shouldNotMove.verts)) {
+		logf("\nError: vertex shared with multiple models. Something will break.\n");
 	}
 
-	int duplicatePlanes = 0;
-	int duplicateClipnodes = 0;
-	int duplicateTexinfos = 0;
+	int duplicatePlanes = shouldMove.planes.count_common(shouldNotMove.planes);
+	int duplicateClipnodes = shouldMove.clipnodes.count_common(shouldNotMove.clipnodes);
+	int duplicateTexinfos = shouldMove.texInfo.count_common(shouldNotMove.texInfo);
 
-	for (int i = 0; i < shouldNotMove.count.planes; i++) {
-		duplicatePlanes += shouldMove.planes[i] && shouldNotMove.planes[i];
-	}
-	for (int i = 0; i < shouldNotMove.count.clipnodes; i++) {
-		duplicateClipnodes += shouldMove.clipnodes[i] && shouldNotMove.clipnodes[i];
-	}
-	for (int i = 0; i < shouldNotMove.count.texInfos; i++) {
-		duplicateTexinfos += shouldMove.texInfo[i] && shouldNotMove.texInfo[i];
+	if (!duplicatePlanes && !duplicateClipnodes && !duplicateTexinfos) {
+		return; // nothing to split. Leave the lumps alone so cached model usage stays valid.
 	}
 
+	STRUCTREMAP remappedStuff(this);
+
 	int newPlaneCount = planeCount + duplicatePlanes;
 	int newClipnodeCount = clipnodeCount + duplicateClipnodes;
 	int newTexinfoCount = texinfoCount + duplicateTexinfos;
@@ -891,7 +880,7 @@ void Bsp::split_shared_model_structures(int modelIdx) {
 	memcpy(newClipnodes, clipnodes, clipnodeCount * sizeof(BSPCLIPNODE));
 
 	BSPTEXTUREINFO* newTexinfos = new BSPTEXTUREINFO[newTexinfoCount];
-	memcpy(newTexinfos, texinfos, newTexinfoCount * sizeof(BSPTEXTUREINFO));
+	memcpy(newTexinfos, texinfos, texinfoCount * sizeof(BSPTEXTUREINFO));
 
 	int addIdx = planeCount;
 	for (int i = 0; i < shouldNotMove.count.planes; i++) {
@@ -931,39 +920,23 @@ void Bsp::split_shared_model_structures(int modelIdx) {
 
 	remap_model_structures(modelIdx, &remappedStuff);
 
-	if (duplicatePlanes || duplicateClipnodes || duplicateTexinfos) {
-		debugf("\nShared model structures were duplicated to allow independent movement:\n");
-		if (duplicatePlanes)
-			debugf("    Added %d planes\n", duplicatePlanes);
-		if (duplicateClipnodes)
-			debugf("    Added %d clipnodes\n", duplicateClipnodes);
-		if (duplicateTexinfos)
-			debugf("    Added %d texinfos\n", duplicateTexinfos);
-	}
+	debugf("\nShared model structures were duplicated to allow independent movement:\n");
+	if (duplicatePlanes)
+		debugf("    Added %d planes\n", duplicatePlanes);
+	if (duplicateClipnodes)
+		debugf("    Added %d clipnodes\n", duplicateClipnodes);
+	if (duplicateTexinfos)
+		debugf("    Added %d texinfos\n", duplicateTexinfos);
 }
 
 bool Bsp::does_model_use_shared_structures(int modelIdx) {
 	STRUCTUSAGE shouldMove(this);
 	STRUCTUSAGE shouldNotMove(this);
 
-	for (int i = 0; i < modelCount; i++) {
-		if (i == modelIdx)
-			mark_model_structures(i, &shouldMove, true);
-		else
-			mark_model_structures(i, &shouldNotMove, false);
-	}
+	mark_model_structures(modelIdx, &shouldMove, true);
+	mark_other_model_structures(modelIdx, &shouldNotMove);
 
-	for (int i = 0; i < planeCount; i++) {
-		if (shouldMove.planes[i] && shouldNotMove.planes[i]) {
-			return true;
-		}
-	}
-	for (int i = 0; i < clipnodeCount; i++) {
-		if (shouldMove.clipnodes[i] && shouldNotMove.clipnodes[i]) {
-			return true;
-		}
-	}
-	return false;
+	return shouldMove.planes.intersects(shouldNotMove.planes) || shouldMove.clipnodes.intersects(shouldNotMove.clipnodes);
 }
 
 LumpState Bsp::duplicate_lumps(int targets) {
@@ -1022,10 +995,13 @@ void Bsp::replace_lumps(LumpState& state) {
 			continue;
 		}
 
-		delete[] lumps[i];
+		free_lump(i);
 		lumps[i] = new byte[state.lumpLen[i]];
+		lumpOwned[i] = true;
+		lumpCapacity[i] = state.lumpLen[i];
 		memcpy(lumps[i], state.lumps[i], state.lumpLen[i]);
 		header.lump[i].nLength = state.lumpLen[i];
+		invalidate_model_usage(i);
 
 		if (i == LUMP_ENTITIES) {
 			load_ents();
@@ -1035,7 +1011,8 @@ void Bsp::replace_lumps(LumpState& state) {
 	update_lump_pointers();
 }
 
-int Bsp::remove_unused_structs(int lumpIdx, bool* usedStructs, int* remappedIndexes) {
+int Bsp::remove_unused_structs(int lumpIdx, const BITSET& usedStructs, int* remappedIndexes) {
+	TraceSpan trace("remove_unused_structs");
 	int structSize = 0;
 
 	switch (lumpIdx) {
@@ -1080,7 +1057,8 @@ int Bsp::remove_unused_structs(int lumpIdx, bool* usedStructs, int* remappedInde
 	return removeCount;
 }
 
-int Bsp::remove_unused_textures(bool* usedTextures, int* remappedIndexes) {
+int Bsp::remove_unused_textures(BITSET& usedTextures, int* remappedIndexes) {
+	TraceSpan trace("remove_unused_textures");
 	int oldTexCount = textureCount;
 
 	int removeCount = 0;
@@ -1092,7 +1070,7 @@ int Bsp::remove_unused_textures(bool* usedTextures, int* remappedIndexes) {
 
 			// don't delete single frames from animated textures or else game crashes
 			if (tex->szName[0] == '-' || tex->szName[0] == '+') {
-				usedTextures[i] = true;
+				usedTextures.set(i);
 				// TODO: delete all frames if none are used
 				continue;
 			}
@@ -1141,7 +1119,8 @@ int Bsp::remove_unused_textures(bool* usedTextures, int* remappedIndexes) {
 	return removeCount;
 }
 
-int Bsp::remove_unused_lightmaps(bool* usedFaces) {
+int Bsp::remove_unused_lightmaps(const BITSET& usedFaces) {
+	TraceSpan trace("remove_unused_lightmaps");
 	int oldLightdataSize = lightDataLength;
 
 	int* lightmapSizes = new int[faceCount];
@@ -1174,15 +1153,34 @@ int Bsp::remove_unused_lightmaps(bool* usedFaces) {
 	return oldLightdataSize - newLightDataSize;
 }
 
-int Bsp::remove_unused_visdata(bool* usedLeaves, BSPLEAF* oldLeaves, int oldLeafCount) {
+int Bsp::remove_unused_visdata(const BITSET& usedLeaves, BSPLEAF* oldLeaves, int oldLeafCount) {
+	TraceSpan trace("remove_unused_visdata");
 	int oldVisLength = visDataLength;
 
 	// exclude solid leaf
 	int oldVisLeafCount = oldLeafCount - 1;
 	int newVisLeafCount = (header.lump[LUMP_LEAVES].nLength / sizeof(BSPLEAF)) - 1;
 
-	int oldWorldLeaves = ((BSPMODEL*)lumps[LUMP_MODELS])->nVisLeafs; // TODO: allow deleting world leaves
-	int newWorldLeaves = ((BSPMODEL*)lumps[LUMP_MODELS])->nVisLeafs;
+	int oldWorldLeaves = ((BSPMODEL*)lumps[LUMP_MODELS])->nVisLeafs;
+
+	// runs of deleted world leaves, as [first vis leaf, count]
+	vector<pair<int, int>> deletedRuns;
+	for (int i = 0; i < oldWorldLeaves; i++) {
+		if (usedLeaves[i + 1]) {
+			continue;
+		}
+		if (deletedRuns.size() && deletedRuns.back().first + deletedRuns.back().second == i) {
+			deletedRuns.back().second++;
+		}
+		else {
+			deletedRuns.push_back(make_pair(i, 1));
+		}
+	}
+
+	int newWorldLeaves = oldWorldLeaves;
+	for (int i = 0; i < deletedRuns.size(); i++) {
+		newWorldLeaves -= deletedRuns[i].second;
+	}
 
 	uint oldVisRowSize = ((oldVisLeafCount + 63) & ~63) >> 3;
 	uint newVisRowSize = ((newVisLeafCount + 63) & ~63) >> 3;
@@ -1193,13 +1191,31 @@ int Bsp::remove_unused_visdata(bool* usedLeaves, BSPLEAF* oldLeaves, int oldLeaf
 	decompress_vis_lump(oldLeaves, lumps[LUMP_VISIBILITY], decompressedVis, 
 		oldWorldLeaves, oldVisLeafCount, oldVisLeafCount);
 
+	if (deletedRuns.size()) {
+		// drop the rows of deleted leaves and shift their bits out of the remaining rows
+		for (int i = 0, k = 0; i < oldWorldLeaves; i++) {
+			if (!usedLeaves[i + 1]) {
+				continue;
+			}
+			byte* row = decompressedVis + k * oldVisRowSize;
+			if (k != i) {
+				memcpy(row, decompressedVis + i * oldVisRowSize, oldVisRowSize);
+			}
+			for (int r = deletedRuns.size() - 1; r >= 0; r--) {
+				shiftBits(row, oldVisRowSize, deletedRuns[r].first, -deletedRuns[r].second);
+			}
+			k++;
+		}
+		((BSPMODEL*)lumps[LUMP_MODELS])->nVisLeafs = newWorldLeaves;
+	}
+
 	if (oldVisRowSize != newVisRowSize) {
 		int newDecompressedVisSize = oldLeafCount * newVisRowSize;
 		byte* newDecompressedVis = new byte[decompressedVisSize];
 		memset(newDecompressedVis, 0, newDecompressedVisSize);
 
 		int minRowSize = min(oldVisRowSize, newVisRowSize);
-		for (int i = 0; i < oldWorldLeaves; i++) {
+		for (int i = 0; i < newWorldLeaves; i++) {
 			memcpy(newDecompressedVis + i * newVisRowSize, decompressedVis + i * oldVisRowSize, minRowSize);
 		}
 
@@ -1223,36 +1239,27 @@ int Bsp::remove_unused_visdata(bool* usedLeaves, BSPLEAF* oldLeaves, int oldLeaf
 }
 
 STRUCTCOUNT Bsp::remove_unused_model_structures() {
+	TraceSpan trace("remove_unused_model_structures");
 	// marks which structures should not be moved
 	STRUCTUSAGE usedStructures(this);
 
-	bool* usedModels = new bool[modelCount];
-	memset(usedModels, 0, sizeof(bool) * modelCount);
-	usedModels[0] = true; // never delete worldspawn
-	for (int i = 0; i < ents.size(); i++) {
-		int modelIdx = ents[i]->getBspModelIdx();
-		if (modelIdx >= 0 && modelIdx < modelCount) {
-			usedModels[modelIdx] = true;
-		}
-	}
+	update_model_ent_index();
 
-	// reversed so models can be deleted without shifting the next delete index
- 	for (int i = modelCount-1; i >= 0; i--) { 
-		if (!usedModels[i]) {
-			delete_model(i);
-		}
-		else {
-			mark_model_structures(i, &usedStructures, false);
-		}
+	vector<bool> unusedModels(modelCount, false);
+	for (int i = 1; i < modelCount; i++) { // never delete worldspawn
+		unusedModels[i] = modelEnts[i].empty();
 	}
+	delete_models(unusedModels);
 
-	delete[] usedModels;
+	for (int i = 0; i < modelCount; i++) {
+		mark_model_structures(i, &usedStructures, false);
+	}
 
 	STRUCTREMAP remap(this);
 	STRUCTCOUNT removeCount;
 	memset(&removeCount, 0, sizeof(STRUCTCOUNT));
 
-	usedStructures.edges[0] = true; // first edge is never used but maps break without it?
+	usedStructures.edges.set(0); // first edge is never used but maps break without it?
 
 	byte* oldLeaves = new byte[header.lump[LUMP_LEAVES].nLength];
 	memcpy(oldLeaves, lumps[LUMP_LEAVES], header.lump[LUMP_LEAVES].nLength);
@@ -1338,6 +1345,86 @@ STRUCTCOUNT Bsp::remove_unused_model_structures() {
 	return removeCount;
 }
 
+STRUCTCOUNT Bsp::dedup_clipnodes() {
+	// planes with the same values count as the same plane (e.g. copies made for a model move)
+	vector<int> planeIds(planeCount);
+	unordered_map<BSPPLANE, int, RawBytesHash<BSPPLANE>, RawBytesEqual<BSPPLANE>> planeIndexes;
+	for (int i = 0; i < planeCount; i++) {
+		planeIds[i] = planeIndexes.insert(make_pair(planes[i], i)).first->second;
+	}
+
+	const int UNVISITED = -1;
+	const int VISITING = -2;
+
+	// first clipnode found with the same plane and (deduplicated) children as each clipnode.
+	// Children are resolved before their parents, so equal keys mean equal subtrees.
+	vector<int> canonical(clipnodeCount, UNVISITED);
+	unordered_map<uint64_t, int> subtrees;
+	subtrees.reserve(clipnodeCount);
+	vector<int> stack;
+
+	for (int i = 0; i < modelCount; i++) {
+		for (int k = 1; k < MAX_MAP_HULLS; k++) {
+			int headnode = models[i].iHeadnodes[k];
+			if (headnode < 0 || headnode >= clipnodeCount || canonical[headnode] != UNVISITED)
+				continue;
+
+			stack.push_back(headnode);
+			while (!stack.empty()) {
+				int iNode = stack.back();
+				BSPCLIPNODE& node = clipnodes[iNode];
+
+				if (canonical[iNode] == UNVISITED) {
+					canonical[iNode] = VISITING;
+					for (int c = 0; c < 2; c++) {
+						int child = node.iChildren[c];
+						if (child >= 0 && child < clipnodeCount && canonical[child] == UNVISITED)
+							stack.push_back(child);
+					}
+					continue;
+				}
+
+				stack.pop_back();
+				if (canonical[iNode] != VISITING)
+					continue; // already resolved through another parent
+
+				// children still being visited are part of a loop and are kept as-is
+				uint16_t children[2];
+				for (int c = 0; c < 2; c++) {
+					int child = node.iChildren[c];
+					if (child >= 0 && child < clipnodeCount && canonical[child] >= 0)
+						child = canonical[child];
+					children[c] = (uint16_t)child;
+				}
+
+				int planeId = node.iPlane >= 0 && node.iPlane < planeCount ? planeIds[node.iPlane] : node.iPlane;
+				uint64_t key = ((uint64_t)(uint32_t)planeId << 32) | ((uint64_t)children[0] << 16) | children[1];
+				canonical[iNode] = subtrees.insert(make_pair(key, iNode)).first->second;
+			}
+		}
+	}
+
+	for (int i = 0; i < clipnodeCount; i++) {
+		for (int c = 0; c < 2; c++) {
+			int child = clipnodes[i].iChildren[c];
+			if (child >= 0 && child < clipnodeCount && canonical[child] >= 0)
+				clipnodes[i].iChildren[c] = canonical[child];
+		}
+	}
+	for (int i = 0; i < modelCount; i++) {
+		for (int k = 1; k < MAX_MAP_HULLS; k++) {
+			int headnode = models[i].iHeadnodes[k];
+			if (headnode >= 0 && headnode < clipnodeCount && canonical[headnode] >= 0)
+				models[i].iHeadnodes[k] = canonical[headnode];
+		}
+	}
+
+	invalidate_model_usage();
+
+	// the duplicates are no longer referenced by any model
+	return remove_unused_model_structures();
+}
+
 bool Bsp::has_hull2_ents() {
 	// monsters that use hull 2 by default
 	static set<string> largeMonsters{
@@ -1356,17 +1443,17 @@ bool Bsp::has_hull2_ents() {
 	};
 
 	for (int i = 0; i < ents.size(); i++) {
-		string cname = ents[i]->keyvalues["classname"];
-		string tname = ents[i]->keyvalues["targetname"];
+		string cname = ents[i]->getKeyvalue("classname");
+		string tname = ents[i]->getKeyvalue("targetname");
 
 		if (cname.find("monster_") == 0) {
 			vec3 minhull;
 			vec3 maxhull;
 
-			if (!ents[i]->keyvalues["minhullsize"].empty())
-				minhull = Keyvalue("", ents[i]->keyvalues["minhullsize"]).getVector();
-			if (!ents[i]->keyvalues["maxhullsize"].empty())
-				maxhull = Keyvalue("", ents[i]->keyvalues["maxhullsize"]).getVector();
+			if (!ents[i]->getKeyvalue("minhullsize").empty())
+				minhull = Keyvalue("", ents[i]->getKeyvalue("minhullsize")).getVector();
+			if (!ents[i]->getKeyvalue("maxhullsize").empty())
+				maxhull = Keyvalue("", ents[i]->getKeyvalue("maxhullsize")).getVector();
 
 			if (minhull == vec3(0, 0, 0) && maxhull == vec3(0, 0, 0)) {
 				// monster is using its default hull size
@@ -1396,6 +1483,7 @@ bool Bsp::has_hull2_ents() {
 }
 
 STRUCTCOUNT Bsp::delete_unused_hulls(bool noProgress) {
+	TraceSpan trace("delete_unused_hulls");
 	if (!noProgress) {
 		if (g_verbose)
 			g_progress.update("", 0);
@@ -1403,8 +1491,56 @@ STRUCTCOUNT Bsp::delete_unused_hulls(bool noProgress) {
 			g_progress.update("Deleting unused hulls", modelCount - 1);
 	}
 
+	static set<string> conditionalPointEntTriggers{
+		"trigger_once",
+		"trigger_multiple",
+		"trigger_counter",
+		"trigger_gravity",
+		"trigger_teleport"
+	};
+
+	static set<string> entsThatNeverNeedAnyHulls{
+		"env_bubbles",
+		"func_mortar_field",
+		"func_tankcontrols",
+		"func_traincontrols",
+		"func_vehiclecontrols",
+		"trigger_autosave", // obsolete in sven
+		"trigger_endsection" // obsolete in sven
+	};
+
+	static set<string> entsThatNeverNeedCollision{
+		"func_illusionary"
+	};
+
+	static set<string> passableEnts{
+		"func_door",
+		"func_door_rotating",
+		"func_pendulum",
+		"func_tracktrain",
+		"func_train",
+		"func_water",
+		"momentary_door"
+	};
+
+	static set<string> playerOnlyTriggers{
+		"func_ladder",
+		"game_zone_player",
+		"player_respawn_zone",
+		"trigger_cdaudio",
+		"trigger_changelevel",
+		"trigger_transition"
+	};
+
+	static set<string> monsterOnlyTriggers{
+		"func_monsterclip",
+		"trigger_monsterjump"
+	};
+
 	int deletedHulls = 0;
 
+	update_model_ent_index();
+
 	for (int i = 1; i < modelCount; i++) {
 		if (!g_verbose && !noProgress)
 			g_progress.tick();
@@ -1417,60 +1553,17 @@ STRUCTCOUNT Bsp::delete_unused_hulls(bool noProgress) {
 			for (int k = 0; k < MAX_MAP_HULLS; k++)
 				deletedHulls += models[i].iHeadnodes[k] >= 0;
 
-			delete_model(i);
-			//modelCount--; automatically updated when lump is replaced
-			i--;
-			continue;
+			continue; // deleted along with the other unused models in remove_unused_model_structures
 		}
 
-		set<string> conditionalPointEntTriggers;
-		conditionalPointEntTriggers.insert("trigger_once");
-		conditionalPointEntTriggers.insert("trigger_multiple");
-		conditionalPointEntTriggers.insert("trigger_counter");
-		conditionalPointEntTriggers.insert("trigger_gravity");
-		conditionalPointEntTriggers.insert("trigger_teleport");
-
-		set<string> entsThatNeverNeedAnyHulls;
-		entsThatNeverNeedAnyHulls.insert("env_bubbles");
-		entsThatNeverNeedAnyHulls.insert("func_mortar_field");
-		entsThatNeverNeedAnyHulls.insert("func_tankcontrols");
-		entsThatNeverNeedAnyHulls.insert("func_traincontrols");
-		entsThatNeverNeedAnyHulls.insert("func_vehiclecontrols");
-		entsThatNeverNeedAnyHulls.insert("trigger_autosave"); // obsolete in sven
-		entsThatNeverNeedAnyHulls.insert("trigger_endsection"); // obsolete in sven
-
-		set<string> entsThatNeverNeedCollision;
-		entsThatNeverNeedCollision.insert("func_illusionary");
-
-		set<string> passableEnts;
-		passableEnts.insert("func_door");
-		passableEnts.insert("func_door_rotating");
-		passableEnts.insert("func_pendulum");
-		passableEnts.insert("func_tracktrain");
-		passableEnts.insert("func_train");
-		passableEnts.insert("func_water");
-		passableEnts.insert("momentary_door");
-
-		set<string> playerOnlyTriggers;
-		playerOnlyTriggers.insert("func_ladder");
-		playerOnlyTriggers.insert("game_zone_player");
-		playerOnlyTriggers.insert("player_respawn_zone");
-		playerOnlyTriggers.insert("trigger_cdaudio");
-		playerOnlyTriggers.insert("trigger_changelevel");
-		playerOnlyTriggers.insert("trigger_transition");
-
-		set<string> monsterOnlyTriggers;
-		monsterOnlyTriggers.insert("func_monsterclip");
-		monsterOnlyTriggers.insert("trigger_monsterjump");
-
 		string uses = "";
 		bool needsPlayerHulls = false; // HULL 1 + HULL 3
 		bool needsMonsterHulls = false; // All HULLs
 		bool needsVisibleHull = false; // HULL 0
 		for (int k = 0; k < usageEnts.size(); k++) {
-			string cname = usageEnts[k]->keyvalues["classname"];
-			string tname = usageEnts[k]->keyvalues["targetname"];
-			int spawnflags = atoi(usageEnts[k]->keyvalues["spawnflags"].c_str());
+			string cname = usageEnts[k]->getKeyvalue("classname");
+			string tname = usageEnts[k]->getKeyvalue("targetname");
+			int spawnflags = atoi(usageEnts[k]->getKeyvalue("spawnflags").c_str());
 
 			if (k != 0) {
 				uses += ", ";
@@ -1605,10 +1698,10 @@ bool Bsp::is_invisible_solid(Entity* ent) {
 	if (!ent->isBspModel())
 		return false;
 
-	string tname = ent->keyvalues["targetname"];
-	int rendermode = atoi(ent->keyvalues["rendermode"].c_str());
-	int renderamt = atoi(ent->keyvalues["renderamt"].c_str());
-	int renderfx = atoi(ent->keyvalues["renderfx"].c_str());
+	string tname = ent->getKeyvalue("targetname");
+	int rendermode = atoi(ent->getKeyvalue("rendermode").c_str());
+	int renderamt = atoi(ent->getKeyvalue("renderamt").c_str());
+	int renderfx = atoi(ent->getKeyvalue("renderfx").c_str());
 
 	if (rendermode == 0 || renderamt != 0) {
 		return false;
@@ -1628,37 +1721,37 @@ bool Bsp::is_invisible_solid(Entity* ent) {
 	};
 
 	for (int i = 0; i < ents.size(); i++) {
-		string cname = ents[i]->keyvalues["classname"];
+		string cname = ents[i]->getKeyvalue("classname");
 
 		if (cname == "env_render") {
 			return false; // assume it will affect the brush since it can be moved anywhere
 		}
 		else if (cname == "env_render_individual") {
-			if (ents[i]->keyvalues["target"] == tname) {
+			if (ents[i]->getKeyvalue("target") == tname) {
 				return false; // assume it's making the ent visible
 			}
 		}
 		else if (cname == "trigger_changevalue") {
-			if (ents[i]->keyvalues["target"] == tname) {
-				if (renderKeys.find(ents[i]->keyvalues["m_iszValueName"]) != renderKeys.end()) {
+			if (ents[i]->getKeyvalue("target") == tname) {
+				if (renderKeys.find(ents[i]->getKeyvalue("m_iszValueName")) != renderKeys.end()) {
 					return false; // assume it's making the ent visible
 				}
 			}
 		}
 		else if (cname == "trigger_copyvalue") {
-			if (ents[i]->keyvalues["target"] == tname) {
-				if (renderKeys.find(ents[i]->keyvalues["m_iszDstValueName"]) != renderKeys.end()) {
+			if (ents[i]->getKeyvalue("target") == tname) {
+				if (renderKeys.find(ents[i]->getKeyvalue("m_iszDstValueName")) != renderKeys.end()) {
 					return false; // assume it's making the ent visible
 				}
 			}
 		}
 		else if (cname == "trigger_createentity") {
-			if (ents[i]->keyvalues["+model"] == tname || ents[i]->keyvalues["-model"] == ent->keyvalues["model"]) {
+			if (ents[i]->getKeyvalue("+model") == tname || ents[i]->getKeyvalue("-model") == ent->getKeyvalue("model")) {
 				return false; // assume this new ent will be visible at some point
 			}
 		}
 		else if (cname == "trigger_changemodel") {
-			if (ents[i]->keyvalues["model"] == ent->keyvalues["model"]) {
+			if (ents[i]->getKeyvalue("model") == ent->getKeyvalue("model")) {
 				return false; // assume the target is visible
 			}
 		}
@@ -1732,37 +1825,63 @@ void Bsp::get_lightmap_shift(const LIGHTMAP& oldLightmap, const LIGHTMAP& newLig
 	srcOffsetY = newLightmap.height != oldLightmap.height ? shouldShiftTop : 0;
 }
 
+static atomic<int> g_nextEntLumpId(1);
+
+static bool is_node_ent(Entity* ent) {
+	const string& cname = ent->getKeyvalue("classname");
+	return cname == "info_node" || cname == "info_node_air";
+}
+
 void Bsp::update_ent_lump(bool stripNodes) {
-	stringstream ent_data;
+	TraceSpan trace("update_ent_lump");
+	const char* oldData = (const char*)lumps[LUMP_ENTITIES];
+	int newId = g_nextEntLumpId++;
 
+	// size everything first so the text is written straight into the new lump
+	int dataSize = 0;
 	for (int i = 0; i < ents.size(); i++) {
-		if (stripNodes) {
-			string cname = ents[i]->keyvalues["classname"];
-			if (cname == "info_node" || cname == "info_node_air") {
-				continue;
-			}
+		Entity* ent = ents[i];
+		if (stripNodes && is_node_ent(ent)) {
+			continue;
 		}
 
-		ent_data << "{\n";
+		bool unchanged = entLumpId != 0 && ent->rawLumpId == entLumpId;
+		dataSize += unchanged ? ent->rawLength : ent->getSerializedSize();
+		if (i < ents.size() - 1) {
+			dataSize++; // trailing newline crashes sven, and only sven, and only sometimes
+		}
+	}
+
+	byte* newEntData = new byte[dataSize + 1];
+	char* out = (char*)newEntData;
 
-		for (int k = 0; k < ents[i]->keyOrder.size(); k++) {
-			string key = ents[i]->keyOrder[k];
-			ent_data << "\"" << key << "\" \"" << ents[i]->keyvalues[key] << "\"\n";
+	for (int i = 0; i < ents.size(); i++) {
+		Entity* ent = ents[i];
+		if (stripNodes && is_node_ent(ent)) {
+			continue;
 		}
 
-		ent_data << "}";
-		if (i < ents.size() - 1) {
-			ent_data << "\n"; // trailing newline crashes sven, and only sven, and only sometimes
+		char* entStart = out;
+		if (entLumpId != 0 && ent->rawLumpId == entLumpId) {
+			memcpy(out, oldData + ent->rawOffset, ent->rawLength);
+			out += ent->rawLength;
+		}
+		else {
+			out = ent->serialize(out);
 		}
-	}
 
-	string str_data = ent_data.str();
+		ent->rawLumpId = newId;
+		ent->rawOffset = entStart - (char*)newEntData;
+		ent->rawLength = out - entStart;
 
-	byte* newEntData = new byte[str_data.size() + 1];
-	memcpy(newEntData, str_data.c_str(), str_data.size());
-	newEntData[str_data.size()] = 0; // null terminator required too(?)
+		if (i < ents.size() - 1) {
+			*out++ = '\n';
+		}
+	}
+	*out = 0; // null terminator required too(?)
 
-	replace_lump(LUMP_ENTITIES, newEntData, str_data.size()+1);	
+	replace_lump(LUMP_ENTITIES, newEntData, dataSize + 1);
+	entLumpId = newId;
 }
 
 vec3 Bsp::get_model_center(int modelIdx) {
@@ -1791,10 +1910,14 @@ int Bsp::lightmap_count(int faceIdx) {
 }
 
 void Bsp::write(string path) {
+	TraceSpan trace("write");
 	if (path.rfind(".bsp") != path.size() - 4) {
 		path = path + ".bsp";
 	}
 
+	// the output is likely the file that was loaded, which can't be truncated while it's mapped
+	release_file_mapping();
+
 	// calculate lump offsets
 	int offset = sizeof(BSPHEADER);
 	for (int i = 0; i < HEADER_LUMPS; i++) {
@@ -1817,25 +1940,97 @@ void Bsp::write(string path) {
 	}
 }
 
+void Bsp::init_lumps() {
+	lumps = new byte * [HEADER_LUMPS];
+	fileMapping = NULL;
+	fileMappingSize = 0;
+	fileMappingHandle = NULL;
+	anyModelUsage = NULL;
+	sharedModelUsage = NULL;
+	modelEntsDirty = true;
+	modelEntsEntCount = 0;
+
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		header.lump[i].nLength = 0;
+		header.lump[i].nOffset = 0;
+		lumps[i] = NULL;
+		lumpOwned[i] = false;
+		lumpCapacity[i] = 0;
+	}
+}
+
+void Bsp::free_lump(int lumpIdx) {
+	if (lumpOwned[lumpIdx])
+		delete[] lumps[lumpIdx];
+	lumps[lumpIdx] = NULL;
+	lumpOwned[lumpIdx] = false;
+	lumpCapacity[lumpIdx] = 0;
+}
+
+void Bsp::release_file_mapping() {
+	if (!fileMapping)
+		return;
+
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		if (!lumps[i] || lumpOwned[i])
+			continue;
+
+		byte* copy = new byte[header.lump[i].nLength];
+		memcpy(copy, lumps[i], header.lump[i].nLength);
+		lumps[i] = copy;
+		lumpOwned[i] = true;
+		lumpCapacity[i] = header.lump[i].nLength;
+	}
+
+	unmapFile(fileMapping, fileMappingSize, fileMappingHandle);
+	fileMapping = NULL;
+	fileMappingSize = 0;
+	fileMappingHandle = NULL;
+
+	update_lump_pointers();
+}
+
+byte* Bsp::grow_lump(int lumpIdx, int appendLength) {
+	int oldLen = header.lump[lumpIdx].nLength;
+	int newLen = oldLen + appendLength;
+
+	if (!lumpOwned[lumpIdx] || newLen > lumpCapacity[lumpIdx]) {
+		int newCapacity = max(newLen, oldLen + oldLen / 2);
+
+		byte* newLump = new byte[newCapacity];
+		if (oldLen)
+			memcpy(newLump, lumps[lumpIdx], oldLen);
+
+		free_lump(lumpIdx);
+		lumps[lumpIdx] = newLump;
+		lumpOwned[lumpIdx] = true;
+		lumpCapacity[lumpIdx] = newCapacity;
+	}
+
+	header.lump[lumpIdx].nLength = newLen;
+	invalidate_model_usage(lumpIdx);
+	update_lump_pointers();
+
+	return lumps[lumpIdx] + oldLen;
+}
+
 bool Bsp::load_lumps(string fpath)
 {
+	TraceSpan trace("load_lumps");
 	bool valid = true;
 
-	// Read all BSP Data
-	ifstream fin(fpath, ios::binary | ios::ate);
-	int size = fin.tellg();
-	fin.seekg(0, fin.beg);
-
-	if (size < sizeof(BSPHEADER) + sizeof(BSPLUMP)*HEADER_LUMPS)
+	// Lumps are not copied. They point directly into a private mapping of the file, so that read-only
+	// commands never touch most of the file. Edits made through the lump pointers are copy-on-write.
+	int size = 0;
+	fileMapping = mapFile(fpath, size, fileMappingHandle);
+	if (!fileMapping)
 		return false;
+	fileMappingSize = size;
 
-	fin.read((char*)&header.nVersion, sizeof(int));
-	
-	for (int i = 0; i < HEADER_LUMPS; i++)
-		fin.read((char*)&header.lump[i], sizeof(BSPLUMP));
+	if (size < sizeof(BSPHEADER))
+		return false;
 
-	lumps = new byte*[HEADER_LUMPS];
-	memset(lumps, 0, sizeof(byte*)*HEADER_LUMPS);
+	memcpy(&header, fileMapping, sizeof(BSPHEADER));
 	
 	for (int i = 0; i < HEADER_LUMPS; i++)
 	{
@@ -1844,42 +2039,53 @@ bool Bsp::load_lumps(string fpath)
 			continue;
 		}
 
-		fin.seekg(header.lump[i].nOffset);
-		if (fin.eof()) {
+		if (header.lump[i].nOffset < 0 || header.lump[i].nLength < 0 || 
+			(int64_t)header.lump[i].nOffset + header.lump[i].nLength > size) {
 			logf("FAILED TO READ BSP LUMP %d\n", i);
+			header.lump[i].nLength = 0;
+			lumps[i] = NULL;
 			valid = false;
 		}
 		else
 		{
-			lumps[i] = new byte[header.lump[i].nLength];
-			fin.read((char*)lumps[i], header.lump[i].nLength);
+			lumps[i] = fileMapping + header.lump[i].nOffset;
+			lumpOwned[i] = false;
 		}
-	}	
-	
-	fin.close();
+	}
 
 	return valid;
 }
 
 void Bsp::load_ents()
 {
+	TraceSpan trace("load_ents");
 	for (int i = 0; i < ents.size(); i++)
 		delete ents[i];
 	ents.clear();
 
-	bool verbose = true;
-	membuf sbuf((char*)lumps[LUMP_ENTITIES], header.lump[LUMP_ENTITIES].nLength);
-	istream in(&sbuf);
+	const char* data = (const char*)lumps[LUMP_ENTITIES];
+	const char* dataEnd = data + header.lump[LUMP_ENTITIES].nLength;
+	entLumpId = g_nextEntLumpId++;
 
 	int lineNum = 0;
 	int lastBracket = -1;
 	Entity* ent = NULL;
+	Keyvalue k; // reused for every line, so only the strings stored in ents are allocated
+	const char* entStart = NULL; // start of the current ent's text, if it began on its own line
 
-	string line = "";
-	while (getline(in, line))
+	// lines are parsed in place. Same splitting as getline, with the last line ending at the lump end
+	const char* nextLine = data;
+	while (nextLine < dataEnd)
 	{
+		const char* line = nextLine;
+		const char* lineEnd = (const char*)memchr(line, '\n', dataEnd - line);
+		if (lineEnd == NULL)
+			lineEnd = dataEnd;
+		int lineLen = lineEnd - line;
+		nextLine = lineEnd + 1;
+
 		lineNum++;
-		if (line.length() < 1 || line[0] == '\n')
+		if (lineLen < 1)
 			continue;
 
 		if (line[0] == '{')
@@ -1894,6 +2100,7 @@ void Bsp::load_ents()
 			if (ent != NULL)
 				delete ent;
 			ent = new Entity();
+			entStart = line;
 		}
 		else if (line[0] == '}')
 		{
@@ -1904,11 +2111,20 @@ void Bsp::load_ents()
 			if (ent == NULL)
 				continue;
 
+			// remember where the text is if writing the ent back would give the same bytes
+			int rawLength = line + 1 - entStart;
+			if (entStart != NULL && ent->isSerializedAs(entStart, rawLength)) {
+				ent->rawLumpId = entLumpId;
+				ent->rawOffset = entStart - data;
+				ent->rawLength = rawLength;
+			}
+
 			ents.push_back(ent);
 			ent = NULL;
+			entStart = NULL;
 
 			// you can end/start an ent on the same line, you know
-			if (line.find("{") != string::npos)
+			if (memchr(line, '{', lineLen) != NULL)
 			{
 				ent = new Entity();
 				lastBracket = 0;
@@ -1916,14 +2132,127 @@ void Bsp::load_ents()
 		}
 		else if (lastBracket == 0 && ent != NULL) // currently defining an entity
 		{
-			Keyvalue k(line);
-			if (k.key.length() && k.value.length())
+			if (k.parse(line, lineLen))
 				ent->addKeyvalue(k);
 		}
 	}
 
 	if (ent != NULL)
 		delete ent;
+
+	update_model_ent_index();
+	update_ent_name_index();
+}
+
+void Bsp::update_ent_name_index() {
+	namedEnts.clear();
+	callerEnts.clear();
+
+	for (int i = 0; i < ents.size(); i++) {
+		add_ent_names(i, true);
+	}
+}
+
+void Bsp::update_ent_name_index(int entIdx) {
+	if (entIdx < 0 || entIdx >= ents.size()) {
+		return;
+	}
+	add_ent_names(entIdx, false);
+}
+
+void Bsp::add_ent_names(int entIdx, bool rebuilding) {
+	Entity* ent = ents[entIdx];
+
+	const string& tname = ent->getKeyvalue("targetname");
+	if (!tname.empty()) {
+		vector<int>& named = namedEnts[tname];
+		bool isNew = rebuilding ? named.empty() || named.back() != entIdx
+			: find(named.begin(), named.end(), entIdx) == named.end();
+		if (isNew)
+			named.push_back(entIdx);
+	}
+
+	vector<string> targets = ent->getTargets();
+	for (int i = 0; i < targets.size(); i++) {
+		if (targets[i].empty())
+			continue;
+		vector<int>& callers = callerEnts[targets[i]];
+		bool isNew = rebuilding ? callers.empty() || callers.back() != entIdx
+			: find(callers.begin(), callers.end(), entIdx) == callers.end();
+		if (isNew)
+			callers.push_back(entIdx);
+	}
+}
+
+vector<int> Bsp::get_named_ents(const string& name) {
+	vector<int> result;
+
+	auto it = namedEnts.find(name);
+	if (it == namedEnts.end()) {
+		return result;
+	}
+
+	// drop entries for ents that were renamed, removed, or shifted since they were added
+	vector<int>& named = it->second;
+	for (int i = 0; i < named.size(); i++) {
+		int entIdx = named[i];
+		if (entIdx < ents.size() && ents[entIdx]->getKeyvalue("targetname") == name) {
+			result.push_back(entIdx);
+		}
+	}
+	named = result;
+
+	sort(result.begin(), result.end());
+	return result;
+}
+
+vector<int> Bsp::get_caller_ents(const string& name) {
+	vector<int> result;
+
+	auto it = callerEnts.find(name);
+	if (it == callerEnts.end()) {
+		return result;
+	}
+
+	vector<int>& callers = it->second;
+	for (int i = 0; i < callers.size(); i++) {
+		int entIdx = callers[i];
+		if (entIdx < ents.size() && ents[entIdx]->hasTarget(name)) {
+			result.push_back(entIdx);
+		}
+	}
+	callers = result;
+
+	sort(result.begin(), result.end());
+	return result;
+}
+
+void Bsp::update_model_ent_index() {
+	// header count because this runs before the lump pointers are set up when loading
+	int numModels = header.lump[LUMP_MODELS].nLength / sizeof(BSPMODEL);
+
+	modelEnts.clear();
+	modelEnts.resize(numModels);
+
+	for (int i = 0; i < ents.size(); i++) {
+		int modelIdx = ents[i]->getBspModelIdx();
+		if (modelIdx >= 0 && modelIdx < numModels) {
+			modelEnts[modelIdx].push_back(i);
+		}
+	}
+
+	modelEntsDirty = false;
+	modelEntsEntCount = ents.size();
+}
+
+void Bsp::invalidate_model_ent_index() {
+	modelEntsDirty = true;
+}
+
+void Bsp::refresh_model_ent_index() {
+	if (modelEntsDirty || modelEntsEntCount != ents.size() || modelEnts.size() != modelCount) {
+		update_model_ent_index();
+	}
 }
 
 void Bsp::print_stat(string name, uint val, uint max, bool isMem) {
@@ -1961,16 +2290,21 @@ void Bsp::print_stat(string name, uint val, uint max, bool isMem) {
 	print_color(PRINT_RED | PRINT_GREEN | PRINT_BLUE);
 }
 
-void Bsp::print_model_stat(STRUCTUSAGE* modelInfo, uint val, uint max, bool isMem)
-{
-	string classname = modelInfo->modelIdx == 0 ? "worldspawn" : "???";
-	string targetname = modelInfo->modelIdx == 0 ? "" : "???";
-	for (int k = 0; k < ents.size(); k++) {
-		if (ents[k]->getBspModelIdx() == modelInfo->modelIdx) {
-			targetname = ents[k]->keyvalues["targetname"];
-			classname = ents[k]->keyvalues["classname"];
-		}
+void Bsp::get_model_ent_names(int modelIdx, string& classname, string& targetname) {
+	classname = modelIdx == 0 ? "worldspawn" : "???";
+	targetname = modelIdx == 0 ? "" : "???";
+	refresh_model_ent_index();
+	if (modelIdx >= 0 && modelIdx < modelEnts.size() && !modelEnts[modelIdx].empty()) {
+		Entity* ent = ents[modelEnts[modelIdx].back()];
+		targetname = ent->getKeyvalue("targetname");
+		classname = ent->getKeyvalue("classname");
 	}
+}
+
+void Bsp::print_model_stat(MODELUSAGE* modelInfo, uint val, uint max, bool isMem)
+{
+	string classname, targetname;
+	get_model_ent_names(modelInfo->modelIdx, classname, targetname);
 
 	const float meg = 1024 * 1024;
 	float percent = (val / (float)max) * 100;
@@ -1987,36 +2321,72 @@ void Bsp::print_model_stat(STRUCTUSAGE* modelInfo, uint val, uint max, bool isMe
 	logf("\n");
 }
 
-bool sortModelInfos(const STRUCTUSAGE* a, const STRUCTUSAGE* b) {
+bool sortModelInfos(const MODELUSAGE& a, const MODELUSAGE& b) {
 	switch (g_sort_mode) {
 	case SORT_VERTS:
-		return a->sum.verts > b->sum.verts;
+		return a.sum.verts > b.sum.verts;
 	case SORT_NODES:
-		return a->sum.nodes > b->sum.nodes;
+		return a.sum.nodes > b.sum.nodes;
 	case SORT_CLIPNODES:
-		return a->sum.clipnodes > b->sum.clipnodes;
+		return a.sum.clipnodes > b.sum.clipnodes;
 	case SORT_FACES:
-		return a->sum.faces > b->sum.faces;
+		return a.sum.faces > b.sum.faces;
 	}
+	return false;
 }
 
-bool Bsp::isValid() {
-	return modelCount < MAX_MAP_MODELS
-		&& planeCount < MAX_MAP_PLANES
-		&& vertCount < MAX_MAP_VERTS
-		&& nodeCount < MAX_MAP_NODES
-		&& texinfoCount < MAX_MAP_TEXINFOS
-		&& faceCount < MAX_MAP_FACES
-		&& clipnodeCount < MAX_MAP_CLIPNODES
-		&& leafCount < MAX_MAP_LEAVES
-		&& marksurfCount < MAX_MAP_MARKSURFS
-		&& surfedgeCount < MAX_MAP_SURFEDGES
-		&& edgeCount < MAX_MAP_SURFEDGES
-		&& textureCount < MAX_MAP_TEXTURES
-		&& lightDataLength < MAX_MAP_LIGHTDATA
-		&& visDataLength < MAX_MAP_VISDATA
-		&& ents.size() < MAX_MAP_ENTS;
+vector<LIMITSTAT> get_limit_stats(const STRUCTCOUNT& count, int entCount) {
+	LIMITSTAT stats[] = {
+		{"models", (uint)count.models, MAX_MAP_MODELS, false},
+		{"planes", (uint)count.planes, MAX_MAP_PLANES, false},
+		{"vertexes", (uint)count.verts, MAX_MAP_VERTS, false},
+		{"nodes", (uint)count.nodes, MAX_MAP_NODES, false},
+		{"texinfos", (uint)count.texInfos, MAX_MAP_TEXINFOS, false},
+		{"faces", (uint)count.faces, MAX_MAP_FACES, false},
+		{"clipnodes", (uint)count.clipnodes, MAX_MAP_CLIPNODES, false},
+		{"leaves", (uint)count.leaves, MAX_MAP_LEAVES, false},
+		{"marksurfaces", (uint)count.markSurfs, MAX_MAP_MARKSURFS, false},
+		{"surfedges", (uint)count.surfEdges, MAX_MAP_SURFEDGES, false},
+		{"edges", (uint)count.edges, MAX_MAP_EDGES, false},
+		{"textures", (uint)count.textures, MAX_MAP_TEXTURES, false},
+		{"lightdata", (uint)count.lightdata, MAX_MAP_LIGHTDATA, true},
+		{"visdata", (uint)count.visdata, MAX_MAP_VISDATA, true},
+		{"entities", (uint)entCount, MAX_MAP_ENTS, false},
+	};
+	return vector<LIMITSTAT>(stats, stats + sizeof(stats) / sizeof(LIMITSTAT));
+}
 
+int find_overflowed_limit(const vector<LIMITSTAT>& stats) {
+	for (int i = 0; i < stats.size(); i++) {
+		if (stats[i].val >= stats[i].max) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+vector<LIMITSTAT> Bsp::get_limit_stats() {
+	STRUCTCOUNT count;
+	count.models = modelCount;
+	count.planes = planeCount;
+	count.verts = vertCount;
+	count.nodes = nodeCount;
+	count.texInfos = texinfoCount;
+	count.faces = faceCount;
+	count.clipnodes = clipnodeCount;
+	count.leaves = leafCount;
+	count.markSurfs = marksurfCount;
+	count.surfEdges = surfedgeCount;
+	count.edges = edgeCount;
+	count.textures = textureCount;
+	count.lightdata = lightDataLength;
+	count.visdata = visDataLength;
+
+	return ::get_limit_stats(count, ents.size());
+}
+
+bool Bsp::isValid() {
+	return find_overflowed_limit(get_limit_stats()) == -1;
 }
 
 bool Bsp::validate() {
@@ -2127,7 +2497,11 @@ bool Bsp::validate() {
 			logf("Bad face reference in model %d: %d / %d\n", i, models[i].iFirstFace, faceCount);
 			isValid = false;
 		}
-		for (int k = 0; k < MAX_MAP_HULLS; k++) {
+		if (models[i].iHeadnodes[0] >= nodeCount) {
+			logf("Bad node reference in model %d hull 0: %d / %d\n", i, models[i].iHeadnodes[0], nodeCount);
+			isValid = false;
+		}
+		for (int k = 1; k < MAX_MAP_HULLS; k++) {
 			if (models[i].iHeadnodes[k] >= clipnodeCount) {
 				logf("Bad clipnode reference in model %d hull %d: %d / %d\n", i, k, models[i].iHeadnodes[k], clipnodeCount);
 				isValid = false;
@@ -2154,15 +2528,19 @@ bool Bsp::validate() {
 	return isValid;
 }
 
-vector<STRUCTUSAGE*> Bsp::get_sorted_model_infos(int sortMode) {
-	vector<STRUCTUSAGE*> modelStructs;
+vector<MODELUSAGE> Bsp::get_sorted_model_infos(int sortMode) {
+	vector<MODELUSAGE> modelStructs;
 	modelStructs.resize(modelCount);
 
+	// one usage is reused for every model. Marking, counting, and clearing only touch the words a
+	// model uses, so this doesn't scale with the size of the whole map for each model.
+	STRUCTUSAGE usage(this);
 	for (int i = 0; i < modelCount; i++) {
-		modelStructs[i] = new STRUCTUSAGE(this);
-		modelStructs[i]->modelIdx = i;
-		mark_model_structures(i, modelStructs[i], false);
-		modelStructs[i]->compute_sum();
+		mark_model_structures(i, &usage, false);
+		usage.compute_sum();
+		modelStructs[i].modelIdx = i;
+		modelStructs[i].sum = usage.sum;
+		usage.clear();
 	}
 
 	g_sort_mode = sortMode;
@@ -2172,22 +2550,17 @@ vector<STRUCTUSAGE*> Bsp::get_sorted_model_infos(int sortMode) {
 }
 
 void Bsp::print_info(bool perModelStats, int perModelLimit, int sortMode) {
-	int entCount = ents.size();
-
 	if (perModelStats) {
 		g_sort_mode = sortMode;
 
-		if (planeCount >= MAX_MAP_PLANES || texinfoCount >= MAX_MAP_TEXINFOS || leafCount >= MAX_MAP_LEAVES ||
-			modelCount >= MAX_MAP_MODELS || nodeCount >= MAX_MAP_NODES || vertCount >= MAX_MAP_VERTS ||
-			faceCount >= MAX_MAP_FACES || clipnodeCount >= MAX_MAP_CLIPNODES || marksurfCount >= MAX_MAP_MARKSURFS ||
-			surfedgeCount >= MAX_MAP_SURFEDGES || edgeCount >= MAX_MAP_EDGES || textureCount >= MAX_MAP_TEXTURES ||
-			lightDataLength >= MAX_MAP_LIGHTDATA || visDataLength >= MAX_MAP_VISDATA) 
+		if (find_overflowed_limit(get_limit_stats()) != -1)
 		{
 			logf("Unable to show model stats while BSP limits are exceeded.\n");
 			return;
 		}
 
-		vector<STRUCTUSAGE*> modelStructs = get_sorted_model_infos(sortMode);
+		vector<MODELUSAGE> modelStructs = get_sorted_model_infos(sortMode);
+		update_model_ent_index();
 
 		int maxCount;
 		char* countName;
@@ -2206,37 +2579,91 @@ void Bsp::print_info(bool perModelStats, int perModelLimit, int sortMode) {
 
 			int val;
 			switch (g_sort_mode) {
-			case SORT_VERTS:		val = modelStructs[i]->sum.verts; break;
-			case SORT_NODES:		val = modelStructs[i]->sum.nodes; break;
-			case SORT_CLIPNODES:	val = modelStructs[i]->sum.clipnodes; break;
-			case SORT_FACES:		val = modelStructs[i]->sum.faces; break;
+			case SORT_VERTS:		val = modelStructs[i].sum.verts; break;
+			case SORT_NODES:		val = modelStructs[i].sum.nodes; break;
+			case SORT_CLIPNODES:	val = modelStructs[i].sum.clipnodes; break;
+			case SORT_FACES:		val = modelStructs[i].sum.faces; break;
 			}
 
 			if (val == 0)
 				break;
 
-			print_model_stat(modelStructs[i], val, maxCount, false);
+			print_model_stat(&modelStructs[i], val, maxCount, false);
 		}
 	}
 	else {
 		logf(" Data Type     Current / Max       Fullness\n");
 		logf("------------  -------------------  --------\n");
-		print_stat("models", modelCount, MAX_MAP_MODELS, false);
-		print_stat("planes", planeCount, MAX_MAP_PLANES, false);
-		print_stat("vertexes", vertCount, MAX_MAP_VERTS, false);
-		print_stat("nodes", nodeCount, MAX_MAP_NODES, false);
-		print_stat("texinfos", texinfoCount, MAX_MAP_TEXINFOS, false);
-		print_stat("faces", faceCount, MAX_MAP_FACES, false);
-		print_stat("clipnodes", clipnodeCount, MAX_MAP_CLIPNODES, false);
-		print_stat("leaves", leafCount, MAX_MAP_LEAVES, false);
-		print_stat("marksurfaces", marksurfCount, MAX_MAP_MARKSURFS, false);
-		print_stat("surfedges", surfedgeCount, MAX_MAP_SURFEDGES, false);
-		print_stat("edges", edgeCount, MAX_MAP_SURFEDGES, false);
-		print_stat("textures", textureCount, MAX_MAP_TEXTURES, false);
-		print_stat("lightdata", lightDataLength, MAX_MAP_LIGHTDATA, true);
-		print_stat("visdata", visDataLength, MAX_MAP_VISDATA, true);
-		print_stat("entities", entCount, MAX_MAP_ENTS, false);
+		vector<LIMITSTAT> stats = get_limit_stats();
+		for (int i = 0; i < stats.size(); i++) {
+			print_stat(stats[i].name, stats[i].val, stats[i].max, stats[i].isMem);
+		}
+	}
+}
+
+void Bsp::print_info_json(int sortMode, double loadTime, const string& warnings) {
+	auto analysisStart = chrono::steady_clock::now();
+
+	// model stats can't be calculated for maps that overflow (see print_info)
+	vector<LIMITSTAT> limits = get_limit_stats();
+	bool overflow = find_overflowed_limit(limits) != -1;
+
+	vector<MODELUSAGE> modelInfos;
+	if (!overflow) {
+		modelInfos = get_sorted_model_infos(sortMode);
+	}
+	update_model_ent_index();
+
+	double analysisTime = chrono::duration<double, milli>(chrono::steady_clock::now() - analysisStart).count();
+
+	string json = "{\n";
+	appendf(json, "  \"file\": \"%s\",\n", escapeJson(path).c_str());
+	appendf(json, "  \"version\": %d,\n", header.nVersion);
+	appendf(json, "  \"load_ms\": %.3f,\n", loadTime);
+	appendf(json, "  \"analysis_ms\": %.3f,\n", analysisTime);
+
+	json += "  \"lumps\": [\n";
+	for (int i = 0; i < HEADER_LUMPS; i++) {
+		appendf(json, "    {\"name\": \"%s\", \"offset\": %d, \"length\": %d}%s\n", g_lump_names[i],
+			header.lump[i].nOffset, header.lump[i].nLength, i < HEADER_LUMPS - 1 ? "," : "");
+	}
+	json += "  ],\n";
+
+	int limitCount = limits.size();
+
+	json += "  \"limits\": {\n";
+	for (int i = 0; i < limitCount; i++) {
+		appendf(json, "    \"%s\": {\"count\": %u, \"max\": %u, \"percent\": %.2f}%s\n", limits[i].name,
+			limits[i].val, limits[i].max, (limits[i].val / (float)limits[i].max) * 100, i < limitCount - 1 ? "," : "");
+	}
+	json += "  },\n";
+	appendf(json, "  \"overflow\": %s,\n", overflow ? "true" : "false");
+
+	vector<string> warningLines = splitString(warnings, "\r\n");
+	json += "  \"warnings\": [";
+	for (int i = 0; i < warningLines.size(); i++) {
+		appendf(json, "%s\"%s\"", i ? ", " : "", escapeJson(trimSpaces(warningLines[i])).c_str());
 	}
+	json += "],\n";
+
+	json += "  \"models\": [\n";
+	for (int i = 0; i < modelInfos.size(); i++) {
+		MODELUSAGE& info = modelInfos[i];
+		STRUCTCOUNT& sum = info.sum;
+		string classname, targetname;
+		get_model_ent_names(info.modelIdx, classname, targetname);
+
+		appendf(json, "    {\"model\": %d, \"classname\": \"%s\", \"targetname\": \"%s\", ",
+			info.modelIdx, escapeJson(classname).c_str(), escapeJson(targetname).c_str());
+		appendf(json, "\"planes\": %d, \"texinfos\": %d, \"leaves\": %d, \"nodes\": %d, \"clipnodes\": %d, "
+			"\"vertexes\": %d, \"faces\": %d, \"textures\": %d, \"marksurfaces\": %d, \"surfedges\": %d, \"edges\": %d}%s\n",
+			sum.planes, sum.texInfos, sum.leaves, sum.nodes, sum.clipnodes, sum.verts, sum.faces, sum.textures,
+			sum.markSurfs, sum.surfEdges, sum.edges, i < modelInfos.size() - 1 ? "," : "");
+	}
+	json += "  ]\n";
+	json += "}\n";
+
+	printLogBlock(json);
 }
 
 void Bsp::print_model_bsp(int modelIdx) {
@@ -2288,24 +2715,33 @@ void Bsp::print_model_hull(int modelIdx, int hull_number) {
 }
 
 string Bsp::get_model_usage(int modelIdx) {
-	for (int i = 0; i < ents.size(); i++) {
-		if (ents[i]->getBspModelIdx() == modelIdx) {
-			return "\"" + ents[i]->keyvalues["targetname"] + "\" (" + ents[i]->keyvalues["classname"] + ")";
-		}
+	refresh_model_ent_index();
+	if (modelIdx >= 0 && modelIdx < modelEnts.size() && !modelEnts[modelIdx].empty()) {
+		Entity* ent = ents[modelEnts[modelIdx][0]];
+		return "\"" + ent->getKeyvalue("targetname") + "\" (" + ent->getKeyvalue("classname") + ")";
 	}
 	return "(unused)";
 }
 
 vector<Entity*> Bsp::get_model_ents(int modelIdx) {
 	vector<Entity*> uses;
-	for (int i = 0; i < ents.size(); i++) {
-		if (ents[i]->getBspModelIdx() == modelIdx) {
-			uses.push_back(ents[i]);
+	refresh_model_ent_index();
+	if (modelIdx >= 0 && modelIdx < modelEnts.size()) {
+		for (int i = 0; i < modelEnts[modelIdx].size(); i++) {
+			uses.push_back(ents[modelEnts[modelIdx][i]]);
 		}
 	}
 	return uses;
 }
 
+vector<int> Bsp::get_model_ent_indexes(int modelIdx) {
+	refresh_model_ent_index();
+	if (modelIdx >= 0 && modelIdx < modelEnts.size()) {
+		return modelEnts[modelIdx];
+	}
+	return vector<int>();
+}
+
 void Bsp::recurse_node(int16_t nodeIdx, int depth) {
 	for (int i = 0; i < depth; i++) {
 		logf("    ");
@@ -2393,6 +2829,212 @@ int32_t Bsp::pointContents(int iNode, vec3 p, int hull) {
 	return pointContents(iNode, p, hull, nodeBranch, leafIdx, childIdx);
 }
 
+int Bsp::traceRay(int modelIdx, vec3 start, vec3 dir, float& maxDist) {
+	if (modelIdx < 0 || modelIdx >= modelCount) {
+		return -1;
+	}
+
+	float hitDist = maxDist;
+	int faceIdx = trace_ray_node(models[modelIdx].iHeadnodes[0], start, dir, 0, maxDist, hitDist);
+	if (faceIdx != -1) {
+		maxDist = hitDist;
+	}
+
+	return faceIdx;
+}
+
+int Bsp::trace_ray_node(int iNode, vec3 start, vec3 dir, float startDist, float endDist, float& hitDist) {
+	if (iNode < 0) {
+		return -1;
+	}
+
+	BSPNODE& node = nodes[iNode];
+	BSPPLANE& plane = planes[node.iPlane];
+
+	float dStart = dotProduct(plane.vNormal, start) - plane.fDist;
+	float dDir = dotProduct(plane.vNormal, dir);
+	float d1 = dStart + dDir * startDist;
+	float d2 = dStart + dDir * endDist;
+
+	if (d1 >= 0 && d2 >= 0) {
+		return trace_ray_node(node.iChildren[0], start, dir, startDist, endDist, hitDist);
+	}
+	if (d1 < 0 && d2 < 0) {
+		return trace_ray_node(node.iChildren[1], start, dir, startDist, endDist, hitDist);
+	}
+
+	// the ray crosses the plane. Check the near side first, then the faces on the plane, then the far side.
+	int nearSide = d1 < 0 ? 1 : 0;
+	float midDist = -dStart / dDir;
+
+	int faceIdx = trace_ray_node(node.iChildren[nearSide], start, dir, startDist, midDist, hitDist);
+	if (faceIdx != -1) {
+		return faceIdx;
+	}
+
+	vec3 mid = start + dir * midDist;
+	for (int i = 0; i < node.nFaces; i++) {
+		int iFace = node.firstFace + i;
+		BSPFACE& face = faces[iFace];
+
+		// faces on the near side of the plane face the ray. The rest are backfaces.
+		if ((face.nPlaneSide != 0) != (nearSide != 0)) {
+			continue;
+		}
+
+		if (is_point_on_face(iFace, mid)) {
+			hitDist = midDist;
+			return iFace;
+		}
+	}
+
+	return trace_ray_node(node.iChildren[nearSide ^ 1], start, dir, midDist, endDist, hitDist);
+}
+
+bool Bsp::is_point_on_face(int faceIdx, vec3 p) {
+	BSPFACE& face = faces[faceIdx];
+	BSPPLANE& plane = planes[face.iPlane];
+
+	// faces are convex, so the point is inside if it's on the same side of every edge
+	bool inFront = false;
+	bool behind = false;
+
+	// only the first vertex of each edge is used to build the polygon (like the engine does)
+	for (int e = 0; e < face.nEdges; e++) {
+		int32_t edgeIdx = surfedges[face.iFirstEdge + e];
+		int32_t nextEdgeIdx = surfedges[face.iFirstEdge + (e + 1) % face.nEdges];
+		BSPEDGE& edge = edges[abs(edgeIdx)];
+		BSPEDGE& nextEdge = edges[abs(nextEdgeIdx)];
+		vec3 v0 = verts[edgeIdx < 0 ? edge.iVertex[1] : edge.iVertex[0]];
+		vec3 v1 = verts[nextEdgeIdx < 0 ? nextEdge.iVertex[1] : nextEdge.iVertex[0]];
+
+		vec3 edgeDir = v1 - v0;
+		float edgeLen = edgeDir.length();
+		if (edgeLen < EPSILON) {
+			continue;
+		}
+
+		float dist = dotProduct(crossProduct(edgeDir, p - v0), plane.vNormal) / edgeLen;
+		if (dist > EPSILON) {
+			inFront = true;
+		}
+		else if (dist < -EPSILON) {
+			behind = true;
+		}
+
+		if (inFront && behind) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool Bsp::traceHull(int modelIdx, int hull, vec3 start, vec3 end, TraceResult& trace) {
+	trace = TraceResult();
+	trace.allSolid = true;
+	trace.fraction = 1.0f;
+	trace.endPos = end;
+
+	if (modelIdx < 0 || modelIdx >= modelCount || hull < 0 || hull >= MAX_MAP_HULLS) {
+		return true;
+	}
+
+	int headnode = models[modelIdx].iHeadnodes[hull];
+	return trace_hull_node(headnode, hull, headnode, 0, 1, start, end, trace);
+}
+
+int32_t Bsp::get_leaf_contents(int iNode, int hull) {
+	if (hull != 0) {
+		return iNode; // clipnode leaves are the contents
+	}
+
+	int leafIdx = ~iNode;
+	return leafIdx < leafCount ? leaves[leafIdx].nContents : CONTENTS_EMPTY;
+}
+
+bool Bsp::trace_hull_node(int headnode, int hull, int iNode, float p1f, float p2f, vec3 p1, vec3 p2, TraceResult& trace) {
+	if (iNode < 0) {
+		if (get_leaf_contents(iNode, hull) == CONTENTS_SOLID) {
+			trace.startSolid = true;
+		}
+		else {
+			trace.allSolid = false;
+		}
+		return true;
+	}
+
+	int iPlane;
+	int children[2];
+	if (hull == 0) {
+		BSPNODE& node = nodes[iNode];
+		iPlane = node.iPlane;
+		children[0] = node.iChildren[0];
+		children[1] = node.iChildren[1];
+	}
+	else {
+		BSPCLIPNODE& node = clipnodes[iNode];
+		iPlane = node.iPlane;
+		children[0] = node.iChildren[0];
+		children[1] = node.iChildren[1];
+	}
+	BSPPLANE& plane = planes[iPlane];
+
+	float t1 = dotProduct(plane.vNormal, p1) - plane.fDist;
+	float t2 = dotProduct(plane.vNormal, p2) - plane.fDist;
+
+	if (t1 >= 0 && t2 >= 0) {
+		return trace_hull_node(headnode, hull, children[0], p1f, p2f, p1, p2, trace);
+	}
+	if (t1 < 0 && t2 < 0) {
+		return trace_hull_node(headnode, hull, children[1], p1f, p2f, p1, p2, trace);
+	}
+
+	// put the crosspoint EPSILON units on the near side
+	float frac = t1 < 0 ? (t1 + EPSILON) / (t1 - t2) : (t1 - EPSILON) / (t1 - t2);
+	frac = clamp(frac, 0.0f, 1.0f);
+
+	float midf = p1f + (p2f - p1f) * frac;
+	vec3 mid = p1 + (p2 - p1) * frac;
+	int side = t1 < 0 ? 1 : 0;
+
+	if (!trace_hull_node(headnode, hull, children[side], p1f, midf, p1, mid, trace)) {
+		return false;
+	}
+
+	int farChild = children[side ^ 1];
+	int32_t farContents = farChild < 0 ? get_leaf_contents(farChild, hull) : pointContents(farChild, mid, hull);
+
+	if (farContents != CONTENTS_SOLID) {
+		return trace_hull_node(headnode, hull, children[side ^ 1], midf, p2f, mid, p2, trace);
+	}
+
+	if (trace.allSolid) {
+		return false; // never got out of the solid area
+	}
+
+	// the other side of the node is solid, so this is where the line stops
+	trace.planeNormal = side ? plane.vNormal * -1 : plane.vNormal;
+	trace.planeDist = side ? -plane.fDist : plane.fDist;
+
+	// back off until the end point is outside of the solid (the crosspoint can land in a
+	// solid leaf on the near side when nodes are nearly parallel)
+	while (pointContents(headnode, mid, hull) == CONTENTS_SOLID) {
+		frac -= 0.1f;
+		if (frac < 0) {
+			trace.fraction = midf;
+			trace.endPos = mid;
+			return false;
+		}
+		midf = p1f + (p2f - p1f) * frac;
+		mid = p1 + (p2 - p1) * frac;
+	}
+
+	trace.fraction = midf;
+	trace.endPos = mid;
+	return false;
+}
+
 const char* Bsp::getLeafContentsName(int32_t contents) {
 	switch (contents) {
 	case CONTENTS_EMPTY:
@@ -2429,59 +3071,93 @@ const char* Bsp::getLeafContentsName(int32_t contents) {
 }
 
 void Bsp::mark_face_structures(int iFace, STRUCTUSAGE* usage) {
+	if (usage->faces.test_and_set(iFace)) {
+		return; // shared by multiple nodes/leaves and already marked
+	}
+
 	BSPFACE& face = faces[iFace];
-	usage->faces[iFace] = true;
 
 	for (int e = 0; e < face.nEdges; e++) {
 		int32_t edgeIdx = surfedges[face.iFirstEdge + e];
 		BSPEDGE& edge = edges[abs(edgeIdx)];
 		int vertIdx = edgeIdx >= 0 ? edge.iVertex[1] : edge.iVertex[0];
 
-		usage->surfEdges[face.iFirstEdge + e] = true;
-		usage->edges[abs(edgeIdx)] = true;
-		usage->verts[vertIdx] = true;
+		usage->surfEdges.set(face.iFirstEdge + e);
+		usage->edges.set(abs(edgeIdx));
+		usage->verts.set(vertIdx);
 	}
 
-	usage->texInfo[face.iTextureInfo] = true;
-	usage->planes[face.iPlane] = true;
-	usage->textures[texinfos[face.iTextureInfo].iMiptex] = true;
+	usage->texInfo.set(face.iTextureInfo);
+	usage->planes.set(face.iPlane);
+	usage->textures.set(texinfos[face.iTextureInfo].iMiptex);
 }
 
 void Bsp::mark_node_structures(int iNode, STRUCTUSAGE* usage, bool skipLeaves) {
-	BSPNODE& node = nodes[iNode];
+	// a marked node had its whole subtree marked already, unless its leaves were skipped back then
+	bool canSkipMarked = skipLeaves || !usage->skippedLeaves;
+	if (skipLeaves) {
+		usage->skippedLeaves = true;
+	}
 
-	usage->nodes[iNode] = true;
-	usage->planes[node.iPlane] = true;
+	vector<int>& stack = markStack;
+	stack.clear();
+	stack.push_back(iNode);
 
-	for (int i = 0; i < node.nFaces; i++) {
-		mark_face_structures(node.firstFace + i, usage);
-	}
+	while (!stack.empty()) {
+		int nodeIdx = stack.back();
+		stack.pop_back();
 
-	for (int i = 0; i < 2; i++) {
-		if (node.iChildren[i] >= 0) {
-			mark_node_structures(node.iChildren[i], usage, skipLeaves);
+		if (usage->nodes.test_and_set(nodeIdx) && canSkipMarked) {
+			continue;
 		}
-		else if (!skipLeaves) {
-			BSPLEAF& leaf = leaves[~node.iChildren[i]];
-			for (int i = 0; i < leaf.nMarkSurfaces; i++) {
-				usage->markSurfs[leaf.iFirstMarkSurface + i] = true;
-				mark_face_structures(marksurfs[leaf.iFirstMarkSurface + i], usage);
+
+		BSPNODE& node = nodes[nodeIdx];
+		usage->planes.set(node.iPlane);
+
+		for (int i = 0; i < node.nFaces; i++) {
+			mark_face_structures(node.firstFace + i, usage);
+		}
+
+		for (int i = 0; i < 2; i++) {
+			if (node.iChildren[i] >= 0) {
+				stack.push_back(node.iChildren[i]);
 			}
+			else if (!skipLeaves) {
+				int leafIdx = ~node.iChildren[i];
+				if (usage->leaves.test_and_set(leafIdx)) {
+					continue;
+				}
 
-			usage->leaves[~node.iChildren[i]] = true;
+				BSPLEAF& leaf = leaves[leafIdx];
+				for (int k = 0; k < leaf.nMarkSurfaces; k++) {
+					usage->markSurfs.set(leaf.iFirstMarkSurface + k);
+					mark_face_structures(marksurfs[leaf.iFirstMarkSurface + k], usage);
+				}
+			}
 		}
 	}
 }
 
 void Bsp::mark_clipnode_structures(int iNode, STRUCTUSAGE* usage) {
-	BSPCLIPNODE& node = clipnodes[iNode];
+	vector<int>& stack = markStack;
+	stack.clear();
+	stack.push_back(iNode);
 
-	usage->clipnodes[iNode] = true;
-	usage->planes[node.iPlane] = true;
+	while (!stack.empty()) {
+		int nodeIdx = stack.back();
+		stack.pop_back();
 
-	for (int i = 0; i < 2; i++) {
-		if (node.iChildren[i] >= 0) {
-			mark_clipnode_structures(node.iChildren[i], usage);
+		if (usage->clipnodes.test_and_set(nodeIdx)) {
+			continue; // subtree already marked (hulls often share clipnodes)
+		}
+
+		BSPCLIPNODE& node = clipnodes[nodeIdx];
+		usage->planes.set(node.iPlane);
+
+		for (int i = 0; i < 2; i++) {
+			if (node.iChildren[i] >= 0) {
+				stack.push_back(node.iChildren[i]);
+			}
 		}
 	}
 }
@@ -2501,6 +3177,38 @@ void Bsp::mark_model_structures(int modelIdx, STRUCTUSAGE* usage, bool skipLeave
 	}
 }
 
+void Bsp::mark_other_model_structures(int modelIdx, STRUCTUSAGE* usage) {
+	if (!anyModelUsage) {
+		anyModelUsage = new STRUCTUSAGE(this);
+		sharedModelUsage = new STRUCTUSAGE(this);
+
+		STRUCTUSAGE modelUsage(this);
+		for (int i = 0; i < modelCount; i++) {
+			mark_model_structures(i, &modelUsage, false);
+			modelUsage.move_into(*anyModelUsage, *sharedModelUsage);
+		}
+	}
+
+	// used by others = used by more than one model, or used by any model but not this one
+	STRUCTUSAGE ownUsage(this);
+	mark_model_structures(modelIdx, &ownUsage, false);
+
+	usage->merge(*sharedModelUsage);
+	usage->merge_missing(*anyModelUsage, ownUsage);
+}
+
+void Bsp::invalidate_model_usage(int lumpIdx) {
+	// these don't change which structures a model references
+	if (lumpIdx == LUMP_ENTITIES || lumpIdx == LUMP_LIGHTING || lumpIdx == LUMP_VISIBILITY) {
+		return;
+	}
+
+	delete anyModelUsage;
+	delete sharedModelUsage;
+	anyModelUsage = NULL;
+	sharedModelUsage = NULL;
+}
+
 void Bsp::remap_face_structures(int faceIdx, STRUCTREMAP* remap) {
 	if (remap->visitedFaces[faceIdx]) {
 		return;
@@ -2576,6 +3284,8 @@ void Bsp::remap_model_structures(int modelIdx, STRUCTREMAP* remap) {
 			}
 		}
 	}
+
+	invalidate_model_usage();
 }
 
 void Bsp::delete_hull(int hull_number, int redirect) {
@@ -2630,31 +3340,65 @@ void Bsp::delete_hull(int hull_number, int modelIdx, int redirect) {
 	}
 	else {
 		model.iHeadnodes[hull_number] = CONTENTS_EMPTY;
-	}	
+	}
+
+	invalidate_model_usage();
 }
 
 void Bsp::delete_model(int modelIdx) {
-	byte* oldModels = (byte*)models;
+	vector<bool> shouldDelete(modelCount, false);
+	shouldDelete[modelIdx] = true;
+	delete_models(shouldDelete);
+}
 
-	int newSize = (modelCount - 1) * sizeof(BSPMODEL);
-	byte* newModels = new byte[newSize];
+void Bsp::delete_models(const vector<bool>& shouldDelete) {
+	int oldCount = modelCount;
 
-	memcpy(newModels, oldModels, modelIdx * sizeof(BSPMODEL));
-	memcpy(newModels + modelIdx * sizeof(BSPMODEL), 
-		   oldModels + (modelIdx+1) * sizeof(BSPMODEL), 
-		   (modelCount - (modelIdx+1))*sizeof(BSPMODEL));
+	// old model index -> new model index, or -1 if deleted
+	vector<int> newModelIdx(oldCount);
+	int newCount = 0;
+	for (int i = 0; i < oldCount; i++) {
+		newModelIdx[i] = shouldDelete[i] ? -1 : newCount++;
+	}
 
-	replace_lump(LUMP_MODELS, newModels, newSize);
+	if (newCount == oldCount) {
+		return;
+	}
+
+	byte* newModels = new byte[newCount * sizeof(BSPMODEL)];
+	for (int i = 0; i < oldCount; i++) {
+		if (newModelIdx[i] != -1) {
+			memcpy(newModels + newModelIdx[i] * sizeof(BSPMODEL), &models[i], sizeof(BSPMODEL));
+		}
+	}
+
+	replace_lump(LUMP_MODELS, newModels, newCount * sizeof(BSPMODEL));
 
 	// update model index references
 	for (int i = 0; i < ents.size(); i++) {
 		int entModel = ents[i]->getBspModelIdx();
-		if (entModel == modelIdx) {
+		if (entModel < 0) {
+			continue;
+		}
+		if (entModel >= oldCount) {
+			ents[i]->setOrAddKeyvalue("model", "*" + to_string(entModel - (oldCount - newCount)));
+		}
+		else if (newModelIdx[entModel] == -1) {
 			ents[i]->setOrAddKeyvalue("model", "error.mdl");
 		}
-		else if (entModel > modelIdx) {
-			ents[i]->setOrAddKeyvalue("model", "*" + to_string(entModel - 1));
+		else if (newModelIdx[entModel] != entModel) {
+			ents[i]->setOrAddKeyvalue("model", "*" + to_string(newModelIdx[entModel]));
+		}
+	}
+
+	// ents were renumbered the same way, so the index only loses the deleted models' entries
+	if (!modelEntsDirty && modelEnts.size() == oldCount) {
+		for (int i = 0; i < oldCount; i++) {
+			if (newModelIdx[i] != -1 && newModelIdx[i] != i) {
+				modelEnts[newModelIdx[i]].swap(modelEnts[i]);
+			}
 		}
+		modelEnts.resize(newCount);
 	}
 }
 
@@ -2764,7 +3508,7 @@ int Bsp::add_texture(const char* name, byte* data, int width, int height) {
 
 	int newTexLumpSize = header.lump[LUMP_TEXTURES].nLength + sizeof(int32_t) + sizeof(BSPMIPTEX) + texDataSize;
 	byte* newTexData = new byte[newTexLumpSize];
-	memset(newTexData, 0, sizeof(newTexLumpSize));
+	memset(newTexData, 0, newTexLumpSize);
 
 	// create new texture lump header
 	int32_t* newLumpHeader = (int32_t*)newTexData;
@@ -2799,6 +3543,7 @@ int Bsp::add_texture(const char* name, byte* data, int width, int height) {
 	memcpy(newTexData + newTexOffset + newMipTex->nOffsets[1], mip[1], (width >> 1) * (height >> 1));
 	memcpy(newTexData + newTexOffset + newMipTex->nOffsets[2], mip[2], (width >> 2) * (height >> 2));
 	memcpy(newTexData + newTexOffset + newMipTex->nOffsets[3], mip[3], (width >> 3) * (height >> 3));
+	*(int16_t*)(newTexData + newTexOffset + palleteOffset - 2) = 256; // palette color count
 	memcpy(newTexData + newTexOffset + palleteOffset, palette, sizeof(COLOR3)*256);
 
 	for (int i = 0; i < MIPLEVELS; i++) {
@@ -2811,19 +3556,14 @@ int Bsp::add_texture(const char* name, byte* data, int width, int height) {
 }
 
 int Bsp::create_leaf(int contents) {
-	BSPLEAF* newLeaves = new BSPLEAF[leafCount + 1];
-	memcpy(newLeaves, leaves, leafCount * sizeof(BSPLEAF));
+	int newLeafIdx = leafCount;
 
-	BSPLEAF& newLeaf = newLeaves[leafCount];
+	BSPLEAF& newLeaf = *(BSPLEAF*)grow_lump(LUMP_LEAVES, sizeof(BSPLEAF));
 	memset(&newLeaf, 0, sizeof(BSPLEAF));
 
 	newLeaf.nVisOffset = -1;
 	newLeaf.nContents = contents;
 
-	int newLeafIdx = leafCount;
-
-	replace_lump(LUMP_LEAVES, newLeaves, (leafCount+1) * sizeof(BSPLEAF));
-
 	return newLeafIdx;
 }
 
@@ -2833,92 +3573,79 @@ void Bsp::create_node_box(vec3 min, vec3 max, BSPMODEL* targetModel, int texture
 	// TODO: subdivide faces to prevent max surface extents error
 	int startVert = vertCount;
 	{
-		vec3* newVerts = new vec3[vertCount + 8];
-		memcpy(newVerts, verts, vertCount * sizeof(vec3));
-
-		newVerts[vertCount + 0] = vec3(min.x, min.y, min.z); // front-left-bottom
-		newVerts[vertCount + 1] = vec3(max.x, min.y, min.z); // front-right-bottom
-		newVerts[vertCount + 2] = vec3(max.x, max.y, min.z); // back-right-bottom
-		newVerts[vertCount + 3] = vec3(min.x, max.y, min.z); // back-left-bottom
+		vec3* newVerts = (vec3*)grow_lump(LUMP_VERTICES, 8 * sizeof(vec3));
 
-		newVerts[vertCount + 4] = vec3(min.x, min.y, max.z); // front-left-top
-		newVerts[vertCount + 5] = vec3(max.x, min.y, max.z); // front-right-top
-		newVerts[vertCount + 6] = vec3(max.x, max.y, max.z); // back-right-top
-		newVerts[vertCount + 7] = vec3(min.x, max.y, max.z); // back-left-top
+		newVerts[0] = vec3(min.x, min.y, min.z); // front-left-bottom
+		newVerts[1] = vec3(max.x, min.y, min.z); // front-right-bottom
+		newVerts[2] = vec3(max.x, max.y, min.z); // back-right-bottom
+		newVerts[3] = vec3(min.x, max.y, min.z); // back-left-bottom
 
-		replace_lump(LUMP_VERTICES, newVerts, (vertCount + 8) * sizeof(vec3));
+		newVerts[4] = vec3(min.x, min.y, max.z); // front-left-top
+		newVerts[5] = vec3(max.x, min.y, max.z); // front-right-top
+		newVerts[6] = vec3(max.x, max.y, max.z); // back-right-top
+		newVerts[7] = vec3(min.x, max.y, max.z); // back-left-top
 	}
 
 	// add new edges (4 for each face)
 	// TODO: subdivide >512
 	int startEdge = edgeCount;
 	{
-		BSPEDGE* newEdges = new BSPEDGE[edgeCount + 12];
-		memcpy(newEdges, edges, edgeCount * sizeof(BSPEDGE));
+		BSPEDGE* newEdges = (BSPEDGE*)grow_lump(LUMP_EDGES, 12 * sizeof(BSPEDGE));
 
 		// left
-		newEdges[startEdge + 0] = BSPEDGE(startVert + 3, startVert + 0);
-		newEdges[startEdge + 1] = BSPEDGE(startVert + 4, startVert + 7);
+		newEdges[0] = BSPEDGE(startVert + 3, startVert + 0);
+		newEdges[1] = BSPEDGE(startVert + 4, startVert + 7);
 
 		// right
-		newEdges[startEdge + 2] = BSPEDGE(startVert + 1, startVert + 2); // bottom edge
-		newEdges[startEdge + 3] = BSPEDGE(startVert + 6, startVert + 5); // right edge
+		newEdges[2] = BSPEDGE(startVert + 1, startVert + 2); // bottom edge
+		newEdges[3] = BSPEDGE(startVert + 6, startVert + 5); // right edge
 
 		// front
-		newEdges[startEdge + 4] = BSPEDGE(startVert + 0, startVert + 1); // bottom edge
-		newEdges[startEdge + 5] = BSPEDGE(startVert + 5, startVert + 4); // top edge
+		newEdges[4] = BSPEDGE(startVert + 0, startVert + 1); // bottom edge
+		newEdges[5] = BSPEDGE(startVert + 5, startVert + 4); // top edge
 
 		// back
-		newEdges[startEdge + 6] = BSPEDGE(startVert + 3, startVert + 7); // left edge
-		newEdges[startEdge + 7] = BSPEDGE(startVert + 6, startVert + 2); // right edge
+		newEdges[6] = BSPEDGE(startVert + 3, startVert + 7); // left edge
+		newEdges[7] = BSPEDGE(startVert + 6, startVert + 2); // right edge
 
 		// bottom
-		newEdges[startEdge + 8] = BSPEDGE(startVert + 3, startVert + 2);
-		newEdges[startEdge + 9] = BSPEDGE(startVert + 1, startVert + 0);
+		newEdges[8] = BSPEDGE(startVert + 3, startVert + 2);
+		newEdges[9] = BSPEDGE(startVert + 1, startVert + 0);
 
 		// top
-		newEdges[startEdge + 10] = BSPEDGE(startVert + 7, startVert + 4);
-		newEdges[startEdge + 11] = BSPEDGE(startVert + 5, startVert + 6);
-
-		replace_lump(LUMP_EDGES, newEdges, (edgeCount + 12) * sizeof(BSPEDGE));
+		newEdges[10] = BSPEDGE(startVert + 7, startVert + 4);
+		newEdges[11] = BSPEDGE(startVert + 5, startVert + 6);
 	}
 
 	// add new surfedges (2 for each edge)
 	int startSurfedge = surfedgeCount;
 	{
-		int32_t* newSurfedges = new int32_t[surfedgeCount + 24];
-		memcpy(newSurfedges, surfedges, surfedgeCount * sizeof(int32_t));
+		int32_t* newSurfedges = (int32_t*)grow_lump(LUMP_SURFEDGES, 24 * sizeof(int32_t));
 
 		// reverse cuz i fucked the edge order and I don't wanna redo
 		for (int i = 12-1; i >= 0; i--) {
 			int32_t edgeIdx = startEdge + i;
-			newSurfedges[startSurfedge + (i*2)] = -edgeIdx; // negative = use second vertex in edge
-			newSurfedges[startSurfedge + (i*2) + 1] = edgeIdx;
+			newSurfedges[(i*2)] = -edgeIdx; // negative = use second vertex in edge
+			newSurfedges[(i*2) + 1] = edgeIdx;
 		}
-		
-		replace_lump(LUMP_SURFEDGES, newSurfedges, (surfedgeCount + 24) * sizeof(int32_t));
 	}
 
 	// add new planes (1 for each face/node)
 	int startPlane = planeCount;
 	{
-		BSPPLANE* newPlanes = new BSPPLANE[planeCount + 6];
-		memcpy(newPlanes, planes, planeCount * sizeof(BSPPLANE));
+		BSPPLANE* newPlanes = (BSPPLANE*)grow_lump(LUMP_PLANES, 6 * sizeof(BSPPLANE));
 
-		newPlanes[startPlane + 0] = { vec3(1, 0, 0), min.x, PLANE_X }; // left
-		newPlanes[startPlane + 1] = { vec3(1, 0, 0), max.x, PLANE_X }; // right
-		newPlanes[startPlane + 2] = { vec3(0, 1, 0), min.y, PLANE_Y }; // front
-		newPlanes[startPlane + 3] = { vec3(0, 1, 0), max.y, PLANE_Y }; // back
-		newPlanes[startPlane + 4] = { vec3(0, 0, 1), min.z, PLANE_Z }; // bottom
-		newPlanes[startPlane + 5] = { vec3(0, 0, 1), max.z, PLANE_Z }; // top
-
-		replace_lump(LUMP_PLANES, newPlanes, (planeCount + 6) * sizeof(BSPPLANE));
+		newPlanes[0] = { vec3(1, 0, 0), min.x, PLANE_X }; // left
+		newPlanes[1] = { vec3(1, 0, 0), max.x, PLANE_X }; // right
+		newPlanes[2] = { vec3(0, 1, 0), min.y, PLANE_Y }; // front
+		newPlanes[3] = { vec3(0, 1, 0), max.y, PLANE_Y }; // back
+		newPlanes[4] = { vec3(0, 0, 1), min.z, PLANE_Z }; // bottom
+		newPlanes[5] = { vec3(0, 0, 1), max.z, PLANE_Z }; // top
 	}
 
 	int startTexinfo = texinfoCount;
 	{
-		BSPTEXTUREINFO* newTexinfos = new BSPTEXTUREINFO[texinfoCount + 6];
-		memcpy(newTexinfos, texinfos, texinfoCount * sizeof(BSPTEXTUREINFO));
+		BSPTEXTUREINFO* newTexinfos = (BSPTEXTUREINFO*)grow_lump(LUMP_TEXINFO, 6 * sizeof(BSPTEXTUREINFO));
 
 		vec3 up = vec3(0, 0, 1);
 		vec3 right = vec3(1, 0, 0);
@@ -2942,7 +3669,7 @@ void Bsp::create_node_box(vec3 min, vec3 max, BSPMODEL* targetModel, int texture
 		};
 
 		for (int i = 0; i < 6; i++) {
-			BSPTEXTUREINFO& info = newTexinfos[startTexinfo + i];
+			BSPTEXTUREINFO& info = newTexinfos[i];
 			info.iMiptex = textureIdx;
 			info.nFlags = TEX_SPECIAL;
 			info.shiftS = 0;
@@ -2951,18 +3678,15 @@ void Bsp::create_node_box(vec3 min, vec3 max, BSPMODEL* targetModel, int texture
 			info.vS = crossProduct(faceUp[i], faceNormals[i]);
 			// TODO: fit texture to face
 		}
-
-		replace_lump(LUMP_TEXINFO, newTexinfos, (texinfoCount + 6) * sizeof(BSPTEXTUREINFO));
 	}
 
 	// add new faces
 	int startFace = faceCount;
 	{
-		BSPFACE* newFaces = new BSPFACE[faceCount + 6];
-		memcpy(newFaces, faces, faceCount * sizeof(BSPFACE));
+		BSPFACE* newFaces = (BSPFACE*)grow_lump(LUMP_FACES, 6 * sizeof(BSPFACE));
 
 		for (int i = 0; i < 6; i++) {
-			BSPFACE& face = newFaces[faceCount + i];
+			BSPFACE& face = newFaces[i];
 			face.iFirstEdge = startSurfedge + i * 4;
 			face.iPlane = startPlane + i;
 			face.nEdges = 4;
@@ -2971,8 +3695,6 @@ void Bsp::create_node_box(vec3 min, vec3 max, BSPMODEL* targetModel, int texture
 			face.nLightmapOffset = 0; // TODO: Lighting
 			memset(face.nStyles, 255, 4);
 		}
-
-		replace_lump(LUMP_FACES, newFaces, (faceCount + 6) * sizeof(BSPFACE));
 	}
 
 	// Submodels don't use leaves like the world does. Everything except nContents is ignored.
@@ -3001,13 +3723,10 @@ void Bsp::create_node_box(vec3 min, vec3 max, BSPMODEL* targetModel, int texture
 	// add new nodes
 	int startNode = nodeCount;
 	{
-		BSPNODE* newNodes = new BSPNODE[nodeCount + 6];
-		memcpy(newNodes, nodes, nodeCount * sizeof(BSPNODE));
-
-		int16 nodeIdx = nodeCount;
+		BSPNODE* newNodes = (BSPNODE*)grow_lump(LUMP_NODES, 6 * sizeof(BSPNODE));
 
 		for (int k = 0; k < 6; k++) {
-			BSPNODE& node = newNodes[nodeCount + k];
+			BSPNODE& node = newNodes[k];
 			memset(&node, 0, sizeof(BSPNODE));
 
 			node.firstFace = startFace + k; // face required for decals
@@ -3015,7 +3734,7 @@ void Bsp::create_node_box(vec3 min, vec3 max, BSPMODEL* targetModel, int texture
 			node.iPlane = startPlane + k;
 			// node mins/maxs don't matter for submodels. Leave them at 0.
 
-			int16 insideContents = k == 5 ? ~sharedSolidLeaf : (int16)(nodeCount + k+1);
+			int16 insideContents = k == 5 ? ~sharedSolidLeaf : (int16)(startNode + k+1);
 			int16 outsideContents = ~anyEmptyLeaf;
 
 			// can't have negative normals on planes so children are swapped instead
@@ -3028,8 +3747,6 @@ void Bsp::create_node_box(vec3 min, vec3 max, BSPMODEL* targetModel, int texture
 				node.iChildren[1] = insideContents;
 			}
 		}
-
-		replace_lump(LUMP_NODES, newNodes, (nodeCount + 6) * sizeof(BSPNODE));
 	}
 
 	targetModel->iHeadnodes[0] = startNode;
@@ -3056,15 +3773,12 @@ void Bsp::create_nodes(Solid& solid, BSPMODEL* targetModel) {
 	vector<int> newVertIndexes;
 	int startVert = vertCount;
 	{
-		vec3* newVerts = new vec3[vertCount + solid.hullVerts.size()];
-		memcpy(newVerts, verts, vertCount * sizeof(vec3));
+		vec3* newVerts = (vec3*)grow_lump(LUMP_VERTICES, solid.hullVerts.size() * sizeof(vec3));
 
 		for (int i = 0; i < solid.hullVerts.size(); i++) {
-			newVerts[vertCount + i] = solid.hullVerts[i].pos;
-			newVertIndexes.push_back(vertCount + i);
+			newVerts[i] = solid.hullVerts[i].pos;
+			newVertIndexes.push_back(startVert + i);
 		}
-
-		replace_lump(LUMP_VERTICES, newVerts, (vertCount + solid.hullVerts.size()) * sizeof(vec3));
 	}
 
 	// add new edges (not actually edges - just an indirection layer for the verts)
@@ -3074,14 +3788,13 @@ void Bsp::create_nodes(Solid& solid, BSPMODEL* targetModel) {
 	{
 		int addEdges = (solid.hullVerts.size() + 1) / 2;
 
-		BSPEDGE* newEdges = new BSPEDGE[edgeCount + addEdges];
-		memcpy(newEdges, edges, edgeCount * sizeof(BSPEDGE));
+		BSPEDGE* newEdges = (BSPEDGE*)grow_lump(LUMP_EDGES, addEdges * sizeof(BSPEDGE));
 
 		int idx = 0;
 		for (int i = 0; i < solid.hullVerts.size(); i += 2) {
 			int v0 = i;
 			int v1 = (i+1) % solid.hullVerts.size();
-			newEdges[startEdge + idx] = BSPEDGE(newVertIndexes[v0], newVertIndexes[v1]);
+			newEdges[idx] = BSPEDGE(newVertIndexes[v0], newVertIndexes[v1]);
 
 			vertToSurfedge[v0] = startEdge + idx;
 			if (v1 > 0) {
@@ -3090,7 +3803,6 @@ void Bsp::create_nodes(Solid& solid, BSPMODEL* targetModel) {
 
 			idx++;
 		}
-		replace_lump(LUMP_EDGES, newEdges, (edgeCount + addEdges) * sizeof(BSPEDGE));
 	}
 
 	// add new surfedges (2 for each edge)
@@ -3101,42 +3813,35 @@ void Bsp::create_nodes(Solid& solid, BSPMODEL* targetModel) {
 			addSurfedges += solid.faces[i].verts.size();
 		}
 
-		int32_t* newSurfedges = new int32_t[surfedgeCount + addSurfedges];
-		memcpy(newSurfedges, surfedges, surfedgeCount * sizeof(int32_t));
+		int32_t* newSurfedges = (int32_t*)grow_lump(LUMP_SURFEDGES, addSurfedges * sizeof(int32_t));
 
 		int idx = 0;
 		for (int i = 0; i < solid.faces.size(); i++) {
 			for (int k = 0; k < solid.faces[i].verts.size(); k++) {
-				newSurfedges[startSurfedge + idx++] = vertToSurfedge[solid.faces[i].verts[k]];
+				newSurfedges[idx++] = vertToSurfedge[solid.faces[i].verts[k]];
 			}
 		}
-
-		replace_lump(LUMP_SURFEDGES, newSurfedges, (surfedgeCount + addSurfedges) * sizeof(int32_t));
 	}
 
 	// add new planes (1 for each face/node)
 	// TODO: reuse existing planes (maybe not until shared stuff can be split when editing solids)
 	int startPlane = planeCount;
 	{
-		BSPPLANE* newPlanes = new BSPPLANE[planeCount + solid.faces.size()];
-		memcpy(newPlanes, planes, planeCount * sizeof(BSPPLANE));
+		BSPPLANE* newPlanes = (BSPPLANE*)grow_lump(LUMP_PLANES, solid.faces.size() * sizeof(BSPPLANE));
 
 		for (int i = 0; i < solid.faces.size(); i++) {
-			newPlanes[startPlane + i] = solid.faces[i].plane;
+			newPlanes[i] = solid.faces[i].plane;
 		}
-
-		replace_lump(LUMP_PLANES, newPlanes, (planeCount + solid.faces.size()) * sizeof(BSPPLANE));
 	}
 
 	// add new faces
 	int startFace = faceCount;
 	{
-		BSPFACE* newFaces = new BSPFACE[faceCount + solid.faces.size()];
-		memcpy(newFaces, faces, faceCount * sizeof(BSPFACE));
+		BSPFACE* newFaces = (BSPFACE*)grow_lump(LUMP_FACES, solid.faces.size() * sizeof(BSPFACE));
 
 		int surfedgeOffset = 0;
 		for (int i = 0; i < solid.faces.size(); i++) {
-			BSPFACE& face = newFaces[faceCount + i];
+			BSPFACE& face = newFaces[i];
 			face.iFirstEdge = startSurfedge + surfedgeOffset;
 			face.iPlane = startPlane + i;
 			face.nEdges = solid.faces[i].verts.size();
@@ -3148,8 +3853,6 @@ void Bsp::create_nodes(Solid& solid, BSPMODEL* targetModel) {
 
 			surfedgeOffset += face.nEdges;
 		}
-
-		replace_lump(LUMP_FACES, newFaces, (faceCount + solid.faces.size()) * sizeof(BSPFACE));
 	}
 
 	//TODO: move to common function
@@ -3172,13 +3875,10 @@ void Bsp::create_nodes(Solid& solid, BSPMODEL* targetModel) {
 	// add new nodes
 	int startNode = nodeCount;
 	{
-		BSPNODE* newNodes = new BSPNODE[nodeCount + solid.faces.size()];
-		memcpy(newNodes, nodes, nodeCount * sizeof(BSPNODE));
-
-		int16 nodeIdx = nodeCount;
+		BSPNODE* newNodes = (BSPNODE*)grow_lump(LUMP_NODES, solid.faces.size() * sizeof(BSPNODE));
 
 		for (int k = 0; k < solid.faces.size(); k++) {
-			BSPNODE& node = newNodes[nodeCount + k];
+			BSPNODE& node = newNodes[k];
 			memset(&node, 0, sizeof(BSPNODE));
 
 			node.firstFace = startFace + k; // face required for decals
@@ -3186,7 +3886,7 @@ void Bsp::create_nodes(Solid& solid, BSPMODEL* targetModel) {
 			node.iPlane = startPlane + k;
 			// node mins/maxs don't matter for submodels. Leave them at 0.
 
-			int16 insideContents = k == solid.faces.size()-1 ? ~sharedSolidLeaf : (int16)(nodeCount + k + 1);
+			int16 insideContents = k == solid.faces.size()-1 ? ~sharedSolidLeaf : (int16)(startNode + k + 1);
 			int16 outsideContents = ~anyEmptyLeaf;
 
 			// can't have negative normals on planes so children are swapped instead
@@ -3199,8 +3899,6 @@ void Bsp::create_nodes(Solid& solid, BSPMODEL* targetModel) {
 				node.iChildren[1] = insideContents;
 			}
 		}
-
-		replace_lump(LUMP_NODES, newNodes, (nodeCount + solid.faces.size()) * sizeof(BSPNODE));
 	}
 
 	targetModel->iHeadnodes[0] = startNode;
@@ -3271,15 +3969,8 @@ int Bsp::create_clipnode_box(vec3 mins, vec3 maxs, BSPMODEL* targetModel, int ta
 		}
 	}
 
-	BSPPLANE* newPlanes = new BSPPLANE[planeCount + addPlanes.size()];
-	memcpy(newPlanes, planes, planeCount * sizeof(BSPPLANE));
-	memcpy(newPlanes + planeCount, &addPlanes[0], addPlanes.size() * sizeof(BSPPLANE));
-	replace_lump(LUMP_PLANES, newPlanes, (planeCount + addPlanes.size()) * sizeof(BSPPLANE));
-
-	BSPCLIPNODE* newClipnodes = new BSPCLIPNODE[clipnodeCount + addNodes.size()];
-	memcpy(newClipnodes, clipnodes, clipnodeCount * sizeof(BSPCLIPNODE));
-	memcpy(newClipnodes + clipnodeCount, &addNodes[0], addNodes.size() * sizeof(BSPCLIPNODE));
-	replace_lump(LUMP_CLIPNODES, newClipnodes, (clipnodeCount + addNodes.size()) * sizeof(BSPCLIPNODE));
+	append_lump(LUMP_PLANES, &addPlanes[0], addPlanes.size() * sizeof(BSPPLANE));
+	append_lump(LUMP_CLIPNODES, &addNodes[0], addNodes.size() * sizeof(BSPCLIPNODE));
 
 	return solidNodeIdx;
 }
@@ -3320,52 +4011,39 @@ void Bsp::simplify_model_collision(int modelIdx, int hullIdx) {
 }
 
 int Bsp::create_clipnode() {
-	BSPCLIPNODE* newNodes = new BSPCLIPNODE[clipnodeCount + 1];
-	memcpy(newNodes, clipnodes, clipnodeCount * sizeof(BSPCLIPNODE));
+	int newNodeIdx = clipnodeCount;
 
-	BSPCLIPNODE* newNode = &newNodes[clipnodeCount];
-	memset(newNode, 0, sizeof(BSPCLIPNODE));
+	BSPCLIPNODE& newNode = *(BSPCLIPNODE*)grow_lump(LUMP_CLIPNODES, sizeof(BSPCLIPNODE));
+	memset(&newNode, 0, sizeof(BSPCLIPNODE));
 
-	replace_lump(LUMP_CLIPNODES, newNodes, (clipnodeCount + 1) * sizeof(BSPCLIPNODE));
-
-	return clipnodeCount-1;
+	return newNodeIdx;
 }
 
 int Bsp::create_plane() {
-	BSPPLANE* newPlanes = new BSPPLANE[planeCount + 1];
-	memcpy(newPlanes, planes, planeCount * sizeof(BSPPLANE));
+	int newPlaneIdx = planeCount;
 
-	BSPPLANE& newPlane = newPlanes[planeCount];
+	BSPPLANE& newPlane = *(BSPPLANE*)grow_lump(LUMP_PLANES, sizeof(BSPPLANE));
 	memset(&newPlane, 0, sizeof(BSPPLANE));
 
-	replace_lump(LUMP_PLANES, newPlanes, (planeCount + 1) * sizeof(BSPPLANE));
-
-	return planeCount - 1;
+	return newPlaneIdx;
 }
 
 int Bsp::create_model() {
-	BSPMODEL* newModels = new BSPMODEL[modelCount + 1];
-	memcpy(newModels, models, modelCount * sizeof(BSPMODEL));
+	int newModelIdx = modelCount;
 
-	BSPMODEL& newModel = newModels[modelCount];
+	BSPMODEL& newModel = *(BSPMODEL*)grow_lump(LUMP_MODELS, sizeof(BSPMODEL));
 	memset(&newModel, 0, sizeof(BSPMODEL));
 
-	int newModelIdx = modelCount;
-	replace_lump(LUMP_MODELS, newModels, (modelCount + 1) * sizeof(BSPMODEL));
-
 	return newModelIdx;
 }
 
 int Bsp::create_texinfo() {
-	BSPTEXTUREINFO* newTexinfos = new BSPTEXTUREINFO[texinfoCount + 1];
-	memcpy(newTexinfos, texinfos, texinfoCount * sizeof(BSPTEXTUREINFO));
+	int newTexinfoIdx = texinfoCount;
 
-	BSPTEXTUREINFO& newTexinfo = newTexinfos[texinfoCount];
+	BSPTEXTUREINFO& newTexinfo = *(BSPTEXTUREINFO*)grow_lump(LUMP_TEXINFO, sizeof(BSPTEXTUREINFO));
 	memset(&newTexinfo, 0, sizeof(BSPTEXTUREINFO));
 
-	replace_lump(LUMP_TEXINFO, newTexinfos, (texinfoCount + 1) * sizeof(BSPTEXTUREINFO));
-
-	return texinfoCount - 1;
+	return newTexinfoIdx;
 }
 
 int Bsp::duplicate_model(int modelIdx) {
@@ -3722,10 +4400,8 @@ void Bsp::write_csg_outputs(string path) {
 		flipped.fDist = -flipped.fDist;
 		newPlanes[numPlanes + i] = flipped;
 	}
-	delete [] lumps[LUMP_PLANES];
-	lumps[LUMP_PLANES] = (byte*)newPlanes;
 	numPlanes *= 2;
-	header.lump[LUMP_PLANES].nLength = numPlanes * sizeof(BSPPLANE);
+	replace_lump(LUMP_PLANES, newPlanes, numPlanes * sizeof(BSPPLANE));
 	thisPlanes = newPlanes;
 
 	ofstream pln_file(path + name + ".pln", ios::out | ios::binary | ios::trunc);
@@ -3885,7 +4561,7 @@ void Bsp::update_lump_pointers() {
 	marksurfCount = header.lump[LUMP_MARKSURFACES].nLength / sizeof(uint16_t);
 	surfedgeCount = header.lump[LUMP_SURFEDGES].nLength / sizeof(int32_t);
 	edgeCount = header.lump[LUMP_EDGES].nLength / sizeof(BSPEDGE);
-	textureCount = *((int32_t*)(lumps[LUMP_TEXTURES]));
+	textureCount = lumps[LUMP_TEXTURES] ? *((int32_t*)(lumps[LUMP_TEXTURES])) : 0;
 	lightDataLength = header.lump[LUMP_LIGHTING].nLength;
 	visDataLength = header.lump[LUMP_VISIBILITY].nLength;
 
@@ -3907,19 +4583,19 @@ void Bsp::update_lump_pointers() {
 }
 
 void Bsp::replace_lump(int lumpIdx, void* newData, int newLength) {
-	delete[] lumps[lumpIdx];
+	free_lump(lumpIdx);
 	lumps[lumpIdx] = (byte*)newData;
+	lumpOwned[lumpIdx] = newData != NULL;
+	lumpCapacity[lumpIdx] = newData ? newLength : 0;
 	header.lump[lumpIdx].nLength = newLength;
+	if (lumpIdx == LUMP_ENTITIES) {
+		entLumpId = 0; // ents no longer match the text
+	}
 
+	invalidate_model_usage(lumpIdx);
 	update_lump_pointers();
 }
 
 void Bsp::append_lump(int lumpIdx, void* newData, int appendLength) {
-	int oldLen = header.lump[lumpIdx].nLength;
-	byte* newLump = new byte[oldLen + appendLength];
-	
-	memcpy(newLump, lumps[lumpIdx], oldLen);
-	memcpy(newLump + oldLen, newData, appendLength);
-
-	replace_lump(lumpIdx, newLump, oldLen + appendLength);
+	memcpy(grow_lump(lumpIdx, appendLength), newData, appendLength);
 }
\ No newline at end of file
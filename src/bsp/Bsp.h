@@ -8,15 +8,24 @@
 #include <string.h>
 #include "remap.h"
 #include <set>
+#include <unordered_map>
 #include "bsptypes.h"
 
-struct membuf : std::streambuf
+// how much of one BSP limit is used
+struct LIMITSTAT
 {
-	membuf(char* begin, int len) {
-		this->setg(begin, begin, begin + len);
-	}
+	const char* name;
+	uint val;
+	uint max;
+	bool isMem; // val and max are in bytes
 };
 
+// usage of every BSP limit, in the order they're printed
+vector<LIMITSTAT> get_limit_stats(const STRUCTCOUNT& count, int entCount);
+
+// index of the first limit that is full, or -1 if the counts fit
+int find_overflowed_limit(const vector<LIMITSTAT>& stats);
+
 class Bsp
 {
 public:
@@ -26,6 +35,16 @@ public:
 	byte ** lumps;
 	bool valid;
 
+	// lumps loaded from a file are views into a copy-on-write mapping of it, until they're replaced
+	byte* fileMapping;
+	int fileMappingSize;
+	void* fileMappingHandle;
+	bool lumpOwned[HEADER_LUMPS]; // false if the lump points into the file mapping
+	int lumpCapacity[HEADER_LUMPS]; // allocated size of owned lumps. The header has the used size.
+
+	// changes every time the entity lump is parsed or rewritten, so ents can tell if their raw text is still there
+	int entLumpId = 0;
+
 	BSPPLANE* planes;
 	BSPTEXTUREINFO* texinfos;
 	byte* textures;
@@ -58,6 +77,12 @@ public:
 	
 	vector<Entity*> ents;
 
+	// indexes into ents by targetname, and by each name they trigger (Entity::getTargets).
+	// Built by load_ents. Entries can go stale after edits, so query with get_named_ents and
+	// get_caller_ents, which skip and drop entries that no longer match.
+	unordered_map<string, vector<int>> namedEnts;
+	unordered_map<string, vector<int>> callerEnts;
+
 	Bsp();
 	Bsp(std::string fname);
 	~Bsp();
@@ -66,14 +91,30 @@ public:
 	bool move(vec3 offset, int modelIdx=0);
 
 	void move_texinfo(int idx, vec3 offset);
+	BSPTEXTUREINFO get_moved_texinfo(int idx, vec3 offset); // texinfo as move_texinfo would leave it
 	void write(string path);
 
 	void print_info(bool perModelStats, int perModelLimit, int sortMode);
+
+	// prints lump sizes, limits, and per-model structure counts (sorted by sortMode) as one JSON object.
+	// loadTime is the time it took to load the map, in milliseconds. Warnings are added as an array of lines.
+	void print_info_json(int sortMode, double loadTime, const string& warnings);
 	void print_model_hull(int modelIdx, int hull);
 	void print_clipnode_tree(int iNode, int depth);
 	void recurse_node(int16_t node, int depth);
 	int32_t pointContents(int iNode, vec3 p, int hull, vector<int>& nodeBranch, int& leafIdx, int& childIdx);
 	int32_t pointContents(int iNode, vec3 p, int hull);
+
+	// Finds the first face of the model hit by a ray. The node tree is walked front to back, and only
+	// the faces on the planes the ray crosses are tested, so this stops at the first hit. Backfaces are
+	// ignored. start is relative to the model origin. maxDist is in units of dir, and is set to the
+	// distance of the hit. Returns the face index, or -1 if nothing was hit.
+	int traceRay(int modelIdx, vec3 start, vec3 dir, float& maxDist);
+
+	// Traces a line through a collision hull of the model (0 = point hull, using the nodes) and stops
+	// where it first enters solid space, the way the engine moves players.
+	// Returns false if something was hit.
+	bool traceHull(int modelIdx, int hull, vec3 start, vec3 end, TraceResult& trace);
 	const char* getLeafContentsName(int32_t contents);
 
 	// strips a collision hull from the given model index
@@ -124,6 +165,26 @@ public:
 
 	void load_ents();
 
+	// rebuilds the model -> entity index (modelEnts)
+	void update_model_ent_index();
+
+	// marks the model -> entity index as stale, so the next lookup rebuilds it.
+	// Call after adding/removing ents or changing an entity's model.
+	void invalidate_model_ent_index();
+
+	// indexes of the ents using the model, in entity order
+	vector<int> get_model_ent_indexes(int modelIdx);
+
+	// rebuilds the entity name indexes (namedEnts/callerEnts). Call after adding/removing ents.
+	void update_ent_name_index();
+
+	// adds the current names of an edited entity to the name indexes
+	void update_ent_name_index(int entIdx);
+
+	// indexes of the ents with this targetname, and of the ents that trigger it, in ent order
+	vector<int> get_named_ents(const string& name);
+	vector<int> get_caller_ents(const string& name);
+
 	// call this after editing ents
 	void update_ent_lump(bool stripNodes=false);
 
@@ -134,13 +195,24 @@ public:
 
 	bool isValid(); // check if any lumps are overflowed
 
+	// usage of every BSP limit by this map
+	vector<LIMITSTAT> get_limit_stats();
+
+	// prints one row of the limits table (see print_info)
+	static void print_stat(string name, uint val, uint max, bool isMem);
+
 	// delete structures not used by the map (needed after deleting models/hulls)
 	STRUCTCOUNT remove_unused_model_structures();
 	void delete_model(int modelIdx);
+	void delete_models(const vector<bool>& shouldDelete);
 
 	// conditionally deletes hulls for entities that aren't using them
 	STRUCTCOUNT delete_unused_hulls(bool noProgress=false);
 
+	// merges structurally identical clipnode subtrees (same planes and leaf contents)
+	// so that they're stored once and shared by every hull that uses them
+	STRUCTCOUNT dedup_clipnodes();
+
 	// returns true if the map has eny entities that make use of hull 2
 	bool has_hull2_ents();
 	
@@ -166,6 +238,7 @@ public:
 	// Returns -1 on failure, else the new texture index
 	int add_texture(const char* name, byte* data, int width, int height);
 
+	// takes ownership of newData, which must be allocated with new[]
 	void replace_lump(int lumpIdx, void* newData, int newLength);
 	void append_lump(int lumpIdx, void* newData, int appendLength);
 
@@ -191,7 +264,7 @@ public:
 
 	int get_model_from_face(int faceIdx);
 
-	vector<STRUCTUSAGE*> get_sorted_model_infos(int sortMode);
+	vector<MODELUSAGE> get_sorted_model_infos(int sortMode);
 
 	// split structures that are shared between the target and other models
 	void split_shared_model_structures(int modelIdx);
@@ -199,6 +272,18 @@ public:
 	// true if the model is sharing planes/clipnodes with other models
 	bool does_model_use_shared_structures(int modelIdx);
 
+	// marks structures used by any model other than the given one, leaves included.
+	// Only the given model is traversed. The rest comes from a map-wide usage cache.
+	void mark_other_model_structures(int modelIdx, STRUCTUSAGE* usage);
+
+	// marks all structures that this model uses
+	// TODO: don't mark faces in submodel leaves (unused)
+	void mark_model_structures(int modelIdx, STRUCTUSAGE* STRUCTUSAGE, bool skipLeaves);
+
+	// drops the cached model usage. Call this after editing structure indexes in place
+	// (headnodes, children, texinfos...). lumpIdx=-1 for any change.
+	void invalidate_model_usage(int lumpIdx=-1);
+
 	// returns the current lump contents
 	LumpState duplicate_lumps(int targets);
 
@@ -207,34 +292,78 @@ public:
 	int delete_embedded_textures();
 
 private:
-	int remove_unused_lightmaps(bool* usedFaces);
-	int remove_unused_visdata(bool* usedLeaves, BSPLEAF* oldLeaves, int oldLeafCount); // called after removing unused leaves
-	int remove_unused_textures(bool* usedTextures, int* remappedIndexes);
-	int remove_unused_structs(int lumpIdx, bool* usedStructs, int* remappedIndexes);
+	// structures used by at least one model, and by more than one model.
+	// NULL until needed, and reset whenever a lump that models reference changes.
+	STRUCTUSAGE* anyModelUsage;
+	STRUCTUSAGE* sharedModelUsage;
+
+	vector<int> markStack; // reused by the node tree traversals in mark_*_structures
+
+	// indexes into ents for each model, in entity order. Built by load_ents and kept in sync by
+	// delete_models. Rebuilt on the next lookup after invalidate_model_ent_index, or if the entity
+	// count changed since it was built.
+	vector<vector<int>> modelEnts;
+	bool modelEntsDirty;
+	int modelEntsEntCount;
+
+	// rebuilds modelEnts if it may be stale
+	void refresh_model_ent_index();
+
+	// adds the ent's names to namedEnts/callerEnts. When rebuilding, ents are added in order,
+	// so only the last entry of each list needs to be checked for duplicates.
+	void add_ent_names(int entIdx, bool rebuilding);
+
+	int remove_unused_lightmaps(const BITSET& usedFaces);
+	int remove_unused_visdata(const BITSET& usedLeaves, BSPLEAF* oldLeaves, int oldLeafCount); // called after removing unused leaves
+	int remove_unused_textures(BITSET& usedTextures, int* remappedIndexes);
+	int remove_unused_structs(int lumpIdx, const BITSET& usedStructs, int* remappedIndexes);
 
 	void resize_lightmaps(LIGHTMAP* oldLightmaps, LIGHTMAP* newLightmaps);
 
 	bool load_lumps(string fname);
 
+	void init_lumps();
+
+	// deletes the lump if it was allocated, or just forgets it if it's a view into the file mapping
+	void free_lump(int lumpIdx);
+
+	// copies any lumps still pointing into the file mapping, then unmaps the file
+	void release_file_mapping();
+
+	// adds appendLength uninitialized bytes to the end of a lump and returns a pointer to them.
+	// Capacity grows geometrically, so adding structs one at a time doesn't copy the lump every time.
+	byte* grow_lump(int lumpIdx, int appendLength);
+
 	// lightmaps that are resized due to precision errors should not be stretched to fit the new canvas.
 	// Instead, the texture should be shifted around, depending on which parts of the canvas is "lit" according
 	// to the qrad code. Shifts apply to one or both of the lightmaps, depending on which dimension is bigger.
 	void get_lightmap_shift(const LIGHTMAP& oldLightmap, const LIGHTMAP& newLightmap, int& srcOffsetX, int& srcOffsetY);
 
+	// checks the segment of the ray between startDist and endDist against the node's children and faces
+	int trace_ray_node(int iNode, vec3 start, vec3 dir, float startDist, float endDist, float& hitDist);
+
+	// true if the point (assumed to be on the face's plane) is inside the face's edges
+	bool is_point_on_face(int faceIdx, vec3 p);
+
+	// contents of a leaf in the node tree (hull 0) or clipnode tree
+	int32_t get_leaf_contents(int iNode, int hull);
+
+	// returns false if the line hit something
+	bool trace_hull_node(int headnode, int hull, int iNode, float p1f, float p2f, vec3 p1, vec3 p2, TraceResult& trace);
+
 	void print_model_bsp(int modelIdx);
 	void print_leaf(BSPLEAF leaf);
 	void print_node(BSPNODE node);
-	void print_stat(string name, uint val, uint max, bool isMem);
-	void print_model_stat(STRUCTUSAGE* modelInfo, uint val, uint max, bool isMem);
+	void print_model_stat(MODELUSAGE* modelInfo, uint val, uint max, bool isMem);
+
+	// classname and targetname of the last entity using the model, or "???" if there is none
+	void get_model_ent_names(int modelIdx, string& classname, string& targetname);
 
 	string get_model_usage(int modelIdx);
 	vector<Entity*> get_model_ents(int modelIdx);
 
 	void write_csg_polys(int16_t nodeIdx, FILE* fout, int flipPlaneSkip, bool debug);	
 
-	// marks all structures that this model uses
-	// TODO: don't mark faces in submodel leaves (unused)
-	void mark_model_structures(int modelIdx, STRUCTUSAGE* STRUCTUSAGE, bool skipLeaves);
 	void mark_face_structures(int iFace, STRUCTUSAGE* usage);
 	void mark_node_structures(int iNode, STRUCTUSAGE* usage, bool skipLeaves);
 	void mark_clipnode_structures(int iNode, STRUCTUSAGE* usage);
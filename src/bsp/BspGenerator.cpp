@@ -0,0 +1,481 @@
+#include "BspGenerator.h"
+#include <numeric>
+#include "rad.h"
+#include "vis.h"
+
+#define GEN_CELL_SIZE 320 // each world leaf is a square column of this width
+#define GEN_CELL_MARGIN 32 // keeps clipnode boxes (expanded by the hull size) inside their cell
+#define GEN_ENT_Z 384 // brush ents float above the world boxes, which are at most 240 tall
+#define GEN_MAX_Z 640
+#define GEN_VIS_RADIUS 3 // leaves see the cells within this many cells of their own
+
+BspGenerator::BspGenerator() {
+
+}
+
+GENERATE_OPTIONS BspGenerator::get_fill_options(float fill) {
+	fill = clamp(fill, 0.0f, 1.0f);
+
+	// Clipnodes run out first. Each box needs 18 (6 for each of the 3 clipnode hulls), and the world's
+	// clipnode trees need about 6 more per world box to find them. Half of the boxes go to entities.
+	int boxes = (int)(fill * (MAX_MAP_CLIPNODES - 1) / 42);
+
+	// The rest of the nodes split the world into leaves. Leaves are rounded up to fill a square grid,
+	// which can add up to one row more than asked for.
+	int leafNodes = (int)(fill * (MAX_MAP_NODES - 1)) - boxes * 12;
+	leafNodes -= (int)sqrt((float)leafNodes) + 1;
+
+	GENERATE_OPTIONS opts;
+	opts.brushEnts = boxes;
+	opts.worldFaces = boxes * 6;
+	opts.leaves = max(2, leafNodes);
+	opts.textures = max(1, (int)(fill * MAX_MAP_TEXTURES / 8));
+	opts.seed = 1;
+
+	return opts;
+}
+
+Bsp* BspGenerator::generate(const GENERATE_OPTIONS& opts) {
+	if (opts.brushEnts < 0 || opts.worldFaces < 0) {
+		logf("ERROR: entity and face counts can't be negative\n");
+		return NULL;
+	}
+	if (opts.brushEnts + 1 >= MAX_MAP_MODELS) {
+		logf("ERROR: Too many brush entities (max %d)\n", MAX_MAP_MODELS - 2);
+		return NULL;
+	}
+	if (opts.textures < 1 || opts.textures >= MAX_MAP_TEXTURES) {
+		logf("ERROR: Texture count must be 1-%d\n", MAX_MAP_TEXTURES - 1);
+		return NULL;
+	}
+	// leaf indexes are stored as negative shorts in node children
+	if (opts.leaves < 2 || opts.leaves >= MAX_MAP_LEAVES / 2) {
+		logf("ERROR: Leaf count must be 2-%d\n", MAX_MAP_LEAVES / 2 - 1);
+		return NULL;
+	}
+
+	gridX = (int)ceil(sqrt((float)opts.leaves));
+	gridY = (opts.leaves + gridX - 1) / gridX;
+	if ((gridX / 2 + 1) * GEN_CELL_SIZE > MAX_MAP_COORD) {
+		logf("ERROR: Too many leaves to fit in the map\n");
+		return NULL;
+	}
+	gridMins = vec3(-(gridX / 2) * GEN_CELL_SIZE, -(gridY / 2) * GEN_CELL_SIZE, 0);
+
+	rngState = opts.seed * 2654435761U ^ 0x9E3779B9;
+	if (rngState == 0)
+		rngState = 1;
+
+	map = new Bsp();
+	worldBoxes.clear();
+	cellBoxes.clear();
+	lightData.clear();
+
+	add_textures(opts.textures);
+	create_world(opts);
+	create_vis(GEN_VIS_RADIUS);
+	create_brush_ents(opts);
+
+	if (lightData.size()) {
+		byte* newLightData = new byte[lightData.size()];
+		memcpy(newLightData, &lightData[0], lightData.size());
+		map->replace_lump(LUMP_LIGHTING, newLightData, lightData.size());
+	}
+
+	Entity* worldspawn = new Entity("worldspawn");
+	worldspawn->addKeyvalue("wad", "");
+	map->ents.insert(map->ents.begin(), worldspawn);
+
+	vec3 spawn = cell_mins(0) + vec3(GEN_CELL_SIZE / 2, GEN_CELL_SIZE / 2, (240 + GEN_ENT_Z) / 2);
+	Entity* playerStart = new Entity("info_player_start");
+	playerStart->addKeyvalue("origin", spawn.toKeyvalueString());
+	map->ents.insert(map->ents.begin() + 1, playerStart);
+
+	map->update_ent_lump();
+
+	return map;
+}
+
+uint32_t BspGenerator::next_rand() {
+	// xorshift, so the output doesn't depend on the standard library
+	rngState ^= rngState << 13;
+	rngState ^= rngState >> 17;
+	rngState ^= rngState << 5;
+	return rngState;
+}
+
+int BspGenerator::rand_range(int min, int max) {
+	// steps of 16 keep faces aligned to the lightmap grid
+	return min + (next_rand() % ((max - min) / 16 + 1)) * 16;
+}
+
+vec3 BspGenerator::cell_mins(int cell) {
+	return gridMins + vec3((cell % gridX) * GEN_CELL_SIZE, (cell / gridX) * GEN_CELL_SIZE, 0);
+}
+
+vec3 BspGenerator::random_box_size() {
+	// 240 units is 16 luxels, the largest lightmap every renderer can load
+	return vec3(rand_range(32, 240), rand_range(32, 240), rand_range(32, 240));
+}
+
+void BspGenerator::add_textures(int count) {
+	// add_texture expects a texture lump with a header
+	byte* emptyTexLump = new byte[sizeof(int32_t)];
+	memset(emptyTexLump, 0, sizeof(int32_t));
+	map->replace_lump(LUMP_TEXTURES, emptyTexLump, sizeof(int32_t));
+
+	COLOR3 pixels[32 * 32];
+
+	for (int i = 0; i < count; i++) {
+		uint32_t colors[2] = { next_rand(), next_rand() };
+
+		for (int y = 0; y < 32; y++) {
+			for (int x = 0; x < 32; x++) {
+				uint32_t c = colors[((x / 8) + (y / 8)) % 2];
+				pixels[y * 32 + x] = COLOR3(c & 0xff, (c >> 8) & 0xff, (c >> 16) & 0xff);
+			}
+		}
+
+		char name[MAXTEXTURENAME];
+		snprintf(name, MAXTEXTURENAME, "gen%d", i);
+		map->add_texture(name, (byte*)pixels, 32, 32);
+	}
+}
+
+void BspGenerator::light_faces(int firstFace, int faceCount) {
+	for (int i = firstFace; i < firstFace + faceCount; i++) {
+		BSPFACE& face = map->faces[i];
+		map->texinfos[face.iTextureInfo].nFlags = 0;
+
+		int size[2];
+		GetFaceLightmapSize(map, i, size);
+
+		face.nStyles[0] = 0;
+		face.nLightmapOffset = lightData.size();
+
+		int brightness = 96 + next_rand() % 128;
+		for (int t = 0; t < size[1]; t++) {
+			for (int s = 0; s < size[0]; s++) {
+				byte v = (byte)clamp(brightness + (s - t) * 4, 0, 255);
+				lightData.push_back(v);
+				lightData.push_back(v);
+				lightData.push_back((v * 7) / 8);
+			}
+		}
+	}
+}
+
+void BspGenerator::create_world(const GENERATE_OPTIONS& opts) {
+	int cellCount = gridX * gridY;
+	int worldBoxCount = (opts.worldFaces + 5) / 6;
+	cellBoxes.resize(cellCount);
+
+	map->create_model();
+	map->create_leaf(CONTENTS_SOLID);
+
+	// one empty leaf per cell, so cell i is leaf i+1
+	{
+		vector<BSPLEAF> newLeaves(cellCount);
+		memset(&newLeaves[0], 0, cellCount * sizeof(BSPLEAF));
+
+		for (int i = 0; i < cellCount; i++) {
+			vec3 mins = cell_mins(i);
+			BSPLEAF& leaf = newLeaves[i];
+			leaf.nContents = CONTENTS_EMPTY;
+			leaf.nVisOffset = -1;
+			leaf.nMins[0] = mins.x;
+			leaf.nMins[1] = mins.y;
+			leaf.nMins[2] = 0;
+			leaf.nMaxs[0] = mins.x + GEN_CELL_SIZE;
+			leaf.nMaxs[1] = mins.y + GEN_CELL_SIZE;
+			leaf.nMaxs[2] = GEN_MAX_Z;
+		}
+
+		map->append_lump(LUMP_LEAVES, &newLeaves[0], cellCount * sizeof(BSPLEAF));
+	}
+
+	// spread the boxes over random cells, only doubling up once every cell has one
+	vector<int> cellOrder(cellCount);
+	iota(cellOrder.begin(), cellOrder.end(), 0);
+	for (int i = cellCount - 1; i > 0; i--) {
+		swap(cellOrder[i], cellOrder[next_rand() % (i + 1)]);
+	}
+
+	vector<int> boxFirstFace;
+	for (int i = 0; i < worldBoxCount; i++) {
+		GENBOX box;
+		box.cell = cellOrder[i % cellCount];
+
+		vec3 size = random_box_size();
+		int room = GEN_CELL_SIZE - GEN_CELL_MARGIN * 2;
+		box.mins = cell_mins(box.cell) + vec3(GEN_CELL_MARGIN + rand_range(0, room - size.x),
+			GEN_CELL_MARGIN + rand_range(0, room - size.y), 0);
+		box.maxs = box.mins + size;
+
+		boxFirstFace.push_back(map->faceCount);
+		map->create_node_box(box.mins, box.maxs, &map->models[0], next_rand() % map->textureCount);
+		map->create_clipnode_box(box.mins, box.maxs, &map->models[0]);
+		light_faces(map->faceCount - 6, 6);
+
+		for (int k = 0; k < MAX_MAP_HULLS; k++) {
+			box.clipHeadnodes[k] = map->models[0].iHeadnodes[k];
+		}
+		box.headnode = map->models[0].iHeadnodes[0];
+
+		cellBoxes[box.cell].push_back(i);
+		worldBoxes.push_back(box);
+	}
+
+	// leaves mark the faces of the boxes in their cell
+	vector<uint16> newMarksurfs;
+	for (int i = 0; i < cellCount; i++) {
+		BSPLEAF& leaf = map->leaves[i + 1];
+		leaf.iFirstMarkSurface = newMarksurfs.size();
+		leaf.nMarkSurfaces = cellBoxes[i].size() * 6;
+
+		for (int k = 0; k < cellBoxes[i].size(); k++) {
+			for (int f = 0; f < 6; f++) {
+				newMarksurfs.push_back(boxFirstFace[cellBoxes[i][k]] + f);
+			}
+		}
+	}
+	if (newMarksurfs.size())
+		map->append_lump(LUMP_MARKSURFACES, &newMarksurfs[0], newMarksurfs.size() * sizeof(uint16));
+
+	create_split_planes();
+
+	int headnodes[MAX_MAP_HULLS];
+	{
+		vector<BSPNODE> newNodes;
+		headnodes[0] = create_partition_nodes(newNodes, 0, 0, gridX, gridY);
+		map->append_lump(LUMP_NODES, &newNodes[0], newNodes.size() * sizeof(BSPNODE));
+	}
+	for (int i = 1; i < MAX_MAP_HULLS; i++) {
+		vector<BSPCLIPNODE> newNodes;
+		vector<int> boxes(worldBoxCount);
+		iota(boxes.begin(), boxes.end(), 0);
+
+		headnodes[i] = create_partition_clipnodes(newNodes, i, 0, 0, gridX, gridY, boxes);
+		if (newNodes.size())
+			map->append_lump(LUMP_CLIPNODES, &newNodes[0], newNodes.size() * sizeof(BSPCLIPNODE));
+	}
+
+	BSPMODEL& world = map->models[0];
+	for (int i = 0; i < MAX_MAP_HULLS; i++) {
+		world.iHeadnodes[i] = headnodes[i];
+	}
+	world.nMins = gridMins;
+	world.nMaxs = gridMins + vec3(gridX * GEN_CELL_SIZE, gridY * GEN_CELL_SIZE, GEN_MAX_Z);
+	world.nVisLeafs = cellCount;
+	world.iFirstFace = 0;
+	world.nFaces = worldBoxCount * 6;
+}
+
+void BspGenerator::create_split_planes() {
+	vector<BSPPLANE> newPlanes;
+
+	int lineCount[2] = { gridX, gridY };
+	for (int axis = 0; axis < 2; axis++) {
+		splitPlanes[axis].clear();
+		splitPlanes[axis].resize(lineCount[axis] + 1, -1);
+
+		// only the lines between cells are needed
+		for (int i = 1; i < lineCount[axis]; i++) {
+			splitPlanes[axis][i] = map->planeCount + newPlanes.size();
+
+			if (axis == 0)
+				newPlanes.push_back({ vec3(1, 0, 0), gridMins.x + i * GEN_CELL_SIZE, PLANE_X });
+			else
+				newPlanes.push_back({ vec3(0, 1, 0), gridMins.y + i * GEN_CELL_SIZE, PLANE_Y });
+		}
+	}
+
+	if (newPlanes.size())
+		map->append_lump(LUMP_PLANES, &newPlanes[0], newPlanes.size() * sizeof(BSPPLANE));
+}
+
+void BspGenerator::link_box_nodes(const vector<int>& boxes, int lastChild) {
+	// create_node_box points the outside of a box at the first empty leaf
+	const int16_t boxOutside = ~1;
+
+	for (int i = 0; i < boxes.size(); i++) {
+		GENBOX& box = worldBoxes[boxes[i]];
+		int16_t next = i + 1 < boxes.size() ? worldBoxes[boxes[i + 1]].headnode : lastChild;
+		vec3 mins = cell_mins(box.cell);
+
+		for (int k = 0; k < 6; k++) {
+			BSPNODE& node = map->nodes[box.headnode + k];
+			for (int c = 0; c < 2; c++) {
+				if (node.iChildren[c] == boxOutside)
+					node.iChildren[c] = next;
+			}
+
+			// the engine culls nodes by their bounds, so these can't be left empty like in submodels
+			node.nMins[0] = mins.x;
+			node.nMins[1] = mins.y;
+			node.nMins[2] = 0;
+			node.nMaxs[0] = mins.x + GEN_CELL_SIZE;
+			node.nMaxs[1] = mins.y + GEN_CELL_SIZE;
+			node.nMaxs[2] = GEN_MAX_Z;
+		}
+	}
+}
+
+void BspGenerator::link_box_clipnodes(const vector<int>& boxes, int hull) {
+	for (int i = 0; i < boxes.size(); i++) {
+		GENBOX& box = worldBoxes[boxes[i]];
+		int16_t next = i + 1 < boxes.size() ? worldBoxes[boxes[i + 1]].clipHeadnodes[hull] : CONTENTS_EMPTY;
+
+		for (int k = 0; k < 6; k++) {
+			BSPCLIPNODE& node = map->clipnodes[box.clipHeadnodes[hull] + k];
+			for (int c = 0; c < 2; c++) {
+				if (node.iChildren[c] == CONTENTS_EMPTY)
+					node.iChildren[c] = next;
+			}
+		}
+	}
+}
+
+int16_t BspGenerator::create_partition_nodes(vector<BSPNODE>& newNodes, int x0, int y0, int x1, int y1) {
+	if (x1 - x0 == 1 && y1 - y0 == 1) {
+		int cell = y0 * gridX + x0;
+		int16_t leaf = ~(cell + 1);
+		if (cellBoxes[cell].empty())
+			return leaf;
+
+		link_box_nodes(cellBoxes[cell], leaf);
+		return worldBoxes[cellBoxes[cell][0]].headnode;
+	}
+
+	int nodeIdx = newNodes.size();
+	newNodes.push_back(BSPNODE());
+
+	// children[0] is the front side of the plane, which is the higher half of the cells
+	int planeIdx;
+	int16_t front, back;
+	if (x1 - x0 >= y1 - y0) {
+		int mid = (x0 + x1) / 2;
+		planeIdx = splitPlanes[0][mid];
+		front = create_partition_nodes(newNodes, mid, y0, x1, y1);
+		back = create_partition_nodes(newNodes, x0, y0, mid, y1);
+	}
+	else {
+		int mid = (y0 + y1) / 2;
+		planeIdx = splitPlanes[1][mid];
+		front = create_partition_nodes(newNodes, x0, mid, x1, y1);
+		back = create_partition_nodes(newNodes, x0, y0, x1, mid);
+	}
+
+	BSPNODE& node = newNodes[nodeIdx];
+	memset(&node, 0, sizeof(BSPNODE));
+	node.iPlane = planeIdx;
+	node.iChildren[0] = front;
+	node.iChildren[1] = back;
+	node.nMins[0] = gridMins.x + x0 * GEN_CELL_SIZE;
+	node.nMins[1] = gridMins.y + y0 * GEN_CELL_SIZE;
+	node.nMins[2] = 0;
+	node.nMaxs[0] = gridMins.x + x1 * GEN_CELL_SIZE;
+	node.nMaxs[1] = gridMins.y + y1 * GEN_CELL_SIZE;
+	node.nMaxs[2] = GEN_MAX_Z;
+
+	return map->nodeCount + nodeIdx;
+}
+
+int16_t BspGenerator::create_partition_clipnodes(vector<BSPCLIPNODE>& newNodes, int hull, int x0, int y0, int x1, int y1, vector<int>& boxes) {
+	if (boxes.empty())
+		return CONTENTS_EMPTY;
+
+	// unlike leaves, clipnode hulls don't need every cell split off. A box chain works anywhere.
+	if (boxes.size() == 1 || (x1 - x0 == 1 && y1 - y0 == 1)) {
+		link_box_clipnodes(boxes, hull);
+		return worldBoxes[boxes[0]].clipHeadnodes[hull];
+	}
+
+	int nodeIdx = newNodes.size();
+	newNodes.push_back(BSPCLIPNODE());
+
+	bool splitX = x1 - x0 >= y1 - y0;
+	int mid = splitX ? (x0 + x1) / 2 : (y0 + y1) / 2;
+
+	vector<int> frontBoxes;
+	vector<int> backBoxes;
+	for (int i = 0; i < boxes.size(); i++) {
+		int cell = worldBoxes[boxes[i]].cell;
+		int pos = splitX ? cell % gridX : cell / gridX;
+		if (pos >= mid)
+			frontBoxes.push_back(boxes[i]);
+		else
+			backBoxes.push_back(boxes[i]);
+	}
+
+	int16_t front, back;
+	if (splitX) {
+		front = create_partition_clipnodes(newNodes, hull, mid, y0, x1, y1, frontBoxes);
+		back = create_partition_clipnodes(newNodes, hull, x0, y0, mid, y1, backBoxes);
+	}
+	else {
+		front = create_partition_clipnodes(newNodes, hull, x0, mid, x1, y1, frontBoxes);
+		back = create_partition_clipnodes(newNodes, hull, x0, y0, x1, mid, backBoxes);
+	}
+
+	BSPCLIPNODE& node = newNodes[nodeIdx];
+	node.iPlane = splitPlanes[splitX ? 0 : 1][mid];
+	node.iChildren[0] = front;
+	node.iChildren[1] = back;
+
+	return map->clipnodeCount + nodeIdx;
+}
+
+void BspGenerator::create_vis(int radius) {
+	int cellCount = gridX * gridY;
+	int rowSize = ((cellCount + 63) & ~63) >> 3; // same row size that CompressAll expects
+	int visSize = cellCount * rowSize;
+
+	byte* decompressedVis = new byte[visSize];
+	memset(decompressedVis, 0, visSize);
+
+	for (int i = 0; i < cellCount; i++) {
+		byte* row = decompressedVis + i * rowSize;
+		int cx = i % gridX;
+		int cy = i / gridX;
+
+		for (int y = max(0, cy - radius); y <= min(gridY - 1, cy + radius); y++) {
+			for (int x = max(0, cx - radius); x <= min(gridX - 1, cx + radius); x++) {
+				int bit = y * gridX + x; // bit 0 = leaf 1
+				row[bit >> 3] |= 1 << (bit & 7);
+			}
+		}
+	}
+
+	byte* compressedVis = new byte[visSize];
+	memset(compressedVis, 0, visSize);
+	int visLen = CompressAll(map->leaves, decompressedVis, compressedVis, cellCount, cellCount, visSize);
+
+	byte* compressedVisResized = new byte[visLen];
+	memcpy(compressedVisResized, compressedVis, visLen);
+
+	map->replace_lump(LUMP_VISIBILITY, compressedVisResized, visLen);
+
+	delete[] decompressedVis;
+	delete[] compressedVis;
+}
+
+void BspGenerator::create_brush_ents(const GENERATE_OPTIONS& opts) {
+	int cellCount = gridX * gridY;
+
+	for (int i = 0; i < opts.brushEnts; i++) {
+		int cell = next_rand() % cellCount;
+
+		vec3 size = random_box_size();
+		int room = GEN_CELL_SIZE - GEN_CELL_MARGIN * 2;
+		vec3 mins = cell_mins(cell) + vec3(GEN_CELL_MARGIN + rand_range(0, room - size.x),
+			GEN_CELL_MARGIN + rand_range(0, room - size.y), GEN_ENT_Z);
+
+		int modelIdx = map->create_solid(mins, mins + size, next_rand() % map->textureCount);
+		light_faces(map->models[modelIdx].iFirstFace, map->models[modelIdx].nFaces);
+
+		Entity* ent = new Entity("func_wall");
+		ent->addKeyvalue("model", "*" + to_string(modelIdx));
+		map->ents.push_back(ent);
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "util.h"
+#include "Bsp.h"
+
+struct GENERATE_OPTIONS
+{
+	int brushEnts;  // func_wall entities, each a box model
+	int worldFaces; // rounded up to whole boxes (6 faces each)
+	int leaves;     // empty world leaves, one per grid cell, each with its own vis row
+	int textures;   // embedded 32x32 textures
+	uint32_t seed;
+};
+
+// builds synthetic maps out of boxes for benchmarking. The same options and seed
+// always produce the same file.
+class BspGenerator {
+public:
+	BspGenerator();
+
+	// counts that use about the given fraction (0-1) of the tightest BSP limits
+	static GENERATE_OPTIONS get_fill_options(float fill);
+
+	// returns NULL if the options can't fit in a map
+	Bsp* generate(const GENERATE_OPTIONS& opts);
+
+private:
+	struct GENBOX {
+		vec3 mins, maxs;
+		int cell;
+		int headnode;
+		int clipHeadnodes[MAX_MAP_HULLS];
+	};
+
+	uint32_t rngState;
+	int gridX, gridY;
+	vec3 gridMins;
+	Bsp* map;
+	vector<GENBOX> worldBoxes;
+	vector<vector<int>> cellBoxes; // world box indexes in each cell
+	vector<int> splitPlanes[2]; // x/y grid line -> plane index
+	vector<byte> lightData;
+
+	uint32_t next_rand();
+	int rand_range(int min, int max); // inclusive, rounded down to a multiple of 16
+
+	vec3 cell_mins(int cell);
+	vec3 random_box_size();
+
+	void add_textures(int count);
+
+	// clears the special flag and gives the faces a lightmap
+	void light_faces(int firstFace, int faceCount);
+
+	void create_world(const GENERATE_OPTIONS& opts);
+	void create_split_planes();
+
+	// links the boxes so each one's outside leads into the next, ending at lastChild
+	void link_box_nodes(const vector<int>& boxes, int lastChild);
+	void link_box_clipnodes(const vector<int>& boxes, int hull);
+
+	int16_t create_partition_nodes(vector<BSPNODE>& newNodes, int x0, int y0, int x1, int y1);
+	int16_t create_partition_clipnodes(vector<BSPCLIPNODE>& newNodes, int hull, int x0, int y0, int x1, int y1, vector<int>& boxes);
+
+	void create_vis(int radius);
+	void create_brush_ents(const GENERATE_OPTIONS& opts);
+};
@@ -2,13 +2,17 @@
 #include <algorithm>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <chrono>
 #include "vis.h"
+#include "trace.h"
 
 BspMerger::BspMerger() {
 
 }
 
-Bsp* BspMerger::merge(vector<Bsp*> maps, vec3 gap, string output_name, bool noripent, bool noscript) {
+Bsp* BspMerger::merge(vector<Bsp*> maps, vec3 gap, string output_name, bool noripent, bool noscript, bool force) {
+	TraceSpan trace("merge");
 	if (maps.size() < 1) {
 		logf("\nMore than 1 map is required for merging. Aborting merge.\n");
 		return NULL;
@@ -16,6 +20,95 @@ Bsp* BspMerger::merge(vector<Bsp*> maps, vec3 gap, string output_name, bool nori
 
 	vector<vector<vector<MAPBLOCK>>> blocks = separate(maps, gap);
 
+	if (blocks.empty()) {
+		logf("\nFailed to arrange maps for merging. Aborting merge.\n");
+		return NULL;
+	}
+
+	vector<vector<MERGEPAIR>> levels = plan_merge(blocks);
+
+	// fail before moving or merging anything if the result won't fit in the BSP limits.
+	// The estimate can be a little high (see merge_estimates), so this can be overridden.
+	if (!estimate_merge(levels)) {
+		if (!force) {
+			logf("\nThe merged map would overflow BSP limits. Aborting merge (use -force to merge anyway).\n");
+			return NULL;
+		}
+		logf("\nWARNING: The merged map may overflow BSP limits. Merging anyway.\n");
+	}
+
+	arrange(blocks, !noripent);
+
+	// Merge order matters. 
+	// The bounding box of a merged map is expanded to contain both maps, and bounding boxes cannot overlap.
+	// Rows are merged along X, then the rows of each layer along Y, then the layers along Z. Each of these
+	// is done as a balanced binary tree to minimize the depth of the merge head nodes. Pairs within a level
+	// of the tree don't share any maps, so they are merged concurrently.
+
+	logf("\nMerging %d maps:\n", maps.size());
+
+	for (int i = 0; i < levels.size(); i++) {
+		vector<MERGEPAIR>& level = levels[i];
+
+		// the progress meter can't show more than one merge at a time
+		bool wasHidden = g_progress.hide;
+		g_progress.hide = wasHidden || (level.size() > 1 && getThreadCount() > 1);
+
+		parallelFor(level.size(), [&](int k, int threadIdx) {
+			merge(*level[k].dst, *level[k].src, level[k].name);
+		}, false, 1);
+
+		g_progress.hide = wasHidden;
+	}
+
+	// total the vis merge spans without counting overlapping time twice
+	sort(visMergeSpans.begin(), visMergeSpans.end());
+	visMergeTime = 0;
+	for (int i = 0; i < visMergeSpans.size(); ) {
+		auto spanStart = visMergeSpans[i].first;
+		auto spanEnd = visMergeSpans[i].second;
+		for (i++; i < visMergeSpans.size() && visMergeSpans[i].first <= spanEnd; i++) {
+			spanEnd = max(spanEnd, visMergeSpans[i].second);
+		}
+		visMergeTime += chrono::duration<double, milli>(spanEnd - spanStart).count();
+	}
+
+	MAPBLOCK& layerStart = blocks[0][0][0];
+	Bsp* output = layerStart.map;
+
+	if (!noripent) {
+		vector<MAPBLOCK> flattenedBlocks;
+		for (int z = 0; z < blocks.size(); z++)
+			for (int y = 0; y < blocks[z].size(); y++)
+				for (int x = 0; x < blocks[z][y].size(); x++)
+					flattenedBlocks.push_back(blocks[z][y][x]);
+
+		logf("\nUpdating map series entity logic:\n");
+		update_map_series_entity_logic(output, flattenedBlocks, maps, output_name, maps[0]->name, noscript);
+	}
+
+	return output;
+}
+
+bool BspMerger::estimate(vector<Bsp*> maps, vec3 gap) {
+	if (maps.size() < 1) {
+		logf("\nMore than 1 map is required for merging.\n");
+		return false;
+	}
+
+	vector<vector<vector<MAPBLOCK>>> blocks = separate(maps, gap);
+
+	if (blocks.empty()) {
+		logf("\nFailed to arrange maps for merging.\n");
+		return false;
+	}
+
+	vector<vector<MERGEPAIR>> levels = plan_merge(blocks);
+
+	return estimate_merge(levels);
+}
+
+void BspMerger::arrange(vector<vector<vector<MAPBLOCK>>>& blocks, bool tagEnts) {
 	logf("\nArranging maps so that they don't overlap:\n");
 
 	for (int z = 0; z < blocks.size(); z++) {
@@ -29,7 +122,7 @@ Bsp* BspMerger::merge(vector<Bsp*> maps, vec3 gap, string output_name, bool nori
 					block.map->move(block.offset);
 				}
 
-				if (!noripent) {
+				if (tagEnts) {
 					// tag ents with the map they belong to
 					for (int i = 0; i < block.map->ents.size(); i++) {
 						block.map->ents[i]->addKeyvalue("$s_bspguy_map_source", toLowerCase(block.map->name));
@@ -38,74 +131,50 @@ Bsp* BspMerger::merge(vector<Bsp*> maps, vec3 gap, string output_name, bool nori
 			}
 		}
 	}
+}
 
-	// Merge order matters. 
-	// The bounding box of a merged map is expanded to contain both maps, and bounding boxes cannot overlap.
-	// TODO: Don't merge linearly. Merge gradually bigger chunks to minimize BSP tree depth.
-	//       Not worth it until more than 27 maps are merged together (merge cube bigger than 3x3x3)
-
-	logf("\nMerging %d maps:\n", maps.size());
+vector<vector<MERGEPAIR>> BspMerger::plan_merge(vector<vector<vector<MAPBLOCK>>>& blocks) {
+	vector<vector<MERGEPAIR>> levels;
 
-	// merge maps along X axis to form rows of maps
-	int rowId = 0;
-	int mergeCount = 1;
+	vector<vector<MAPBLOCK*>> rows;
+	vector<string> rowNames;
 	for (int z = 0; z < blocks.size(); z++) {
 		for (int y = 0; y < blocks[z].size(); y++) {
-			MAPBLOCK& rowStart = blocks[z][y][0];
+			vector<MAPBLOCK*> row;
 			for (int x = 0; x < blocks[z][y].size(); x++) {
-				MAPBLOCK& block = blocks[z][y][x];
-
-				if (x != 0) {
-					//logf("Merge %d,%d,%d -> %d,%d,%d\n", x, y, z, 0, y, z);
-					string merge_name = ++mergeCount < maps.size() ? "row_" + to_string(rowId) : "result";
-					merge(rowStart, block, merge_name);
-				}
+				row.push_back(&blocks[z][y][x]);
 			}
-			rowId++;
+			rows.push_back(row);
+			rowNames.push_back("row_" + to_string(rows.size() - 1));
 		}
 	}
+	plan_merge_levels(rows, rowNames, levels);
 
-	// merge the rows along the Y axis to form layers of maps
-	int colId = 0;
+	vector<vector<MAPBLOCK*>> layers;
+	vector<string> layerNames;
 	for (int z = 0; z < blocks.size(); z++) {
-		MAPBLOCK& colStart = blocks[z][0][0];
+		vector<MAPBLOCK*> layer;
 		for (int y = 0; y < blocks[z].size(); y++) {
-			MAPBLOCK& block = blocks[z][y][0];
-
-			if (y != 0) {
-				//logf("Merge %d,%d,%d -> %d,%d,%d\n", 0, y, z, 0, 0, z);
-				string merge_name = ++mergeCount < maps.size() ? "layer_" + to_string(colId) : "result";
-				merge(colStart, block, merge_name);
-			}
+			layer.push_back(&blocks[z][y][0]);
 		}
-		colId++;
+		layers.push_back(layer);
+		layerNames.push_back("layer_" + to_string(z));
 	}
+	plan_merge_levels(layers, layerNames, levels);
 
-	// merge the layers to form a cube of maps
-	MAPBLOCK& layerStart = blocks[0][0][0];
+	vector<vector<MAPBLOCK*>> cube(1);
+	vector<string> cubeNames(1, "result");
 	for (int z = 0; z < blocks.size(); z++) {
-		MAPBLOCK& block = blocks[z][0][0];
-
-		if (z != 0) {
-			//logf("Merge %d,%d,%d -> %d,%d,%d\n", 0, 0, z, 0, 0, 0);
-			merge(layerStart, block, "result");
-		}
+		cube[0].push_back(&blocks[z][0][0]);
 	}
+	plan_merge_levels(cube, cubeNames, levels);
 
-	Bsp* output = layerStart.map;
-
-	if (!noripent) {
-		vector<MAPBLOCK> flattenedBlocks;
-		for (int z = 0; z < blocks.size(); z++)
-			for (int y = 0; y < blocks[z].size(); y++)
-				for (int x = 0; x < blocks[z][y].size(); x++)
-					flattenedBlocks.push_back(blocks[z][y][x]);
-
-		logf("\nUpdating map series entity logic:\n");
-		update_map_series_entity_logic(output, flattenedBlocks, maps, output_name, maps[0]->name, noscript);
+	// the last merge always produces the final map, whichever axis it was on
+	if (levels.size()) {
+		levels.back()[0].name = "result";
 	}
 
-	return output;
+	return levels;
 }
 
 void BspMerger::merge(MAPBLOCK& dst, MAPBLOCK& src, string resultType) {
@@ -114,7 +183,268 @@ void BspMerger::merge(MAPBLOCK& dst, MAPBLOCK& src, string resultType) {
 	dst.merge_name = resultType;
 	logf("    %-8s = %s + %s\n", dst.merge_name.c_str(), thisName.c_str(), otherName.c_str());
 
-	merge(*dst.map, *src.map);
+	// remap tables are per merge, so a separate merger is used for each pair
+	BspMerger pairMerger;
+	pairMerger.merge(*dst.map, *src.map);
+
+	statsMutex.lock();
+	visMergeSpans.insert(visMergeSpans.end(), pairMerger.visMergeSpans.begin(), pairMerger.visMergeSpans.end());
+	statsMutex.unlock();
+}
+
+void BspMerger::plan_merge_levels(vector<vector<MAPBLOCK*>>& groups, vector<string>& groupNames, vector<vector<MERGEPAIR>>& levels) {
+	// block i absorbs block i+step, so each group collapses into its first block
+	for (int step = 1; ; step *= 2) {
+		vector<MERGEPAIR> level;
+		for (int g = 0; g < groups.size(); g++) {
+			for (int i = 0; i + step < groups[g].size(); i += step * 2) {
+				MERGEPAIR pair;
+				pair.dst = groups[g][i];
+				pair.src = groups[g][i + step];
+				pair.name = groupNames[g];
+				level.push_back(pair);
+			}
+		}
+		if (level.empty()) {
+			break;
+		}
+		levels.push_back(level);
+	}
+}
+
+// the parts of a map that decide how big the merged map will be. Planes, texinfos, and textures are kept
+// so that duplicates are removed exactly like in a real merge. Everything else is just counted.
+struct MERGEESTIMATE
+{
+	string name;
+	STRUCTCOUNT count;
+	int ents;
+	int worldLeaves; // excludes solid leaf 0
+	vec3 mins, maxs; // world bounds
+	vector<BSPPLANE> planes;
+	vector<BSPTEXTUREINFO> texinfos;
+	vector<BSPMIPTEX*> textures; // NULL for textures that aren't embedded
+
+	MERGEESTIMATE(MAPBLOCK* block);
+};
+
+// the map is left where it is. Bounds, planes and texinfos are offset the same way Bsp::move would
+// offset them (without splitting structures shared by the world and submodels, or resizing lightmaps).
+MERGEESTIMATE::MERGEESTIMATE(MAPBLOCK* block) : count(block->map) {
+	Bsp* map = block->map;
+	vec3 offset = block->offset;
+	name = map->name;
+	ents = map->ents.size();
+	worldLeaves = map->modelCount ? map->models[0].nVisLeafs : 0;
+	mins = map->modelCount ? map->models[0].nMins + offset : vec3(0, 0, 0);
+	maxs = map->modelCount ? map->models[0].nMaxs + offset : vec3(0, 0, 0);
+	planes.assign(map->planes, map->planes + map->planeCount);
+	texinfos.assign(map->texinfos, map->texinfos + map->texinfoCount);
+
+	if (map->modelCount && (offset.x != 0 || offset.y != 0 || offset.z != 0)) {
+		STRUCTUSAGE shouldBeMoved(map);
+		map->mark_model_structures(0, &shouldBeMoved, false);
+
+		for (int i = 0; i < planes.size(); i++) {
+			if (shouldBeMoved.planes[i]) {
+				BSPPLANE& plane = planes[i];
+				vec3 newPlaneOri = offset + (plane.vNormal * plane.fDist);
+				plane.fDist = dotProduct(plane.vNormal, newPlaneOri) / dotProduct(plane.vNormal, plane.vNormal);
+			}
+		}
+		for (int i = 0; i < texinfos.size(); i++) {
+			if (shouldBeMoved.texInfo[i]) {
+				texinfos[i] = map->get_moved_texinfo(i, offset);
+			}
+		}
+	}
+
+	for (int i = 0; i < map->textureCount; i++) {
+		int32_t offset = ((int32_t*)map->textures)[i + 1];
+		textures.push_back(offset == -1 ? NULL : (BSPMIPTEX*)(map->textures + offset));
+	}
+}
+
+// compressed size of a run of zeroed vis bits (0 followed by a repeat count, max 255 bytes per run)
+static int zero_vis_run_size(int leafCount) {
+	int bytes = (leafCount + 7) / 8;
+	return 2 * ((bytes + 254) / 255);
+}
+
+// applies the same count changes to a as BspMerger::merge(Bsp&, Bsp&) would to mapA
+static void merge_estimates(MERGEESTIMATE& a, MERGEESTIMATE& b, BSPPLANE separationPlane) {
+	// embedded textures in b reuse the first identical texture in a (see merge_textures)
+	unordered_multimap<uint64_t, int> texIndexes;
+	texIndexes.reserve(a.textures.size());
+	for (int i = 0; i < a.textures.size(); i++) {
+		if (a.textures[i]) {
+			texIndexes.insert(make_pair(hashBytes(a.textures[i], getBspTextureSize(a.textures[i])), i));
+		}
+	}
+
+	vector<int> texRemap;
+	texRemap.reserve(b.textures.size());
+	for (int i = 0; i < b.textures.size(); i++) {
+		BSPMIPTEX* tex = b.textures[i];
+		int match = -1;
+
+		if (tex) {
+			int sz = getBspTextureSize(tex);
+			auto range = texIndexes.equal_range(hashBytes(tex, sz));
+			for (auto it = range.first; it != range.second; it++) {
+				BSPMIPTEX* thisTex = a.textures[it->second];
+				if ((match == -1 || it->second < match) && getBspTextureSize(thisTex) == sz && memcmp(tex, thisTex, sz) == 0) {
+					match = it->second;
+				}
+			}
+		}
+
+		if (match == -1) {
+			match = a.textures.size();
+			a.textures.push_back(tex);
+		}
+		texRemap.push_back(match);
+	}
+
+	unordered_map<BSPPLANE, int, RawBytesHash<BSPPLANE>, RawBytesEqual<BSPPLANE>> planeIndexes;
+	planeIndexes.reserve(a.planes.size());
+	for (int i = 0; i < a.planes.size(); i++) {
+		planeIndexes.insert(make_pair(a.planes[i], i));
+	}
+	for (int i = 0; i < b.planes.size(); i++) {
+		if (planeIndexes.find(b.planes[i]) == planeIndexes.end()) {
+			a.planes.push_back(b.planes[i]);
+		}
+	}
+
+	// see create_merge_headnodes
+	if (separationPlane.vNormal.x < 0 || separationPlane.vNormal.y < 0 || separationPlane.vNormal.z < 0)
+		separationPlane.vNormal = separationPlane.vNormal.invert();
+	a.planes.push_back(separationPlane);
+
+	unordered_map<BSPTEXTUREINFO, int, RawBytesHash<BSPTEXTUREINFO>, RawBytesEqual<BSPTEXTUREINFO>> infoIndexes;
+	infoIndexes.reserve(a.texinfos.size());
+	for (int i = 0; i < a.texinfos.size(); i++) {
+		infoIndexes.insert(make_pair(a.texinfos[i], i));
+	}
+	for (int i = 0; i < b.texinfos.size(); i++) {
+		BSPTEXTUREINFO info = b.texinfos[i];
+		if (info.iMiptex >= 0 && info.iMiptex < texRemap.size()) {
+			info.iMiptex = texRemap[info.iMiptex];
+		}
+		if (infoIndexes.find(info) == infoIndexes.end()) {
+			a.texinfos.push_back(info);
+		}
+	}
+
+	// Each world leaf row is extended with zeros for the other map's leaves. This ignores
+	// rows that compress to the same data, so the real vis lump is usually a bit smaller.
+	int thisVisLeaves = a.count.leaves - 1;
+	int otherVisLeaves = b.count.leaves - 1;
+	a.count.visdata += b.count.visdata
+		+ a.worldLeaves * zero_vis_run_size(otherVisLeaves)
+		+ b.worldLeaves * zero_vis_run_size(thisVisLeaves);
+
+	// a full-bright lightmap is added if only one of the maps has lighting (see merge_lighting)
+	int fullBrightSize = MAX_SURFACE_EXTENT * MAX_SURFACE_EXTENT * sizeof(COLOR3);
+	if (a.count.lightdata == 0 && b.count.lightdata != 0) {
+		a.count.lightdata = fullBrightSize;
+	}
+	a.count.lightdata += (b.count.lightdata == 0 && a.count.lightdata != 0) ? fullBrightSize : b.count.lightdata;
+
+	a.count.planes = a.planes.size();
+	a.count.texInfos = a.texinfos.size();
+	a.count.textures = a.textures.size();
+	a.count.verts += b.count.verts;
+	a.count.edges += b.count.edges;
+	a.count.surfEdges += b.count.surfEdges;
+	a.count.faces += b.count.faces;
+	a.count.markSurfs += b.count.markSurfs;
+	a.count.leaves += b.count.leaves - 1; // shared solid leaf
+	a.count.nodes += b.count.nodes + 1; // new head node
+	a.count.clipnodes += b.count.clipnodes + (MAX_MAP_HULLS - 1); // new head node per clipping hull
+	a.count.models += b.count.models - 1; // shared world model
+	a.ents += b.ents - 1; // shared worldspawn
+	a.worldLeaves += b.worldLeaves;
+
+	a.mins = vec3(min(a.mins.x, b.mins.x), min(a.mins.y, b.mins.y), min(a.mins.z, b.mins.z));
+	a.maxs = vec3(max(a.maxs.x, b.maxs.x), max(a.maxs.y, b.maxs.y), max(a.maxs.z, b.maxs.z));
+}
+
+bool BspMerger::estimate_merge(vector<vector<MERGEPAIR>>& levels) {
+	auto startTime = chrono::steady_clock::now();
+
+	logf("\nEstimating merged map limits:\n");
+
+	map<MAPBLOCK*, MERGEESTIMATE*> estimates;
+	for (int i = 0; i < levels.size(); i++) {
+		for (int k = 0; k < levels[i].size(); k++) {
+			MAPBLOCK* blocks[2] = { levels[i][k].dst, levels[i][k].src };
+			for (int b = 0; b < 2; b++) {
+				if (!estimates.count(blocks[b])) {
+					estimates[blocks[b]] = new MERGEESTIMATE(blocks[b]);
+				}
+			}
+		}
+	}
+
+	bool fits = true;
+	bool separated = true;
+	int mergeCount = 0;
+	MERGEESTIMATE* result = NULL;
+
+	for (int i = 0; i < levels.size() && separated; i++) {
+		for (int k = 0; k < levels[i].size(); k++) {
+			MERGEESTIMATE& a = *estimates[levels[i][k].dst];
+			MERGEESTIMATE& b = *estimates[levels[i][k].src];
+			string thisName = a.name;
+			a.name = levels[i][k].name;
+
+			logf("    %-8s = %s + %s", a.name.c_str(), thisName.c_str(), b.name.c_str());
+
+			BSPPLANE separationPlane = get_separation_plane(a.mins, a.maxs, b.mins, b.maxs);
+			if (separationPlane.nType == -1) {
+				logf("  (no separating axis)\n");
+				separated = false;
+				break;
+			}
+
+			merge_estimates(a, b, separationPlane);
+			result = &a;
+			mergeCount++;
+
+			vector<LIMITSTAT> stats = get_limit_stats(a.count, a.ents);
+			int overflowIdx = find_overflowed_limit(stats);
+			if (overflowIdx != -1) {
+				LIMITSTAT& stat = stats[overflowIdx];
+				logf("  (overflows %s: %u / %u)\n", stat.name, stat.val, stat.max);
+			}
+			else {
+				logf("  (OK)\n");
+			}
+			fits = fits && overflowIdx == -1;
+		}
+	}
+
+	if (result && separated) {
+		logf("\nEstimated result:\n");
+		logf(" Data Type     Current / Max       Fullness\n");
+		logf("------------  -------------------  --------\n");
+
+		vector<LIMITSTAT> stats = get_limit_stats(result->count, result->ents);
+		for (int s = 0; s < stats.size(); s++) {
+			Bsp::print_stat(stats[s].name, stats[s].val, stats[s].max, stats[s].isMem);
+		}
+	}
+
+	for (auto it = estimates.begin(); it != estimates.end(); it++) {
+		delete it->second;
+	}
+
+	double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+	logf("\nEstimated %d merges in %.0f ms\n", mergeCount, elapsed);
+
+	return fits && separated;
 }
 
 vector<vector<vector<MAPBLOCK>>> BspMerger::separate(vector<Bsp*>& maps, vec3 gap) {
@@ -229,6 +559,7 @@ typedef map< string, MAPBLOCK > mapStringToMapBlock;
 
 void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>& sourceMaps, 
 		vector<Bsp*>& mapOrder, string output_name, string firstMapName, bool noscript) {
+	TraceSpan trace("update_map_series_entity_logic");
 	int originalEntCount = mergedMap->ents.size();
 	int renameCount = force_unique_ent_names_per_map(mergedMap);
 
@@ -283,9 +614,9 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 	string startingSky = "desert";
 	for (int k = 0; k < mergedMap->ents.size(); k++) {
 		Entity* ent = mergedMap->ents[k];
-		if (ent->keyvalues["classname"] == "worldspawn") {
+		if (ent->getKeyvalue("classname") == "worldspawn") {
 			if (ent->hasKey("skyname")) {
-				startingSky = toLowerCase(ent->keyvalues["skyname"]);
+				startingSky = toLowerCase(ent->getKeyvalue("skyname"));
 			}
 		}
 	}
@@ -295,9 +626,9 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 		string skyname = "desert";
 		for (int k = 0; k < sourceMaps[i].map->ents.size(); k++) {
 			Entity* ent = sourceMaps[i].map->ents[k];
-			if (ent->keyvalues["classname"] == "worldspawn") {
+			if (ent->getKeyvalue("classname") == "worldspawn") {
 				if (ent->hasKey("skyname")) {
-					skyname = toLowerCase(ent->keyvalues["skyname"]);
+					skyname = toLowerCase(ent->getKeyvalue("skyname"));
 				}
 			}
 		}
@@ -320,10 +651,10 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 
 	for (int i = 0; i < originalEntCount; i++) {
 		Entity* ent = mergedMap->ents[i];
-		string cname = ent->keyvalues["classname"];
-		string tname = ent->keyvalues["targetname"];
-		string source_map = ent->keyvalues["$s_bspguy_map_source"];
-		int spawnflags = atoi(ent->keyvalues["spawnflags"].c_str());
+		string cname = ent->getKeyvalue("classname");
+		string tname = ent->getKeyvalue("targetname");
+		string source_map = ent->getKeyvalue("$s_bspguy_map_source");
+		int spawnflags = atoi(ent->getKeyvalue("spawnflags").c_str());
 		bool isInFirstMap = toLowerCase(source_map) == toLowerCase(firstMapName);
 		vec3 origin;
 
@@ -333,7 +664,7 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 		}
 
 		if (ent->hasKey("origin")) {
-			origin = Keyvalue("origin", ent->keyvalues["origin"]).getVector();
+			origin = Keyvalue("origin", ent->getKeyvalue("origin")).getVector();
 		}
 		if (ent->isBspModel()) {
 			origin = mergedMap->get_model_center(ent->getBspModelIdx());
@@ -342,7 +673,8 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 		if (noscript && (cname == "info_player_start" || cname == "info_player_coop" || cname == "info_player_dm2")) {
 			// info_player_start ents are ignored if there is any active info_player_deathmatch,
 			// so this may break spawns if there are a mix of spawn types
-			cname = ent->keyvalues["classname"] = "info_player_deathmatch";
+			cname = "info_player_deathmatch";
+			ent->setOrAddKeyvalue("classname", cname);
 		}
 
 		if (noscript && !isInFirstMap) {
@@ -365,13 +697,13 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 			}
 			if (cname == "trigger_auto") {
 				ent->addKeyvalue("targetname", "bspguy_autos_" + source_map);
-				ent->keyvalues["classname"] = "trigger_relay";
+				ent->setOrAddKeyvalue("classname", "trigger_relay");
 			}
 			if (cname.find("monster_") == 0 && cname.rfind("_dead") != cname.size()-5) {
 				// replace with a squadmaker and spawn when this map section starts
 
 				updated_monsters++;
-				hashmap oldKeys = ent->keyvalues;
+				Entity oldKeys = *ent;
 
 				string spawn_name = "bspguy_npcs_" + source_map;
 
@@ -385,46 +717,46 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 				// - apache/osprey targets, and any other monster-specific keys
 
 				ent->clearAllKeyvalues();
-				ent->addKeyvalue("origin", oldKeys["origin"]);
-				ent->addKeyvalue("angles", oldKeys["angles"]);
+				ent->addKeyvalue("origin", oldKeys.getKeyvalue("origin"));
+				ent->addKeyvalue("angles", oldKeys.getKeyvalue("angles"));
 				ent->addKeyvalue("targetname", spawn_name);
-				ent->addKeyvalue("netname", oldKeys["targetname"]);
+				ent->addKeyvalue("netname", oldKeys.getKeyvalue("targetname"));
 				//ent->addKeyvalue("target", "bspguy_npc_spawn_" + toLowerCase(source_map));
-				if (oldKeys["rendermode"] != "0") {
-					ent->addKeyvalue("renderfx", oldKeys["renderfx"]);
-					ent->addKeyvalue("rendermode", oldKeys["rendermode"]);
-					ent->addKeyvalue("renderamt", oldKeys["renderamt"]);
-					ent->addKeyvalue("rendercolor", oldKeys["rendercolor"]);
+				if (oldKeys.getKeyvalue("rendermode") != "0") {
+					ent->addKeyvalue("renderfx", oldKeys.getKeyvalue("renderfx"));
+					ent->addKeyvalue("rendermode", oldKeys.getKeyvalue("rendermode"));
+					ent->addKeyvalue("renderamt", oldKeys.getKeyvalue("renderamt"));
+					ent->addKeyvalue("rendercolor", oldKeys.getKeyvalue("rendercolor"));
 					ent->addKeyvalue("change_rendermode", "1");
 				}
-				ent->addKeyvalue("classify", oldKeys["classify"]);
-				ent->addKeyvalue("is_not_revivable", oldKeys["is_not_revivable"]);
-				ent->addKeyvalue("bloodcolor", oldKeys["bloodcolor"]);
-				ent->addKeyvalue("health", oldKeys["health"]);
-				ent->addKeyvalue("minhullsize", oldKeys["minhullsize"]);
-				ent->addKeyvalue("maxhullsize", oldKeys["maxhullsize"]);
-				ent->addKeyvalue("freeroam", oldKeys["freeroam"]);
+				ent->addKeyvalue("classify", oldKeys.getKeyvalue("classify"));
+				ent->addKeyvalue("is_not_revivable", oldKeys.getKeyvalue("is_not_revivable"));
+				ent->addKeyvalue("bloodcolor", oldKeys.getKeyvalue("bloodcolor"));
+				ent->addKeyvalue("health", oldKeys.getKeyvalue("health"));
+				ent->addKeyvalue("minhullsize", oldKeys.getKeyvalue("minhullsize"));
+				ent->addKeyvalue("maxhullsize", oldKeys.getKeyvalue("maxhullsize"));
+				ent->addKeyvalue("freeroam", oldKeys.getKeyvalue("freeroam"));
 				ent->addKeyvalue("monstercount", "1");
 				ent->addKeyvalue("delay", "0");
 				ent->addKeyvalue("m_imaxlivechildren", "1");
 				ent->addKeyvalue("spawn_mode", "2"); // force spawn, never block
 				ent->addKeyvalue("dmg", "0"); // telefrag damage
-				ent->addKeyvalue("trigger_condition", oldKeys["TriggerCondition"]);
-				ent->addKeyvalue("trigger_target", oldKeys["TriggerTarget"]);
-				ent->addKeyvalue("trigger_target", oldKeys["TriggerTarget"]);
+				ent->addKeyvalue("trigger_condition", oldKeys.getKeyvalue("TriggerCondition"));
+				ent->addKeyvalue("trigger_target", oldKeys.getKeyvalue("TriggerTarget"));
+				ent->addKeyvalue("trigger_target", oldKeys.getKeyvalue("TriggerTarget"));
 				ent->addKeyvalue("notsolid", "-1");
 				ent->addKeyvalue("gag", (spawnflags & 2) ? "1" : "0");
-				ent->addKeyvalue("weapons", oldKeys["weapons"]);
-				ent->addKeyvalue("new_body", oldKeys["body"]);
-				ent->addKeyvalue("respawn_as_playerally", oldKeys["is_player_ally"]);
-				ent->addKeyvalue("monstertype", oldKeys["classname"]);
-				ent->addKeyvalue("displayname", oldKeys["displayname"]);
-				ent->addKeyvalue("squadname", oldKeys["netname"]);
-				ent->addKeyvalue("new_model", oldKeys["model"]);
-				ent->addKeyvalue("soundlist", oldKeys["soundlist"]);
-				ent->addKeyvalue("path_name", oldKeys["path_name"]);
-				ent->addKeyvalue("guard_ent", oldKeys["guard_ent"]);
-				ent->addKeyvalue("$s_bspguy_map_source", oldKeys["$s_bspguy_map_source"]);
+				ent->addKeyvalue("weapons", oldKeys.getKeyvalue("weapons"));
+				ent->addKeyvalue("new_body", oldKeys.getKeyvalue("body"));
+				ent->addKeyvalue("respawn_as_playerally", oldKeys.getKeyvalue("is_player_ally"));
+				ent->addKeyvalue("monstertype", oldKeys.getKeyvalue("classname"));
+				ent->addKeyvalue("displayname", oldKeys.getKeyvalue("displayname"));
+				ent->addKeyvalue("squadname", oldKeys.getKeyvalue("netname"));
+				ent->addKeyvalue("new_model", oldKeys.getKeyvalue("model"));
+				ent->addKeyvalue("soundlist", oldKeys.getKeyvalue("soundlist"));
+				ent->addKeyvalue("path_name", oldKeys.getKeyvalue("path_name"));
+				ent->addKeyvalue("guard_ent", oldKeys.getKeyvalue("guard_ent"));
+				ent->addKeyvalue("$s_bspguy_map_source", oldKeys.getKeyvalue("$s_bspguy_map_source"));
 				ent->addKeyvalue("spawnflags", to_string(newFlags));
 				ent->addKeyvalue("classname", "squadmaker");
 				ent->clearEmptyKeyvalues(); // things like the model keyvalue will break the monster if it's set but empty
@@ -442,7 +774,7 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 		if (cname == "trigger_changelevel") {
 			replaced_changelevels++;
 
-			string map = toLowerCase(ent->keyvalues["map"]);
+			string map = toLowerCase(ent->getKeyvalue("map"));
 			bool isMergedMap = false;
 			for (int i = 0; i < sourceMaps.size(); i++) {
 				if (map == toLowerCase(sourceMaps[i].map->name)) {
@@ -461,9 +793,9 @@ void BspMerger::update_map_series_entity_logic(Bsp* mergedMap, vector<MAPBLOCK>&
 				logf("\nWarning: use-only trigger_changelevel has no targetname\n");
 
 			if (!(spawnflags & 2)) {
-				string model = ent->keyvalues["model"];
+				string model = ent->getKeyvalue("model");
 
-				string oldOrigin = ent->keyvalues["origin"];
+				string oldOrigin = ent->getKeyvalue("origin");
 				ent->clearAllKeyvalues();
 				ent->addKeyvalue("origin", oldOrigin);
 				ent->addKeyvalue("model", model);
@@ -715,8 +1047,8 @@ int BspMerger::force_unique_ent_names_per_map(Bsp* mergedMap) {
 
 	for (int i = 0; i < mergedMap->ents.size(); i++) {
 		Entity* ent = mergedMap->ents[i];
-		string tname = ent->keyvalues["targetname"];
-		string source_map = ent->keyvalues["$s_bspguy_map_source"];
+		string tname = ent->getKeyvalue("targetname");
+		string source_map = ent->getKeyvalue("$s_bspguy_map_source");
 
 		if (tname.empty())
 			continue;
@@ -740,6 +1072,8 @@ int BspMerger::force_unique_ent_names_per_map(Bsp* mergedMap) {
 
 	g_progress.update("Renaming entities", renameCount);
 
+	mergedMap->update_ent_name_index();
+
 	int renameSuffix = 2;
 	for (auto it = entsToRename.begin(); it != entsToRename.end(); ++it) {
 		for (auto it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
@@ -748,12 +1082,20 @@ int BspMerger::force_unique_ent_names_per_map(Bsp* mergedMap) {
 
 			//logf << "\nRenaming " << *it2 << " to " << newName << endl;
 
-			for (int i = 0; i < mergedMap->ents.size(); i++) {
-				Entity* ent = mergedMap->ents[i];
-				if (ent->keyvalues["$s_bspguy_map_source"] != it->first)
+			// only ents named oldName or triggering it can have values to rename
+			vector<int> refs = mergedMap->get_named_ents(oldName);
+			vector<int> callers = mergedMap->get_caller_ents(oldName);
+			refs.insert(refs.end(), callers.begin(), callers.end());
+			sort(refs.begin(), refs.end());
+			refs.erase(unique(refs.begin(), refs.end()), refs.end());
+
+			for (int i = 0; i < refs.size(); i++) {
+				Entity* ent = mergedMap->ents[refs[i]];
+				if (ent->getKeyvalue("$s_bspguy_map_source") != it->first)
 					continue;
 
 				ent->renameTargetnameValues(oldName, newName);
+				mergedMap->update_ent_name_index(refs[i]);
 			}
 
 			g_progress.tick();
@@ -764,6 +1106,7 @@ int BspMerger::force_unique_ent_names_per_map(Bsp* mergedMap) {
 }
 
 bool BspMerger::merge(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_pair");
 	// TODO: Create a new map and store result there. Don't break mapA.
 
 	BSPPLANE separationPlane = separate(mapA, mapB);
@@ -794,9 +1137,9 @@ bool BspMerger::merge(Bsp& mapA, Bsp& mapB) {
 		}
 		else if (!mapA.lumps[i]) {
 			logf("Replacing %s lump\n", g_lump_names[i]);
-			mapA.header.lump[i].nLength = mapB.header.lump[i].nLength;
-			mapA.lumps[i] = new byte[mapB.header.lump[i].nLength];
-			memcpy(mapA.lumps[i], mapB.lumps[i], mapB.header.lump[i].nLength);
+			byte* newLump = new byte[mapB.header.lump[i].nLength];
+			memcpy(newLump, mapB.lumps[i], mapB.header.lump[i].nLength);
+			mapA.replace_lump(i, newLump, mapB.header.lump[i].nLength);
 
 			// process the lump here (TODO: faster to just copy wtv needs copying)
 			switch (i) {
@@ -855,7 +1198,9 @@ bool BspMerger::merge(Bsp& mapA, Bsp& mapB) {
 
 	// doing this last because it takes way longer than anything else, and limit overflows should fail the
 	// merge as soon as possible. // TODO: fail fast if overflow detected in other merges? Kind ni
+	auto visStart = chrono::steady_clock::now();
 	merge_vis(mapA, mapB);
+	visMergeSpans.push_back(make_pair(visStart, chrono::steady_clock::now()));
 
 	g_progress.clear();
 
@@ -871,6 +1216,21 @@ BSPPLANE BspMerger::separate(Bsp& mapA, Bsp& mapB) {
 	vec3 bmin = otherWorld.nMins;
 	vec3 bmax = otherWorld.nMaxs;
 
+	BSPPLANE separationPlane = get_separation_plane(amin, amax, bmin, bmax);
+
+	if (separationPlane.nType == -1) {
+		logf("Bounding boxes for each map:\n");
+		logf("(%6.0f, %6.0f, %6.0f)", amin.x, amin.y, amin.z);
+		logf(" - (%6.0f, %6.0f, %6.0f) %s\n", amax.x, amax.y, amax.z, mapA.name.c_str());
+
+		logf("(%6.0f, %6.0f, %6.0f)", bmin.x, bmin.y, bmin.z);
+		logf(" - (%6.0f, %6.0f, %6.0f) %s\n", bmax.x, bmax.y, bmax.z, mapB.name.c_str());
+	}
+
+	return separationPlane;
+}
+
+BSPPLANE BspMerger::get_separation_plane(vec3 amin, vec3 amax, vec3 bmin, vec3 bmax) {
 	BSPPLANE separationPlane;
 	memset(&separationPlane, 0, sizeof(BSPPLANE));
 
@@ -907,13 +1267,6 @@ BSPPLANE BspMerger::separate(Bsp& mapA, Bsp& mapB) {
 	}
 	else {
 		separationPlane.nType = -1; // no simple separating axis
-
-		logf("Bounding boxes for each map:\n");
-		logf("(%6.0f, %6.0f, %6.0f)", amin.x, amin.y, amin.z);
-		logf(" - (%6.0f, %6.0f, %6.0f) %s\n", amax.x, amax.y, amax.z, mapA.name.c_str());
-
-		logf("(%6.0f, %6.0f, %6.0f)", bmin.x, bmin.y, bmin.z);
-		logf(" - (%6.0f, %6.0f, %6.0f) %s\n", bmax.x, bmax.y, bmax.z, mapB.name.c_str());
 	}
 
 	return separationPlane;
@@ -921,6 +1274,7 @@ BSPPLANE BspMerger::separate(Bsp& mapA, Bsp& mapB) {
 
 void BspMerger::merge_ents(Bsp& mapA, Bsp& mapB)
 {
+	TraceSpan trace("merge_ents");
 	g_progress.update("Merging entities", mapA.ents.size() + mapB.ents.size());
 
 	int oldEntCount = mapA.ents.size();
@@ -928,26 +1282,26 @@ void BspMerger::merge_ents(Bsp& mapA, Bsp& mapB)
 	// update model indexes since this map's models will be appended after the other map's models
 	int otherModelCount = (mapB.header.lump[LUMP_MODELS].nLength / sizeof(BSPMODEL)) - 1;
 	for (int i = 0; i < mapA.ents.size(); i++) {
-		if (!mapA.ents[i]->hasKey("model") || mapA.ents[i]->keyvalues["model"][0] != '*') {
+		if (!mapA.ents[i]->hasKey("model") || mapA.ents[i]->getKeyvalue("model")[0] != '*') {
 			continue;
 		}
-		string modelIdxStr = mapA.ents[i]->keyvalues["model"].substr(1);
+		string modelIdxStr = mapA.ents[i]->getKeyvalue("model").substr(1);
 
 		if (!isNumeric(modelIdxStr)) {
 			continue;
 		}
 
 		int newModelIdx = atoi(modelIdxStr.c_str()) + otherModelCount;
-		mapA.ents[i]->keyvalues["model"] = "*" + to_string(newModelIdx);
+		mapA.ents[i]->setOrAddKeyvalue("model", "*" + to_string(newModelIdx));
 
 		g_progress.tick();
 	}
 
 	for (int i = 0; i < mapB.ents.size(); i++) {
-		if (mapB.ents[i]->keyvalues["classname"] == "worldspawn") {
+		if (mapB.ents[i]->getKeyvalue("classname") == "worldspawn") {
 			Entity* otherWorldspawn = mapB.ents[i];
 
-			vector<string> otherWads = splitString(otherWorldspawn->keyvalues["wad"], ";");
+			vector<string> otherWads = splitString(otherWorldspawn->getKeyvalue("wad"), ";");
 
 			// strip paths from wad names
 			for (int j = 0; j < otherWads.size(); j++) {
@@ -956,14 +1310,14 @@ void BspMerger::merge_ents(Bsp& mapA, Bsp& mapB)
 
 			Entity* worldspawn = NULL;
 			for (int k = 0; k < mapA.ents.size(); k++) {
-				if (mapA.ents[k]->keyvalues["classname"] == "worldspawn") {
+				if (mapA.ents[k]->getKeyvalue("classname") == "worldspawn") {
 					worldspawn = mapA.ents[k];
 					break;
 				}
 			}
 
 			// merge wad list
-			vector<string> thisWads = splitString(worldspawn->keyvalues["wad"], ";");
+			vector<string> thisWads = splitString(worldspawn->getKeyvalue("wad"), ";");
 
 			// strip paths from wad names
 			for (int j = 0; j < thisWads.size(); j++) {
@@ -977,53 +1331,55 @@ void BspMerger::merge_ents(Bsp& mapA, Bsp& mapB)
 				}
 			}
 
-			worldspawn->keyvalues["wad"] = "";
+			string wadList;
 			for (int j = 0; j < thisWads.size(); j++) {
-				worldspawn->keyvalues["wad"] += thisWads[j] + ";";
+				wadList += thisWads[j] + ";";
 			}
+			worldspawn->setOrAddKeyvalue("wad", wadList);
 
 			// include prefixed version of the other maps keyvalues
-			for (auto it = otherWorldspawn->keyvalues.begin(); it != otherWorldspawn->keyvalues.end(); it++) {
-				if (it->first == "classname" || it->first == "wad") {
+			for (int k = 0; k < otherWorldspawn->keyCount(); k++) {
+				if (otherWorldspawn->getKey(k) == "classname" || otherWorldspawn->getKey(k) == "wad") {
 					continue;
 				}
 				// TODO: unknown keyvalues crash the game? Try something else.
-				//worldspawn->addKeyvalue(Keyvalue(mapB.name + "_" + it->first, it->second));
+				//worldspawn->addKeyvalue(Keyvalue(mapB.name + "_" + otherWorldspawn->getKey(k), otherWorldspawn->getValue(k)));
 			}
 		}
 		else {
-			Entity* copy = new Entity();
-			copy->keyvalues = mapB.ents[i]->keyvalues;
-			copy->keyOrder = mapB.ents[i]->keyOrder;
+			Entity* copy = new Entity(*mapB.ents[i]);
 			mapA.ents.push_back(copy);
 		}
 
 		g_progress.tick();
 	}
 
+	mapA.invalidate_model_ent_index();
 	mapA.update_ent_lump();
 }
 
 void BspMerger::merge_planes(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_planes");
 	g_progress.update("Merging planes", mapA.planeCount + mapB.planeCount);
 
 	vector<BSPPLANE> mergedPlanes;
 	mergedPlanes.reserve(mapA.planeCount + mapB.planeCount);
 
+	// first index of each unique plane in mapA
+	unordered_map<BSPPLANE, int, RawBytesHash<BSPPLANE>, RawBytesEqual<BSPPLANE>> planeIndexes;
+	planeIndexes.reserve(mapA.planeCount);
+
 	for (int i = 0; i < mapA.planeCount; i++) {
 		mergedPlanes.push_back(mapA.planes[i]);
+		planeIndexes.insert(make_pair(mapA.planes[i], i));
 		g_progress.tick();
 	}
 	for (int i = 0; i < mapB.planeCount; i++) {
-		bool isUnique = true;
-		for (int k = 0; k < mapA.planeCount; k++) {
-			if (memcmp(&mapB.planes[i], &mapA.planes[k], sizeof(BSPPLANE)) == 0) {
-				isUnique = false;
-				planeRemap.push_back(k);
-				break;
-			}
+		auto match = planeIndexes.find(mapB.planes[i]);
+		if (match != planeIndexes.end()) {
+			planeRemap.push_back(match->second);
 		}
-		if (isUnique) {
+		else {
 			planeRemap.push_back(mergedPlanes.size());
 			mergedPlanes.push_back(mapB.planes[i]);
 		}
@@ -1043,6 +1399,7 @@ void BspMerger::merge_planes(Bsp& mapA, Bsp& mapB) {
 }
 
 void BspMerger::merge_textures(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_textures");
 	uint32_t newTexCount = 0;
 
 	// temporary buffer for holding miptex + embedded textures (too big but doesn't matter)
@@ -1137,6 +1494,7 @@ void BspMerger::merge_textures(Bsp& mapA, Bsp& mapB) {
 }
 
 void BspMerger::merge_vertices(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_vertices");
 	thisVertCount = mapA.vertCount;
 	int totalVertCount = thisVertCount + mapB.vertCount;
 
@@ -1153,13 +1511,19 @@ void BspMerger::merge_vertices(Bsp& mapA, Bsp& mapB) {
 }
 
 void BspMerger::merge_texinfo(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_texinfo");
 	g_progress.update("Merging texinfos", mapA.texinfoCount + mapB.texinfoCount);
 
 	vector<BSPTEXTUREINFO> mergedInfo;
 	mergedInfo.reserve(mapA.texinfoCount + mapB.texinfoCount);
 
+	// first index of each unique texinfo in mapA
+	unordered_map<BSPTEXTUREINFO, int, RawBytesHash<BSPTEXTUREINFO>, RawBytesEqual<BSPTEXTUREINFO>> infoIndexes;
+	infoIndexes.reserve(mapA.texinfoCount);
+
 	for (int i = 0; i < mapA.texinfoCount; i++) {
 		mergedInfo.push_back(mapA.texinfos[i]);
+		infoIndexes.insert(make_pair(mapA.texinfos[i], i));
 		g_progress.tick();
 	}
 
@@ -1167,16 +1531,11 @@ void BspMerger::merge_texinfo(Bsp& mapA, Bsp& mapB) {
 		BSPTEXTUREINFO info = mapB.texinfos[i];
 		info.iMiptex = texRemap[info.iMiptex];
 
-		bool isUnique = true;
-		for (int k = 0; k < mapA.texinfoCount; k++) {
-			if (memcmp(&info, &mapA.texinfos[k], sizeof(BSPTEXTUREINFO)) == 0) {
-				texInfoRemap.push_back(k);
-				isUnique = false;
-				break;
-			}
+		auto match = infoIndexes.find(info);
+		if (match != infoIndexes.end()) {
+			texInfoRemap.push_back(match->second);
 		}
-
-		if (isUnique) {
+		else {
 			texInfoRemap.push_back(mergedInfo.size());
 			mergedInfo.push_back(info);
 		}
@@ -1193,6 +1552,7 @@ void BspMerger::merge_texinfo(Bsp& mapA, Bsp& mapB) {
 }
 
 void BspMerger::merge_faces(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_faces");
 	thisFaceCount = mapA.faceCount;
 	otherFaceCount = mapB.faceCount;
 	thisWorldFaceCount = mapA.models[0].nFaces;
@@ -1237,6 +1597,7 @@ void BspMerger::merge_faces(Bsp& mapA, Bsp& mapB) {
 }
 
 void BspMerger::merge_leaves(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_leaves");
 	thisLeafCount = mapA.header.lump[LUMP_LEAVES].nLength / sizeof(BSPLEAF);
 	otherLeafCount = mapB.header.lump[LUMP_LEAVES].nLength / sizeof(BSPLEAF);
 
@@ -1290,6 +1651,7 @@ void BspMerger::merge_leaves(Bsp& mapA, Bsp& mapB) {
 }
 
 void BspMerger::merge_marksurfs(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_marksurfs");
 	thisMarkSurfCount = mapA.marksurfCount;
 	int totalSurfCount = thisMarkSurfCount + mapB.marksurfCount;
 
@@ -1318,6 +1680,7 @@ void BspMerger::merge_marksurfs(Bsp& mapA, Bsp& mapB) {
 }
 
 void BspMerger::merge_edges(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_edges");
 	thisEdgeCount = mapA.header.lump[LUMP_EDGES].nLength / sizeof(BSPEDGE);
 	int totalEdgeCount = thisEdgeCount + mapB.edgeCount;
 
@@ -1339,6 +1702,7 @@ void BspMerger::merge_edges(Bsp& mapA, Bsp& mapB) {
 }
 
 void BspMerger::merge_surfedges(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_surfedges");
 	thisSurfEdgeCount = mapA.surfedgeCount;
 	int totalSurfCount = thisSurfEdgeCount + mapB.surfedgeCount;
 
@@ -1359,6 +1723,7 @@ void BspMerger::merge_surfedges(Bsp& mapA, Bsp& mapB) {
 }
 
 void BspMerger::merge_nodes(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_nodes");
 	thisNodeCount = mapA.nodeCount;
 
 	g_progress.update("Merging nodes", thisNodeCount + mapB.nodeCount);
@@ -1416,6 +1781,7 @@ void BspMerger::merge_nodes(Bsp& mapA, Bsp& mapB) {
 }
 
 void BspMerger::merge_clipnodes(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_clipnodes");
 	thisClipnodeCount = mapA.clipnodeCount;
 
 	g_progress.update("Merging clipnodes", thisClipnodeCount + mapB.clipnodeCount);
@@ -1458,6 +1824,7 @@ void BspMerger::merge_clipnodes(Bsp& mapA, Bsp& mapB) {
 }
 
 void BspMerger::merge_models(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_models");
 	g_progress.update("Merging models", mapA.modelCount + mapB.modelCount);
 
 	vector<BSPMODEL> mergedModels;
@@ -1520,6 +1887,7 @@ void BspMerger::merge_models(Bsp& mapA, Bsp& mapB) {
 }
 
 void BspMerger::merge_vis(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_vis");
 	BSPLEAF* allLeaves = mapA.leaves; // combined with mapB's leaves earlier in merge_leaves
 
 	int thisVisLeaves = thisLeafCount - 1; // VIS ignores the shared solid leaf 0
@@ -1569,6 +1937,7 @@ void BspMerger::merge_vis(Bsp& mapA, Bsp& mapB) {
 }
 
 void BspMerger::merge_lighting(Bsp& mapA, Bsp& mapB) {
+	TraceSpan trace("merge_lighting");
 	COLOR3* thisRad = (COLOR3*)mapA.lightdata;
 	COLOR3* otherRad = (COLOR3*)mapB.lightdata;
 	int thisColorCount = mapA.header.lump[LUMP_LIGHTING].nLength / sizeof(COLOR3);
@@ -1583,8 +1952,7 @@ void BspMerger::merge_lighting(Bsp& mapA, Bsp& mapB) {
 		thisColorCount = MAX_SURFACE_EXTENT * MAX_SURFACE_EXTENT;
 		totalColorCount += thisColorCount;
 		int sz = thisColorCount * sizeof(COLOR3);
-		mapA.lumps[LUMP_LIGHTING] = new byte[sz];
-		mapA.header.lump[LUMP_LIGHTING].nLength = sz;
+		mapA.replace_lump(LUMP_LIGHTING, new byte[sz], sz);
 		thisRad = (COLOR3*)mapA.lumps[LUMP_LIGHTING];
 
 		memset(thisRad, 255, sz);
@@ -1627,6 +1995,7 @@ void BspMerger::merge_lighting(Bsp& mapA, Bsp& mapB) {
 }
 
 void BspMerger::create_merge_headnodes(Bsp& mapA, Bsp& mapB, BSPPLANE separationPlane) {
+	TraceSpan trace("create_merge_headnodes");
 	BSPMODEL& thisWorld = mapA.models[0];
 	BSPMODEL& otherWorld = mapB.models[0];
 
@@ -1657,7 +2026,10 @@ void BspMerger::create_merge_headnodes(Bsp& mapA, Bsp& mapB, BSPPLANE separation
 	{
 		BSPNODE headNode = {
 			separationPlaneIdx,			// plane idx
-			{mapA.nodeCount + 1, 1},		// child nodes
+			{	// child nodes (every node shifts by 1 to make room for this one)
+				(int16_t)(otherWorld.iHeadnodes[0] + mapA.nodeCount + 1),
+				(int16_t)(thisWorld.iHeadnodes[0] + 1)
+			},
 			{ min(amin.x, bmin.x), min(amin.y, bmin.y), min(amin.z, bmin.z) },	// mins
 			{ max(amax.x, bmax.x), max(amax.y, bmax.y), max(amax.z, bmax.z) },	// maxs
 			0, // first face
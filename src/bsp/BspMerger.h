@@ -15,6 +15,14 @@ struct MAPBLOCK
 	}
 };
 
+// a pair of blocks that can be merged independently of other pairs in the same level
+struct MERGEPAIR
+{
+	MAPBLOCK* dst;
+	MAPBLOCK* src;
+	string name;
+};
+
 class BspMerger {
 public:
 	BspMerger();
@@ -22,9 +30,20 @@ public:
 	// merges all maps into one
 	// noripent - don't change any entity logic
 	// noscript - don't add support for the bspguy map script (worse performance + buggy, but simpler)
-	Bsp* merge(vector<Bsp*> maps, vec3 gap, string output_name, bool noripent, bool noscript);
+	// force - merge even if the estimate says the result will overflow a BSP limit
+	Bsp* merge(vector<Bsp*> maps, vec3 gap, string output_name, bool noripent, bool noscript, bool force);
+
+	// plans the merge and predicts the size of each step without moving or merging anything.
+	// Returns false if any step would overflow a BSP limit.
+	bool estimate(vector<Bsp*> maps, vec3 gap);
+
+	// wall clock time spent merging visibility data by the last merge of a map list (milliseconds).
+	// Merge steps run in parallel, so time where several steps were merging vis data is only counted once.
+	double visMergeTime = 0;
 
 private:
+	mutex statsMutex; // merge steps run in parallel
+	vector<pair<chrono::steady_clock::time_point, chrono::steady_clock::time_point>> visMergeSpans; // per merge step
 	int merge_ops = 0;
 
 	// wrapper around BSP data merging for nicer console output
@@ -33,6 +52,19 @@ private:
 	// merge BSP data
 	bool merge(Bsp& mapA, Bsp& mapB);
 
+	// moves maps into their merge positions and optionally tags ents with their source map
+	void arrange(vector<vector<vector<MAPBLOCK>>>& blocks, bool tagEnts);
+
+	// returns the levels of merge pairs that combine all blocks into blocks[0][0][0]
+	vector<vector<MERGEPAIR>> plan_merge(vector<vector<vector<MAPBLOCK>>>& blocks);
+
+	// simulates the merge plan using lump counts and logs the first limit each step overflows.
+	// The maps must not be arranged yet. Block offsets are applied to copies of the data that depends on them.
+	bool estimate_merge(vector<vector<MERGEPAIR>>& levels);
+
+	// appends the levels of a balanced merge tree for each group of blocks
+	void plan_merge_levels(vector<vector<MAPBLOCK*>>& groups, vector<string>& groupNames, vector<vector<MERGEPAIR>>& levels);
+
 	vector<vector<vector<MAPBLOCK>>> separate(vector<Bsp*>& maps, vec3 gap);
 
 	// for maps in a series:
@@ -47,6 +79,9 @@ private:
 
 	BSPPLANE separate(Bsp& mapA, Bsp& mapB);
 
+	// separating plane points toward b. nType is -1 if there is no simple separating axis
+	static BSPPLANE get_separation_plane(vec3 amin, vec3 amax, vec3 bmin, vec3 bmax);
+
 	void merge_ents(Bsp& mapA, Bsp& mapB);
 	void merge_planes(Bsp& mapA, Bsp& mapB);
 	void merge_textures(Bsp& mapA, Bsp& mapB);
@@ -2,9 +2,25 @@
 #include <string>
 #include "util.h"
 #include <algorithm>
+#include <set>
+#include <mutex>
 
 using namespace std;
 
+// every key name used by an entity. Names are never removed, so pointers to them stay valid
+// and entities can be copied or moved between maps freely.
+static set<string> g_keyNames;
+static mutex g_keyNamesMutex;
+
+static const string* internKey(const string& key) {
+	g_keyNamesMutex.lock();
+	const string* name = &*g_keyNames.insert(key).first;
+	g_keyNamesMutex.unlock();
+	return name;
+}
+
+static const string g_emptyValue;
+
 Entity::Entity(void)
 {
 }
@@ -18,23 +34,39 @@ Entity::~Entity(void)
 {
 }
 
+int Entity::findKey(const char* key) const {
+	size_t len = strlen(key);
+	for (int i = 0; i < keyvalues.size(); i++) {
+		const string& name = *keyvalues[i].key;
+		if (name.size() == len && memcmp(name.data(), key, len) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const string& Entity::getKeyvalue(const char* key) const {
+	int idx = findKey(key);
+	return idx != -1 ? keyvalues[idx].value : g_emptyValue;
+}
+
 void Entity::addKeyvalue( Keyvalue& k )
 {
 	int dup = 1;
-	if (keyvalues.find(k.key) == keyvalues.end()) {
-		keyvalues[k.key] = k.value;
-		keyOrder.push_back(k.key);
+	if (findKey(k.key.c_str()) == -1) {
+		EntityKeyvalue kv = { internKey(k.key), k.value };
+		keyvalues.push_back(kv);
 	}
 	else
 	{
 		while (true)
 		{
 			string newKey = k.key + '#' + to_string((long long)dup);
-			if (keyvalues.find(newKey) == keyvalues.end())
+			if (findKey(newKey.c_str()) == -1)
 			{
 				//println("wrote dup key " + newKey);
-				keyvalues[newKey] = k.value;
-				keyOrder.push_back(newKey);
+				EntityKeyvalue kv = { internKey(newKey), k.value };
+				keyvalues.push_back(kv);
 				break;
 			}
 			dup++;
@@ -43,76 +75,82 @@ void Entity::addKeyvalue( Keyvalue& k )
 
 	cachedModelIdx = -2;
 	targetsCached = false;
+	rawLumpId = 0;
 }
 
 void Entity::addKeyvalue(const std::string& key, const std::string& value)
 {
-	keyvalues[key] = value;
+	int idx = findKey(key.c_str());
+	if (idx != -1) {
+		keyvalues[idx].value = value;
+	}
+	else {
+		EntityKeyvalue kv = { internKey(key), value };
+		keyvalues.push_back(kv);
+	}
 
-	keyOrder.push_back(key);
 	cachedModelIdx = -2;
 	targetsCached = false;
+	rawLumpId = 0;
 }
 
 void Entity::setOrAddKeyvalue(const std::string& key, const std::string& value) {
-	cachedModelIdx = -2;
-	targetsCached = false;
-
-	if (hasKey(key)) {
-		keyvalues[key] = value;
-		return;
-	}
 	addKeyvalue(key, value);
 }
 
 void Entity::removeKeyvalue(const std::string& key) {
-	if (!hasKey(key))
+	int idx = findKey(key.c_str());
+	if (idx == -1)
 		return;
-	keyOrder.erase(find(keyOrder.begin(), keyOrder.end(), key));
-	keyvalues.erase(key);
+	keyvalues.erase(keyvalues.begin() + idx);
 	cachedModelIdx = -2;
 	targetsCached = false;
+	rawLumpId = 0;
 }
 
 bool Entity::renameKey(int idx, string newName) {
-	if (idx < 0 || idx >= keyOrder.size() || newName.empty()) {
+	if (idx < 0 || idx >= keyvalues.size() || newName.empty()) {
 		return false;
 	}
-	for (int i = 0; i < keyOrder.size(); i++) {
-		if (keyOrder[i] == newName) {
-			return false;
-		}
+	if (findKey(newName.c_str()) != -1) {
+		return false;
 	}
 
-	keyvalues[newName] = keyvalues[keyOrder[idx]];
-	keyvalues.erase(keyOrder[idx]);
-	keyOrder[idx] = newName;
+	keyvalues[idx].key = internKey(newName);
 	cachedModelIdx = -2;
 	targetsCached = false;
+	rawLumpId = 0;
 	return true;
 }
 
+void Entity::swapKeys(int idxA, int idxB) {
+	swap(keyvalues[idxA], keyvalues[idxB]);
+	rawLumpId = 0;
+}
+
 void Entity::clearAllKeyvalues() {
-	keyOrder.clear();
 	keyvalues.clear();
 	cachedModelIdx = -2;
+	targetsCached = false;
+	rawLumpId = 0;
 }
 
 void Entity::clearEmptyKeyvalues() {
-	vector<string> newKeyOrder;
-	for (int i = 0; i < keyOrder.size(); i++) {
-		if (!keyvalues[keyOrder[i]].empty()) {
-			newKeyOrder.push_back(keyOrder[i]);
+	vector<EntityKeyvalue> newKeyvalues;
+	for (int i = 0; i < keyvalues.size(); i++) {
+		if (!keyvalues[i].value.empty()) {
+			newKeyvalues.push_back(keyvalues[i]);
 		}
 	}
-	keyOrder = newKeyOrder;
+	keyvalues.swap(newKeyvalues);
 	cachedModelIdx = -2;
 	targetsCached = false;
+	rawLumpId = 0;
 }
 
-bool Entity::hasKey(const std::string& key)
+bool Entity::hasKey(const char* key) const
 {
-	return keyvalues.find(key) != keyvalues.end() && find(keyOrder.begin(), keyOrder.end(), key) != keyOrder.end();
+	return findKey(key) != -1;
 }
 
 int Entity::getBspModelIdx() {
@@ -120,12 +158,7 @@ int Entity::getBspModelIdx() {
 		return cachedModelIdx;
 	}
 
-	if (!hasKey("model")) {
-		cachedModelIdx = -1;
-		return -1;
-	}
-
-	string model = keyvalues["model"];
+	const string& model = getKeyvalue("model");
 	if (model.size() <= 1 || model[0] != '*') {
 		cachedModelIdx = -1;
 		return -1;
@@ -145,7 +178,7 @@ bool Entity::isBspModel() {
 }
 
 vec3 Entity::getOrigin() {
-	return hasKey("origin") ? parseVector(keyvalues["origin"]) : vec3(0, 0, 0);
+	return hasKey("origin") ? parseVector(getKeyvalue("origin")) : vec3(0, 0, 0);
 }
 
 // TODO: maybe store this in a text file or something
@@ -359,16 +392,16 @@ vector<string> Entity::getTargets() {
 	vector<string> targets;
 
 	for (int i = 1; i < TOTAL_TARGETNAME_KEYS; i++) { // skip targetname
-		const char* key = potential_tergetname_keys[i];
-		if (hasKey(key)) {
-			targets.push_back(keyvalues[key]);
+		int idx = findKey(potential_tergetname_keys[i]);
+		if (idx != -1) {
+			targets.push_back(keyvalues[idx].value);
 		}
 	}
 
-	if (keyvalues["classname"] == "multi_manager") {
+	if (getKeyvalue("classname") == "multi_manager") {
 		// multi_manager is a special case where the targets are in the key names
-		for (int i = 0; i < keyOrder.size(); i++) {
-			string tname = keyOrder[i];
+		for (int i = 0; i < keyvalues.size(); i++) {
+			string tname = *keyvalues[i].key;
 			size_t hashPos = tname.find("#");
 			string suffix;
 
@@ -403,32 +436,33 @@ bool Entity::hasTarget(string checkTarget) {
 
 void Entity::renameTargetnameValues(string oldTargetname, string newTargetname) {
 	for (int i = 0; i < TOTAL_TARGETNAME_KEYS; i++) {
-		const char* key = potential_tergetname_keys[i];
-		if (keyvalues.find(key) != keyvalues.end() && keyvalues[key] == oldTargetname) {
-			keyvalues[key] = newTargetname;
+		int idx = findKey(potential_tergetname_keys[i]);
+		if (idx != -1 && keyvalues[idx].value == oldTargetname) {
+			keyvalues[idx].value = newTargetname;
 		}
 	}
 
-	if (keyvalues["classname"] == "multi_manager") {
+	if (getKeyvalue("classname") == "multi_manager") {
 		// multi_manager is a special case where the targets are in the key names
-		for (int i = 0; i < keyOrder.size(); i++) {
-			string tname = keyOrder[i];
+		for (int i = 0; i < keyvalues.size(); i++) {
+			string tname = *keyvalues[i].key;
 			size_t hashPos = tname.find("#");
 			string suffix;
 
 			// duplicate targetnames have a #X suffix to differentiate them
 			if (hashPos != string::npos) {
-				tname = keyOrder[i].substr(0, hashPos);
-				suffix = keyOrder[i].substr(hashPos);
+				suffix = tname.substr(hashPos);
+				tname = tname.substr(0, hashPos);
 			}
 
 			if (tname == oldTargetname) {
-				string newKey = newTargetname + suffix;
-				keyvalues[newKey] = keyvalues[keyOrder[i]];
-				keyOrder[i] = newKey;
+				keyvalues[i].key = internKey(newTargetname + suffix);
 			}
 		}
 	}
+
+	targetsCached = false;
+	rawLumpId = 0;
 }
 
 int Entity::getMemoryUsage() {
@@ -437,12 +471,66 @@ int Entity::getMemoryUsage() {
 	for (int i = 0; i < cachedTargets.size(); i++) {
 		size += cachedTargets[i].size();
 	}
-	for (int i = 0; i < keyOrder.size(); i++) {
-		size += keyOrder[i].size();
-	}
-	for (const auto& entry : keyvalues) {
-		size += entry.first.size() + entry.second.size();
+	// key names are shared by all ents, so only the values belong to this one
+	size += keyvalues.capacity() * sizeof(EntityKeyvalue);
+	for (int i = 0; i < keyvalues.size(); i++) {
+		size += keyvalues[i].value.size();
 	}
 
 	return size;
+}
+
+int Entity::getSerializedSize() const {
+	int size = 3; // "{\n" and "}"
+	for (int i = 0; i < keyvalues.size(); i++) {
+		size += keyvalues[i].key->size() + keyvalues[i].value.size() + 6; // "key" "value"\n
+	}
+	return size;
+}
+
+char* Entity::serialize(char* out) const {
+	*out++ = '{';
+	*out++ = '\n';
+	for (int i = 0; i < keyvalues.size(); i++) {
+		const string& key = *keyvalues[i].key;
+		const string& value = keyvalues[i].value;
+		*out++ = '"';
+		memcpy(out, key.data(), key.size());
+		out += key.size();
+		*out++ = '"';
+		*out++ = ' ';
+		*out++ = '"';
+		memcpy(out, value.data(), value.size());
+		out += value.size();
+		*out++ = '"';
+		*out++ = '\n';
+	}
+	*out++ = '}';
+	return out;
+}
+
+bool Entity::isSerializedAs(const char* text, int len) const {
+	if (len != getSerializedSize() || text[0] != '{' || text[1] != '\n' || text[len - 1] != '}') {
+		return false;
+	}
+
+	const char* p = text + 2;
+	for (int i = 0; i < keyvalues.size(); i++) {
+		const string& key = *keyvalues[i].key;
+		const string& value = keyvalues[i].value;
+		if (p[0] != '"' || memcmp(p + 1, key.data(), key.size()) != 0) {
+			return false;
+		}
+		p += key.size() + 1;
+		if (p[0] != '"' || p[1] != ' ' || p[2] != '"' || memcmp(p + 3, value.data(), value.size()) != 0) {
+			return false;
+		}
+		p += value.size() + 3;
+		if (p[0] != '"' || p[1] != '\n') {
+			return false;
+		}
+		p += 2;
+	}
+
+	return true;
 }
\ No newline at end of file
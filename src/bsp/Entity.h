@@ -4,16 +4,26 @@
 
 typedef std::map< std::string, std::string > hashmap;
 
+// key names are interned, so each keyvalue only stores a pointer to the shared name
+struct EntityKeyvalue
+{
+	const std::string* key;
+	std::string value;
+};
+
 class Entity
 {
 public:
-	hashmap keyvalues;
-	vector<string> keyOrder;
-
 	int cachedModelIdx = -2; // -2 = not cached
 	vector<string> cachedTargets;
 	bool targetsCached = false;
 
+	// where this ent's text is in the entity lump it was loaded from or last written to.
+	// Any keyvalue change clears rawLumpId, so an unchanged ent can be copied back as-is.
+	int rawLumpId = 0; // 0 = no valid span
+	int rawOffset = 0;
+	int rawLength = 0;
+
 	Entity(void);
 	Entity(const std::string& classname);
 	~Entity(void);
@@ -27,6 +37,16 @@ public:
 
 	void setOrAddKeyvalue(const std::string& key, const std::string& value);
 
+	// returns an empty string if the key doesn't exist. Lookups never add keys or allocate.
+	const std::string& getKeyvalue(const char* key) const;
+	const std::string& getKeyvalue(const std::string& key) const { return getKeyvalue(key.c_str()); }
+
+	// keyvalues in the order they are written to the BSP
+	int keyCount() const { return keyvalues.size(); }
+	const std::string& getKey(int idx) const { return *keyvalues[idx].key; }
+	const std::string& getValue(int idx) const { return keyvalues[idx].value; }
+	void swapKeys(int idxA, int idxB);
+
 	// returns -1 for invalid idx
 	int getBspModelIdx();
 
@@ -34,7 +54,8 @@ public:
 
 	vec3 getOrigin();
 
-	bool hasKey(const std::string& key);
+	bool hasKey(const char* key) const;
+	bool hasKey(const std::string& key) const { return hasKey(key.c_str()); }
 
 	vector<string> getTargets();
 
@@ -43,5 +64,19 @@ public:
 	void renameTargetnameValues(string oldTargetname, string newTargetname);
 
 	int getMemoryUsage(); // aproximate
-};
 
+	// length of the "{ ... }" text written to the entity lump (no newline after the closing bracket)
+	int getSerializedSize() const;
+
+	// writes getSerializedSize() bytes and returns a pointer past the last one
+	char* serialize(char* out) const;
+
+	// true if the text is exactly what serialize() would write
+	bool isSerializedAs(const char* text, int len) const;
+
+private:
+	vector<EntityKeyvalue> keyvalues;
+
+	// returns -1 if the key doesn't exist
+	int findKey(const char* key) const;
+};
@@ -2,21 +2,26 @@
 #include "util.h"
 
 Keyvalue::Keyvalue(string line)
+{
+	parse(line.c_str(), line.length());
+}
+
+bool Keyvalue::parse(const char* line, int len)
 {
 	int begin = -1;
-	int end = -1;
 
-	key = "";
-	value = "";
+	key.clear();
+	value.clear();
 	int comment = 0;
 
-	for (uint i = 0; i < line.length(); i++)
+	for (int i = 0; i < len; i++)
 	{
 		if (line[i] == '/')
 		{
 			if (++comment >= 2)
 			{
-				key = value = "";
+				key.clear();
+				value.clear();
 				break;
 			}
 		}
@@ -28,20 +33,21 @@ Keyvalue::Keyvalue(string line)
 				begin = i + 1;
 			else
 			{
-				end = i;
 				if (key.length() == 0)
 				{
-					key = line.substr(begin,end-begin);
-					begin = end = -1;
+					key.assign(line + begin, i - begin);
+					begin = -1;
 				}
 				else
 				{
-					value = line.substr(begin,end-begin);
+					value.assign(line + begin, i - begin);
 					break;
 				}
 			}
 		}
 	}
+
+	return key.length() && value.length();
 }
 
 Keyvalue::Keyvalue(void)
@@ -12,6 +12,10 @@ public:
 	Keyvalue(void);
 	~Keyvalue(void);
 
+	// parses a '"key" "value"' line of len chars, reusing this object's strings.
+	// Returns false if the line doesn't have a non-empty key and value.
+	bool parse(const char* line, int len);
+
 	vec3 getVector();
 };
 
@@ -4,13 +4,12 @@
 #include <fstream>
 #include <string.h>
 
-#ifdef WIN32
-	#define strcasecmp _stricmp
-#endif
-
 Wad::Wad(void)
 {
 	dirEntries = NULL;
+	fileData = NULL;
+	fileSize = 0;
+	fileMappingHandle = NULL;
 }
 
 Wad::Wad( const string& file )
@@ -18,12 +17,16 @@ Wad::Wad( const string& file )
 	this->filename = file;
 	numTex = -1;
 	dirEntries = NULL;
+	fileData = NULL;
+	fileSize = 0;
+	fileMappingHandle = NULL;
 }
 
 Wad::~Wad(void)
 {
 	if (dirEntries)
 		delete [] dirEntries;
+	unmapFile(fileData, fileSize, fileMappingHandle);
 }
 
 bool Wad::readInfo()
@@ -36,54 +39,55 @@ bool Wad::readInfo()
 		return false;
 	}
 
-	ifstream fin(file, ifstream::in|ios::binary);
-	if (!fin.good())
+	// map the file once. Textures are copied out of the mapping after this.
+	fileData = mapFile(file, fileSize, fileMappingHandle);
+	if (!fileData)
+	{
+		logf("Failed to map %s\n", filename.c_str());
 		return false;
+	}
 
-	uint begin = fin.tellg();
-	fin.seekg (0, ios::end);
-	uint end = fin.tellg();
-	uint sz = end - begin;
-	fin.seekg(0, ios::beg);
+	uint sz = fileSize;
 
 	if (sz < sizeof(WADHEADER))
 	{
-		fin.close();
 		return false;
 	}
 
 	//
 	// WAD HEADER
 	//
-	fin.read((char*)&header, sizeof(WADHEADER)); 
+	memcpy(&header, fileData, sizeof(WADHEADER));
 
-	if (string(header.szMagic).find("WAD3") != 0)
+	if (string(header.szMagic, 4).find("WAD3") != 0)
 	{
-		fin.close();
 		return false;
 	}
 
-	if (header.nDirOffset >= sz)
+	if (header.nDirOffset < 0 || header.nDirOffset >= sz)
 	{
-		fin.close();
 		return false;
 	}
 
 	//
 	// WAD DIRECTORY ENTRIES
 	//
-	fin.seekg(header.nDirOffset);
 	numTex = header.nDir;
+	if (numTex < 0 || (uint64_t)numTex * sizeof(WADDIRENTRY) > sz - header.nDirOffset)
+	{
+		logf("Unexpected end of WAD\n");
+		numTex = header.nDir = 0;
+		return false;
+	}
 	dirEntries = new WADDIRENTRY[numTex];
+	memcpy(dirEntries, fileData + header.nDirOffset, numTex * sizeof(WADDIRENTRY));
 
 	bool usableTextures = false;
 	for (int i = 0; i < numTex; i++)
 	{
-		if (fin.eof()) { logf("Unexpected end of WAD\n"); return false; }
-		fin.read((char*)&dirEntries[i], sizeof(WADDIRENTRY)); 
+		dirEntries[i].szName[MAXTEXTURENAME - 1] = 0;
 		if (dirEntries[i].nType == 0x43) usableTextures = true;
 	}
-	fin.close();
 
 	if (!usableTextures)
 	{
@@ -93,17 +97,26 @@ bool Wad::readInfo()
 		logf("%s contains no regular textures\n", filename.c_str());
 		return false; // we can't use these types of textures (see fonts.wad as an example)
 	}
-	
+
+	// first entry wins if a name is duplicated, same as the old linear search
+	nameIndex.reserve(numTex);
+	for (int i = 0; i < numTex; i++)
+	{
+		nameIndex.insert(make_pair(toLowerCase(dirEntries[i].szName), i));
+	}
 
 	return true;
 }
 
 bool Wad::hasTexture(string name)
 {
-	for (int d = 0; d < header.nDir; d++)
-		if (strcasecmp(name.c_str(), dirEntries[d].szName) == 0)
-			return true;
-	return false;
+	return findTexture(name) != -1;
+}
+
+int Wad::findTexture(const string& name)
+{
+	auto it = nameIndex.find(toLowerCase(name));
+	return it != nameIndex.end() ? it->second : -1;
 }
 
 WADTEX * Wad::readTexture( int dirIndex )
@@ -113,58 +126,51 @@ WADTEX * Wad::readTexture( int dirIndex )
 		logf("invalid wad directory index\n");
 		return NULL;
 	}
-	//if (cache != NULL)
-		//return cache[dirIndex];
-	string name = string(dirEntries[dirIndex].szName);
-	return readTexture(name);
-}
-
-WADTEX * Wad::readTexture( const string& texname )
-{
-	string path = filename;
-	const char * file = (path.c_str());
-
-	ifstream fin(file, ifstream::in|ios::binary);
-	if (!fin.good())
-		return NULL;
-
-	int idx = -1;
-	for (int d = 0; d < header.nDir; d++)
+	if (!fileData)
 	{
-		if (strcasecmp(texname.c_str(), dirEntries[d].szName) == 0)
-		{
-			idx = d;
-			break;
-		}
+		logf("%s was not loaded\n", filename.c_str());
+		return NULL;
 	}
 
-	if (idx < 0)
+	int idx = dirIndex;
+	if (dirEntries[idx].bCompression)
 	{
-		fin.close();
+		logf("OMG texture is compressed. I'm too scared to load it :<\n");
 		return NULL;
 	}
-	if (dirEntries[idx].bCompression)
+
+	int64_t pos = dirEntries[idx].nFilePos;
+	if (pos < 0 || pos + (int64_t)sizeof(BSPMIPTEX) > fileSize)
 	{
-		logf("OMG texture is compressed. I'm too scared to load it :<\n");
+		logf("Texture %s is outside of %s\n", dirEntries[idx].szName, filename.c_str());
 		return NULL;
 	}
-	fin.seekg(dirEntries[idx].nFilePos);
 
 	BSPMIPTEX mtex;
-	fin.read((char*)&mtex, sizeof(BSPMIPTEX));
+	memcpy(&mtex, fileData + pos, sizeof(BSPMIPTEX));
 
 	int w = mtex.nWidth;
 	int h = mtex.nHeight;
+	if (w <= 0 || h <= 0 || (int64_t)w * h > fileSize)
+	{
+		logf("Texture %s is outside of %s\n", dirEntries[idx].szName, filename.c_str());
+		return NULL;
+	}
+
 	int sz = w*h;	   // miptex 0
 	int sz2 = sz / 4;  // miptex 1
 	int sz3 = sz2 / 4; // miptex 2
 	int sz4 = sz3 / 4; // miptex 3
 	int szAll = sz + sz2 + sz3 + sz4 + 2 + 256*3 + 2;
 
+	if (pos + (int64_t)sizeof(BSPMIPTEX) + szAll > fileSize)
+	{
+		logf("Texture %s is outside of %s\n", dirEntries[idx].szName, filename.c_str());
+		return NULL;
+	}
+
 	byte * data = new byte[szAll];
-	fin.read((char*)data, szAll);		
-	
-	fin.close();
+	memcpy(data, fileData + pos + sizeof(BSPMIPTEX), szAll);
 
 	WADTEX * tex = new WADTEX;
 	for (int i = 0; i < MAXTEXTURENAME; i++)
@@ -178,6 +184,15 @@ WADTEX * Wad::readTexture( const string& texname )
 	return tex;
 }
 
+WADTEX * Wad::readTexture( const string& texname )
+{
+	int idx = findTexture(texname);
+	if (idx < 0)
+		return NULL;
+
+	return readTexture(idx);
+}
+
 bool Wad::write( std::string filename, WADTEX ** textures, int numTex )
 {
 	ofstream myFile(filename, ios::out | ios::binary | ios::trunc);
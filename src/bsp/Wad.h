@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <unordered_map>
 #include "bsplimits.h"
 
 typedef unsigned char byte;
@@ -66,6 +67,10 @@ public:
 	WADHEADER header;
 	WADDIRENTRY * dirEntries;
 	int numTex;
+	byte * fileData; // the whole file, mapped by readInfo
+	int fileSize;
+	void * fileMappingHandle;
+	std::unordered_map<std::string, int> nameIndex; // lowercase texture name -> directory index
 
 	Wad(const std::string& file);
 	Wad(void);
@@ -73,6 +78,7 @@ public:
 
 	bool readInfo();
 	bool hasTexture(std::string name);
+	int findTexture(const std::string& name); // returns the directory index or -1
 
 	bool write(std::string filename, WADTEX ** textures, int numTex);
 
@@ -243,3 +243,13 @@ struct NodeVolumeCuts {
 	int nodeIdx;
 	vector<BSPPLANE> cuts; // cuts which define the leaf boundaries when applied to a bounding box, in order.
 };
+
+// result of a line traced through a collision hull
+struct TraceResult {
+	bool allSolid; // the line never left solid space
+	bool startSolid; // the line started in solid space
+	float fraction; // how far along the line it got before hitting something (1 = nothing was hit)
+	vec3 endPos;
+	vec3 planeNormal; // surface that was hit, facing the start of the line
+	float planeDist;
+};
@@ -12,7 +12,7 @@ STRUCTCOUNT::STRUCTCOUNT(Bsp* map) {
 	clipnodes = map->header.lump[LUMP_CLIPNODES].nLength / sizeof(BSPCLIPNODE);
 	verts = map->header.lump[LUMP_VERTICES].nLength / sizeof(vec3);
 	faces = map->header.lump[LUMP_FACES].nLength / sizeof(BSPFACE);
-	textures = *((int32_t*)(map->lumps[LUMP_TEXTURES]));
+	textures = map->lumps[LUMP_TEXTURES] ? *((int32_t*)(map->lumps[LUMP_TEXTURES])) : 0;
 	markSurfs = map->header.lump[LUMP_MARKSURFACES].nLength / sizeof(uint16_t);
 	surfEdges = map->header.lump[LUMP_SURFEDGES].nLength / sizeof(int32_t);
 	edges = map->header.lump[LUMP_EDGES].nLength / sizeof(BSPEDGE);
@@ -100,59 +100,195 @@ void STRUCTCOUNT::print_delete_stats(int indent) {
 	print_stat_mem(indent, visdata, "VIS data");
 }
 
+static inline int popcount64(uint64_t v) {
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((v * 0x0101010101010101ULL) >> 56);
+}
+
+BITSET::BITSET() {
+	words = NULL;
+	summary = NULL;
+	count = 0;
+}
+
+BITSET::~BITSET() {
+	delete[] words;
+	delete[] summary;
+}
+
+void BITSET::init(int count) {
+	int wordCount = (count + 63) / 64;
+	int summaryCount = (wordCount + 63) / 64;
+	delete[] words;
+	delete[] summary;
+	this->count = count;
+	words = new uint64_t[wordCount];
+	summary = new uint64_t[summaryCount];
+	memset(words, 0, wordCount * sizeof(uint64_t));
+	memset(summary, 0, summaryCount * sizeof(uint64_t));
+}
+
+void BITSET::merge(const BITSET& other) {
+	int wordCount = (count + 63) / 64;
+	for (int i = 0; i < wordCount; i++) {
+		words[i] |= other.words[i];
+	}
+	for (int i = 0; i < (wordCount + 63) / 64; i++) {
+		summary[i] |= other.summary[i];
+	}
+}
+
+void BITSET::merge_missing(const BITSET& a, const BITSET& b) {
+	int wordCount = (count + 63) / 64;
+	for (int i = 0; i < wordCount; i++) {
+		words[i] |= a.words[i] & ~b.words[i];
+	}
+	for (int i = 0; i < (wordCount + 63) / 64; i++) {
+		summary[i] |= a.summary[i];
+	}
+}
+
+void BITSET::move_into(BITSET& any, BITSET& shared) {
+	int summaryCount = ((count + 63) / 64 + 63) / 64;
+
+	for (int s = 0; s < summaryCount; s++) {
+		uint64_t dirty = summary[s];
+
+		while (dirty) {
+			uint64_t lowest = dirty & (~dirty + 1);
+			int i = s * 64 + popcount64(lowest - 1);
+			dirty ^= lowest;
+
+			shared.words[i] |= any.words[i] & words[i];
+			any.words[i] |= words[i];
+			words[i] = 0;
+		}
+
+		shared.summary[s] |= any.summary[s] & summary[s];
+		any.summary[s] |= summary[s];
+		summary[s] = 0;
+	}
+}
+
+void BITSET::clear() {
+	int summaryCount = ((count + 63) / 64 + 63) / 64;
+
+	for (int s = 0; s < summaryCount; s++) {
+		uint64_t dirty = summary[s];
+
+		while (dirty) {
+			uint64_t lowest = dirty & (~dirty + 1);
+			words[s * 64 + popcount64(lowest - 1)] = 0;
+			dirty ^= lowest;
+		}
+
+		summary[s] = 0;
+	}
+}
+
+bool BITSET::intersects(const BITSET& other) const {
+	int wordCount = (min(count, other.count) + 63) / 64;
+	for (int i = 0; i < wordCount; i++) {
+		if (words[i] & other.words[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int BITSET::popcount() const {
+	int total = 0;
+	int summaryCount = ((count + 63) / 64 + 63) / 64;
+
+	for (int s = 0; s < summaryCount; s++) {
+		uint64_t dirty = summary[s];
+
+		while (dirty) {
+			uint64_t lowest = dirty & (~dirty + 1);
+			total += popcount64(words[s * 64 + popcount64(lowest - 1)]);
+			dirty ^= lowest;
+		}
+	}
+	return total;
+}
+
+int BITSET::count_common(const BITSET& other) const {
+	int total = 0;
+	int wordCount = (min(count, other.count) + 63) / 64;
+	for (int i = 0; i < wordCount; i++) {
+		total += popcount64(words[i] & other.words[i]);
+	}
+	return total;
+}
+
+static BITSET STRUCTUSAGE::* const usageSets[] = {
+	&STRUCTUSAGE::nodes, &STRUCTUSAGE::clipnodes, &STRUCTUSAGE::leaves, &STRUCTUSAGE::planes,
+	&STRUCTUSAGE::verts, &STRUCTUSAGE::texInfo, &STRUCTUSAGE::faces, &STRUCTUSAGE::textures,
+	&STRUCTUSAGE::markSurfs, &STRUCTUSAGE::surfEdges, &STRUCTUSAGE::edges
+};
+static const int usageSetCount = sizeof(usageSets) / sizeof(usageSets[0]);
+
 STRUCTUSAGE::STRUCTUSAGE(Bsp* map) : count(map) {
-	nodes = new bool[count.nodes];
-	clipnodes = new bool[count.clipnodes];
-	leaves = new bool[count.leaves];
-	planes = new bool[count.planes];
-	verts = new bool[count.verts];
-	texInfo = new bool[count.texInfos];
-	faces = new bool[count.faces];
-	textures = new bool[count.textures];
-	markSurfs = new bool[count.markSurfs];
-	surfEdges = new bool[count.surfEdges];
-	edges = new bool[count.edges];
-
-	memset(nodes, 0, count.nodes * sizeof(bool));
-	memset(clipnodes, 0, count.clipnodes * sizeof(bool));
-	memset(leaves, 0, count.leaves * sizeof(bool));
-	memset(planes, 0, count.planes * sizeof(bool));
-	memset(verts, 0, count.verts * sizeof(bool));
-	memset(texInfo, 0, count.texInfos * sizeof(bool));
-	memset(faces, 0, count.faces * sizeof(bool));
-	memset(textures, 0, count.textures * sizeof(bool));
-	memset(markSurfs, 0, count.markSurfs * sizeof(bool));
-	memset(surfEdges, 0, count.surfEdges * sizeof(bool));
-	memset(edges, 0, count.edges * sizeof(bool));
+	nodes.init(count.nodes);
+	clipnodes.init(count.clipnodes);
+	leaves.init(count.leaves);
+	planes.init(count.planes);
+	verts.init(count.verts);
+	texInfo.init(count.texInfos);
+	faces.init(count.faces);
+	textures.init(count.textures);
+	markSurfs.init(count.markSurfs);
+	surfEdges.init(count.surfEdges);
+	edges.init(count.edges);
+
+	modelIdx = 0;
+	skippedLeaves = false;
 }
 
 void STRUCTUSAGE::compute_sum() {
 	memset(&sum, 0, sizeof(STRUCTCOUNT));
-	for (int i = 0; i < count.planes; i++) sum.planes += planes[i];
-	for (int i = 0; i < count.texInfos; i++) sum.texInfos += texInfo[i];
-	for (int i = 0; i < count.leaves; i++) sum.leaves += leaves[i];
-	for (int i = 0; i < count.nodes; i++) sum.nodes += nodes[i];
-	for (int i = 0; i < count.clipnodes; i++) sum.clipnodes += clipnodes[i];
-	for (int i = 0; i < count.verts; i++) sum.verts += verts[i];
-	for (int i = 0; i < count.faces; i++) sum.faces += faces[i];
-	for (int i = 0; i < count.textures; i++) sum.textures += textures[i];
-	for (int i = 0; i < count.markSurfs; i++) sum.markSurfs += markSurfs[i];
-	for (int i = 0; i < count.surfEdges; i++) sum.surfEdges += surfEdges[i];
-	for (int i = 0; i < count.edges; i++) sum.edges += edges[i];
-}
-
-STRUCTUSAGE::~STRUCTUSAGE() {
-	delete[] nodes;
-	delete[] clipnodes;
-	delete[] leaves;
-	delete[] planes;
-	delete[] verts;
-	delete[] texInfo;
-	delete[] faces;
-	delete[] textures;
-	delete[] markSurfs;
-	delete[] surfEdges;
-	delete[] edges;
+	sum.planes = planes.popcount();
+	sum.texInfos = texInfo.popcount();
+	sum.leaves = leaves.popcount();
+	sum.nodes = nodes.popcount();
+	sum.clipnodes = clipnodes.popcount();
+	sum.verts = verts.popcount();
+	sum.faces = faces.popcount();
+	sum.textures = textures.popcount();
+	sum.markSurfs = markSurfs.popcount();
+	sum.surfEdges = surfEdges.popcount();
+	sum.edges = edges.popcount();
+}
+
+void STRUCTUSAGE::merge(const STRUCTUSAGE& other) {
+	for (int i = 0; i < usageSetCount; i++) {
+		(this->*usageSets[i]).merge(other.*usageSets[i]);
+	}
+	skippedLeaves = skippedLeaves || other.skippedLeaves;
+}
+
+void STRUCTUSAGE::move_into(STRUCTUSAGE& any, STRUCTUSAGE& shared) {
+	for (int i = 0; i < usageSetCount; i++) {
+		(this->*usageSets[i]).move_into(any.*usageSets[i], shared.*usageSets[i]);
+	}
+	any.skippedLeaves = shared.skippedLeaves = any.skippedLeaves || skippedLeaves;
+	skippedLeaves = false;
+}
+
+void STRUCTUSAGE::clear() {
+	for (int i = 0; i < usageSetCount; i++) {
+		(this->*usageSets[i]).clear();
+	}
+	skippedLeaves = false;
+}
+
+void STRUCTUSAGE::merge_missing(const STRUCTUSAGE& a, const STRUCTUSAGE& b) {
+	for (int i = 0; i < usageSetCount; i++) {
+		(this->*usageSets[i]).merge_missing(a.*usageSets[i], b.*usageSets[i]);
+	}
+	skippedLeaves = skippedLeaves || a.skippedLeaves || b.skippedLeaves;
 }
 
 STRUCTREMAP::STRUCTREMAP(Bsp* map) : count(map) {
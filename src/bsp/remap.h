@@ -1,4 +1,6 @@
 #pragma once
+#include <stdint.h>
+
 class Bsp;
 
 // excludes entities
@@ -27,30 +29,98 @@ struct STRUCTCOUNT {
 	void print_delete_stats(int indent);
 };
 
+// packed array of flags, one bit per structure
+struct BITSET
+{
+	uint64_t* words;
+	uint64_t* summary; // one bit per word that may be non-zero
+	int count; // number of bits
+
+	BITSET();
+	~BITSET();
+
+	// allocates and clears the bits
+	void init(int count);
+
+	bool operator[](int i) const { return (words[i >> 6] >> (i & 63)) & 1; }
+	void set(int i) { test_and_set(i); }
+
+	// sets the bit and returns its previous value
+	bool test_and_set(int i) {
+		int w = i >> 6;
+		uint64_t mask = (uint64_t)1 << (i & 63);
+		bool old = (words[w] & mask) != 0;
+		words[w] |= mask;
+		summary[w >> 6] |= (uint64_t)1 << (w & 63);
+		return old;
+	}
+
+	// bitwise ops. Sets must be the same size.
+	void merge(const BITSET& other); // this |= other
+	void merge_missing(const BITSET& a, const BITSET& b); // this |= a & ~b
+
+	// adds these bits to "any" and bits already in "any" to "shared", then clears this set.
+	// Only words that were set are visited, so this is cheap for sparse sets.
+	void move_into(BITSET& any, BITSET& shared);
+
+	// clears the bits. Only words that were set are visited.
+	void clear();
+
+	bool intersects(const BITSET& other) const;
+	int popcount() const; // only visits words that were set
+	int count_common(const BITSET& other) const; // popcount of this & other
+
+private:
+	BITSET(const BITSET&);
+	BITSET& operator=(const BITSET&);
+};
+
 // used to mark structures that are in use by a model
 struct STRUCTUSAGE
 {
-	bool* nodes;
-	bool* clipnodes;
-	bool* leaves;
-	bool* planes;
-	bool* verts;
-	bool* texInfo;
-	bool* faces;
-	bool* textures;
-	bool* markSurfs;
-	bool* surfEdges;
-	bool* edges;
+	BITSET nodes;
+	BITSET clipnodes;
+	BITSET leaves;
+	BITSET planes;
+	BITSET verts;
+	BITSET texInfo;
+	BITSET faces;
+	BITSET textures;
+	BITSET markSurfs;
+	BITSET surfEdges;
+	BITSET edges;
 
 	STRUCTCOUNT count; // size of each array
 	STRUCTCOUNT sum;
 
 	int modelIdx;
 
+	// true if a node tree was marked without its leaves. Nodes that are
+	// already marked can't be skipped when marking leaves afterwards.
+	bool skippedLeaves;
+
 	STRUCTUSAGE(Bsp* map);
-	~STRUCTUSAGE();
 
 	void compute_sum();
+
+	// marks everything that the other usage marked
+	void merge(const STRUCTUSAGE& other);
+
+	// marks structures used by a but not b
+	void merge_missing(const STRUCTUSAGE& a, const STRUCTUSAGE& b);
+
+	// accumulates usage of several models, see BITSET::move_into
+	void move_into(STRUCTUSAGE& any, STRUCTUSAGE& shared);
+
+	// unmarks everything, so the usage can be reused for another model
+	void clear();
+};
+
+// structure counts of a single model
+struct MODELUSAGE
+{
+	int modelIdx;
+	STRUCTCOUNT sum;
 };
 
 // used to remap structure indexes to new locations
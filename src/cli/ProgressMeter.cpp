@@ -9,10 +9,13 @@ ProgressMeter::ProgressMeter() {
 }
 
 void ProgressMeter::update(const char* newTitle, int totalProgressTicks) {
+	if (hide) {
+		return;
+	}
 	progress_title = newTitle;
 	progress = 0;
 	progress_total = totalProgressTicks;
-	if (simpleMode && !hide) {
+	if (simpleMode) {
 		logf((string(newTitle) + "\n").c_str());
 	}
 }
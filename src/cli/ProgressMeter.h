@@ -9,7 +9,9 @@ public:
 
 	ProgressMeter();
 
-	// set a new title for the progress meter and set the number of ticks needed to reach 100%
+	// set a new title for the progress meter and set the number of ticks needed to reach 100%.
+	// Does nothing while the meter is hidden, so work running on several threads at once can't
+	// race on the title and counters. Call it again after unhiding.
 	void update(const char* newTitle, int totalProgressTicks);
 
 	// increment progress counter and print current status
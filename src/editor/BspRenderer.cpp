@@ -6,6 +6,27 @@
 #include <algorithm>
 #include "Renderer.h"
 #include "Clipper.h"
+#include "trace.h"
+#include "vis.h"
+
+// face bounds are flat on axis-aligned faces, so pad them to avoid missing hits to rounding errors
+#define FACE_BVH_PADDING 1.0f
+
+// entities touching more leaves than this are always drawn (same limit as the engine)
+#define MAX_ENT_VIS_LEAVES 48
+
+static void setFaceBvhItems(Bvh& bvh, FaceMath* faceMaths, int count) {
+	vector<vec3> mins(count);
+	vector<vec3> maxs(count);
+	vec3 pad = vec3(FACE_BVH_PADDING, FACE_BVH_PADDING, FACE_BVH_PADDING);
+
+	for (int i = 0; i < count; i++) {
+		mins[i] = faceMaths[i].mins - pad;
+		maxs[i] = faceMaths[i].maxs + pad;
+	}
+
+	bvh.setItems(mins, maxs);
+}
 
 #include "icons/missing.h"
 
@@ -76,19 +97,16 @@ BspRenderer::BspRenderer(Bsp* map, ShaderProgram* bspShader, ShaderProgram* full
 	lightmapFuture = async(launch::async, &BspRenderer::loadLightmaps, this);
 	texturesFuture = async(launch::async, &BspRenderer::loadTextures, this);
 	clipnodesFuture = async(launch::async, &BspRenderer::loadClipnodes, this);
-
-	// cache ent targets so first selection doesn't lag
-	for (int i = 0; i < map->ents.size(); i++) {
-		map->ents[i]->getTargets();
-	}
 }
 
 void BspRenderer::loadTextures() {
-	vector<Wad*> wads;
+	TraceSpan trace("loadTextures");
+	vector<Wad*> oldWads = wads;
+	wads.clear();
 	vector<string> wadNames;
 	for (int i = 0; i < map->ents.size(); i++) {
-		if (map->ents[i]->keyvalues["classname"] == "worldspawn") {
-			wadNames = splitString(map->ents[i]->keyvalues["wad"], ";");
+		if (map->ents[i]->getKeyvalue("classname") == "worldspawn") {
+			wadNames = splitString(map->ents[i]->getKeyvalue("wad"), ";");
 
 			for (int k = 0; k < wadNames.size(); k++) {
 				wadNames[k] = basename(wadNames[k]);
@@ -121,10 +139,15 @@ void BspRenderer::loadTextures() {
 			continue;
 		}
 
-		logf("Loading WAD %s\n", path.c_str());
-		Wad* wad = new Wad(path);
-		wad->readInfo();
-		wads.push_back(wad);
+		Wad* wad = g_wads.acquireWad(path);
+		if (wad) {
+			wads.push_back(wad);
+		}
+	}
+
+	// released after acquiring the new list so WADs used by both aren't reloaded
+	for (int i = 0; i < oldWads.size(); i++) {
+		g_wads.releaseWad(oldWads[i]);
 	}
 
 	int wadTexCount = 0;
@@ -140,39 +163,28 @@ void BspRenderer::loadTextures() {
 		}
 		BSPMIPTEX& tex = *((BSPMIPTEX*)(map->textures + texOffset));
 
-		COLOR3* palette;
-		byte* src;
-		WADTEX* wadTex = NULL;
-
 		int lastMipSize = (tex.nWidth / 8) * (tex.nHeight / 8);
 
 		if (tex.nOffsets[0] <= 0) {
-
-			bool foundInWad = false;
-			for (int k = 0; k < wads.size(); k++) {
-				if (wads[k]->hasTexture(tex.szName)) {
-					foundInWad = true;
-
-					wadTex = wads[k]->readTexture(tex.szName);
-					palette = (COLOR3*)(wadTex->data + wadTex->nOffsets[3] + lastMipSize + 2 - 40);
-					src = wadTex->data;
-
-					wadTexCount++;
-					break;
-				}
+			Texture* wadTex = NULL;
+			for (int k = 0; k < wads.size() && !wadTex; k++) {
+				wadTex = g_wads.acquireTexture(wads[k], tex.szName);
 			}
 
-			if (!foundInWad) {
+			if (wadTex) {
+				glTexturesSwap[i] = wadTex;
+				wadTexCount++;
+			}
+			else {
 				glTexturesSwap[i] = missingTex;
 				missingCount++;
-				continue;
 			}
+			continue;
 		}
-		else {
-			palette = (COLOR3*)(map->textures + texOffset + tex.nOffsets[3] + lastMipSize + 2);
-			src = map->textures + texOffset + tex.nOffsets[0];
-			embedCount++;
-		}
+
+		COLOR3* palette = (COLOR3*)(map->textures + texOffset + tex.nOffsets[3] + lastMipSize + 2);
+		byte* src = map->textures + texOffset + tex.nOffsets[0];
+		embedCount++;
 
 		COLOR3* imageData = new COLOR3[tex.nWidth * tex.nHeight];
 		int sz = tex.nWidth * tex.nHeight;
@@ -181,20 +193,11 @@ void BspRenderer::loadTextures() {
 			imageData[k] = palette[src[k]];
 		}
 
-		if (wadTex) {
-			delete[] wadTex->data;
-			delete wadTex;
-		}
-
 		// map->textures + texOffset + tex.nOffsets[0]
 
 		glTexturesSwap[i] = new Texture(tex.nWidth, tex.nHeight, imageData);
 	}
 
-	for (int i = 0; i < wads.size(); i++) {
-		delete wads[i];
-	}
-
 	if (wadTexCount)
 		debugf("Loaded %d wad textures\n", wadTexCount);
 	if (embedCount)
@@ -260,6 +263,7 @@ void BspRenderer::updateModelShaders() {
 }
 
 void BspRenderer::loadLightmaps() {
+	TraceSpan trace("loadLightmaps");
 	vector<LightmapNode*> atlases;
 	vector<Texture*> atlasTextures;
 	atlases.push_back(new LightmapNode(0, 0, LIGHTMAP_ATLAS_SIZE, LIGHTMAP_ATLAS_SIZE));
@@ -375,6 +379,7 @@ void BspRenderer::updateLightmapInfos() {
 }
 
 void BspRenderer::preRenderFaces() {
+	TraceSpan trace("preRenderFaces");
 	deleteRenderFaces();
 
 	genRenderFaces(numRenderModels);
@@ -446,8 +451,13 @@ void BspRenderer::deleteRenderModelClipnodes(RenderClipnodes* renderClip) {
 			delete renderClip->clipnodeBuffer[i];
 			delete renderClip->wireframeClipnodeBuffer[i];
 		}
+		if (renderClip->faceBvh[i]) {
+			delete renderClip->faceBvh[i];
+		}
 		renderClip->clipnodeBuffer[i] = NULL;
 		renderClip->wireframeClipnodeBuffer[i] = NULL;
+		renderClip->faceBvh[i] = NULL;
+		renderClip->faceMaths[i].clear();
 	}
 }
 
@@ -465,7 +475,7 @@ void BspRenderer::deleteRenderFaces() {
 void BspRenderer::deleteTextures() {
 	if (glTextures != NULL) {
 		for (int i = 0; i < numLoadedTextures; i++) {
-			if (glTextures[i] != missingTex)
+			if (glTextures[i] != missingTex && !g_wads.releaseTexture(glTextures[i]))
 				delete glTextures[i];
 		}
 		delete[] glTextures;
@@ -487,11 +497,21 @@ void BspRenderer::deleteLightmapTextures() {
 }
 
 void BspRenderer::deleteFaceMaths() {
+	if (faceBvhFuture.valid()) {
+		faceBvhFuture.wait(); // don't delete the trees while they're being built
+	}
+
 	if (faceMaths != NULL) {
 		delete[] faceMaths;
 	}
+	if (faceBvhs != NULL) {
+		delete[] faceBvhs;
+	}
 
 	faceMaths = NULL;
+	faceBvhs = NULL;
+	numFaceBvhs = 0;
+	faceBvhsLoaded = false;
 }
 
 int BspRenderer::refreshModel(int modelIdx, bool refreshClipnodes) {
@@ -672,6 +692,8 @@ int BspRenderer::refreshModel(int modelIdx, bool refreshClipnodes) {
 		renderModel->renderFaces[i].group = groupIdx;
 		renderModel->renderFaces[i].vertOffset = renderGroupVerts[groupIdx].size();
 		renderModel->renderFaces[i].vertCount = vertCount;
+		renderModel->renderFaces[i].wireframeVertOffset = renderGroupWireframeVerts[groupIdx].size();
+		renderModel->renderFaces[i].wireframeVertCount = wireframeVertCount;
 
 		renderGroupVerts[groupIdx].insert(renderGroupVerts[groupIdx].end(), verts, verts + vertCount);
 		renderGroupWireframeVerts[groupIdx].insert(renderGroupWireframeVerts[groupIdx].end(), wireframeVerts, wireframeVerts + wireframeVertCount);
@@ -718,6 +740,11 @@ int BspRenderer::refreshModel(int modelIdx, bool refreshClipnodes) {
 	for (int i = 0; i < model.nFaces; i++) {
 		refreshFace(model.iFirstFace + i);
 	}
+	refitFaceBvh(modelIdx);
+
+	if (modelIdx == 0) {
+		invalidateVis(); // render groups and leaves changed
+	}
 
 	if (refreshClipnodes)
 		generateClipnodeBuffer(modelIdx);
@@ -739,6 +766,7 @@ int BspRenderer::refreshModelClipnodes(int modelIdx) {
 }
 
 void BspRenderer::loadClipnodes() {
+	TraceSpan trace("loadClipnodes");
 	numRenderClipnodes = map->modelCount;
 	renderClipnodes = new RenderClipnodes[numRenderClipnodes];
 	memset(renderClipnodes, 0, numRenderClipnodes * sizeof(RenderClipnodes));
@@ -749,16 +777,15 @@ void BspRenderer::loadClipnodes() {
 }
 
 void BspRenderer::generateClipnodeBuffer(int modelIdx) {
+	TraceSpan trace("generateClipnodeBuffer");
 	BSPMODEL& model = map->models[modelIdx];
 	RenderClipnodes* renderClip = &renderClipnodes[modelIdx];
 
 	vec3 min = vec3(model.nMins.x, model.nMins.y, model.nMins.z);
 	vec3 max = vec3(model.nMaxs.x, model.nMaxs.y, model.nMaxs.z);
 
-	for (int i = 0; i < MAX_MAP_HULLS; i++) {
-		renderClip->clipnodeBuffer[i] = NULL;
-		renderClip->wireframeClipnodeBuffer[i] = NULL;
-	}
+	// refreshModel rebuilds the buffers without deleting them first
+	deleteRenderModelClipnodes(renderClip);
 
 	Clipper clipper;
 	
@@ -849,8 +876,11 @@ void BspRenderer::generateClipnodeBuffer(int modelIdx) {
 					faceMath.worldToLocal = worldToLocalTransform(plane_x, plane_y, plane_z);
 
 					faceMath.localVerts = vector<vec2>(faceVerts.size());
+					faceMath.mins = vec3(9e99, 9e99, 9e99);
+					faceMath.maxs = vec3(-9e99, -9e99, -9e99);
 					for (int k = 0; k < faceVerts.size(); k++) {
 						faceMath.localVerts[k] = (faceMath.worldToLocal * vec4(faceVerts[k], 1)).xy();
+						expandBoundingBox(faceVerts[k], faceMath.mins, faceMath.maxs);
 					}
 
 					faceMaths.push_back(faceMath);
@@ -896,8 +926,8 @@ void BspRenderer::generateClipnodeBuffer(int modelIdx) {
 		}
 
 		if (allVerts.size() == 0 || wireframeVerts.size() == 0) {
-			renderClip->clipnodeBuffer[i] = NULL;
-			renderClip->wireframeClipnodeBuffer[i] = NULL;
+			delete[] output;
+			delete[] wireOutput;
 			continue;
 		}
 
@@ -908,6 +938,10 @@ void BspRenderer::generateClipnodeBuffer(int modelIdx) {
 		renderClip->wireframeClipnodeBuffer[i]->ownData = true;
 
 		renderClip->faceMaths[i] = faceMaths;
+
+		renderClip->faceBvh[i] = new Bvh();
+		setFaceBvhItems(*renderClip->faceBvh[i], &renderClip->faceMaths[i][0], faceMaths.size());
+		renderClip->faceBvh[i]->build();
 	}
 }
 
@@ -927,12 +961,22 @@ void BspRenderer::updateClipnodeOpacity(byte newValue) {
 }
 
 void BspRenderer::preRenderEnts() {
+	TraceSpan trace("preRenderEnts");
 	if (renderEnts != NULL) {
 		delete[] renderEnts;
 		delete pointEnts;
 	}
 	renderEnts = new RenderEnt[map->ents.size()];
 
+	for (int i = 0; i < 3; i++) {
+		entCenters[i].resize(map->ents.size());
+		entExtents[i].resize(map->ents.size());
+	}
+	entInFrustum.resize(map->ents.size());
+
+	// ents may have been added or removed
+	map->update_ent_name_index();
+
 	numPointEnts = 0;
 	for (int i = 1; i < map->ents.size(); i++) {
 		numPointEnts += !map->ents[i]->isBspModel();
@@ -942,7 +986,7 @@ void BspRenderer::preRenderEnts() {
 	int pointEntIdx = 0;
 
 	for (int i = 0; i < map->ents.size(); i++) {
-		refreshEnt(i);
+		refreshEnt(i, false);
 
 		if (i != 0 && !map->ents[i]->isBspModel()) {
 			memcpy(entCubes + pointEntIdx, renderEnts[i].pointEntCube->buffer->data, sizeof(cCube));
@@ -1000,18 +1044,92 @@ void BspRenderer::refreshPointEnt(int entIdx) {
 	pointEnts->upload();
 }
 
-void BspRenderer::refreshEnt(int entIdx) {
+void BspRenderer::refreshEnt(int entIdx, bool updateNameIndex) {
 	Entity* ent = map->ents[entIdx];
+	if (updateNameIndex)
+		map->update_ent_name_index(entIdx);
+	map->invalidate_model_ent_index(); // the model key may have changed
 	renderEnts[entIdx].modelIdx = ent->getBspModelIdx();
 	renderEnts[entIdx].modelMat.loadIdentity();
 	renderEnts[entIdx].offset = vec3(0, 0, 0);
 	renderEnts[entIdx].pointEntCube = pointEntRenderer->getEntCube(ent);
 
 	if (ent->hasKey("origin")) {
-		vec3 origin = parseVector(ent->keyvalues["origin"]);
+		vec3 origin = parseVector(ent->getKeyvalue("origin"));
 		renderEnts[entIdx].modelMat.translate(origin.x, origin.z, -origin.y);
 		renderEnts[entIdx].offset = origin;
 	}
+
+	int modelIdx = renderEnts[entIdx].modelIdx;
+
+	if (entIdx < entInFrustum.size()) {
+		vec3 center, extents = vec3(1e30f, 1e30f, 1e30f); // finite so a zero plane normal axis can't make NaN
+		if (modelIdx >= 0 && modelIdx < map->modelCount) {
+			BSPMODEL& model = map->models[modelIdx];
+			center = (model.nMins + model.nMaxs) * 0.5f + renderEnts[entIdx].offset;
+			extents = (model.nMaxs - model.nMins) * 0.5f;
+		}
+		entCenters[0][entIdx] = center.x;
+		entCenters[1][entIdx] = center.y;
+		entCenters[2][entIdx] = center.z;
+		entExtents[0][entIdx] = extents.x;
+		entExtents[1][entIdx] = extents.y;
+		entExtents[2][entIdx] = extents.z;
+	}
+
+	updateEntVisLeaves(entIdx);
+}
+
+void BspRenderer::updateEntVisLeaves(int entIdx) {
+	vector<int>& visLeaves = renderEnts[entIdx].visLeaves;
+	visLeaves.clear();
+
+	int modelIdx = renderEnts[entIdx].modelIdx;
+	if (entIdx > 0 && modelIdx > 0 && modelIdx < map->modelCount) {
+		BSPMODEL& model = map->models[modelIdx];
+		vec3 offset = renderEnts[entIdx].offset;
+
+		findTouchedLeaves(map->models[0].iHeadnodes[0], model.nMins + offset - vec3(1, 1, 1),
+			model.nMaxs + offset + vec3(1, 1, 1), visLeaves);
+
+		if (visLeaves.size() > MAX_ENT_VIS_LEAVES) {
+			visLeaves.clear();
+		}
+	}
+}
+
+void BspRenderer::invalidateVis() {
+	visDirty = true;
+	entVisLeavesDirty = true;
+}
+
+void BspRenderer::findTouchedLeaves(int iNode, vec3 mins, vec3 maxs, vector<int>& touchedLeaves) {
+	if (touchedLeaves.size() > MAX_ENT_VIS_LEAVES) {
+		return;
+	}
+
+	if (iNode < 0) {
+		int leafIdx = ~iNode;
+		if (leafIdx > 0 && leafIdx < map->leafCount && map->leaves[leafIdx].nContents != CONTENTS_SOLID) {
+			touchedLeaves.push_back(leafIdx);
+		}
+		return;
+	}
+
+	BSPNODE& node = map->nodes[iNode];
+	BSPPLANE& plane = map->planes[node.iPlane];
+
+	vec3 center = (mins + maxs) * 0.5f;
+	vec3 extents = maxs - center;
+	float radius = fabs(plane.vNormal.x) * extents.x + fabs(plane.vNormal.y) * extents.y + fabs(plane.vNormal.z) * extents.z;
+	float dist = dotProduct(plane.vNormal, center) - plane.fDist;
+
+	if (dist > -radius) {
+		findTouchedLeaves(node.iChildren[0], mins, maxs, touchedLeaves);
+	}
+	if (dist < radius) {
+		findTouchedLeaves(node.iChildren[1], mins, maxs, touchedLeaves);
+	}
 }
 
 void BspRenderer::calcFaceMaths() {
@@ -1027,6 +1145,47 @@ void BspRenderer::calcFaceMaths() {
 	for (int i = 0; i < map->faceCount; i++) {
 		refreshFace(i);
 	}
+
+	// the face bounds are copied now so that faces can keep changing while the trees are built
+	numFaceBvhs = map->modelCount;
+	faceBvhs = new Bvh[numFaceBvhs];
+	for (int i = 0; i < numFaceBvhs; i++) {
+		BSPMODEL& model = map->models[i];
+		setFaceBvhItems(faceBvhs[i], faceMaths + model.iFirstFace, model.nFaces);
+	}
+
+	faceBvhFuture = async(launch::async, &BspRenderer::loadFaceBvhs, this);
+}
+
+void BspRenderer::loadFaceBvhs() {
+	TraceSpan trace("loadFaceBvhs");
+	for (int i = 0; i < numFaceBvhs; i++) {
+		faceBvhs[i].build();
+	}
+}
+
+void BspRenderer::refitFaceBvh(int modelIdx) {
+	if (faceBvhs == NULL || modelIdx < 0 || modelIdx >= numFaceBvhs) {
+		return;
+	}
+
+	faceBvhFuture.wait();
+
+	BSPMODEL& model = map->models[modelIdx];
+	Bvh& bvh = faceBvhs[modelIdx];
+	FaceMath* modelFaceMaths = faceMaths + model.iFirstFace;
+
+	if (bvh.itemCount() != model.nFaces) {
+		// faces were added or removed, so the old tree doesn't fit anymore
+		setFaceBvhItems(bvh, modelFaceMaths, model.nFaces);
+		bvh.build();
+		return;
+	}
+
+	vec3 pad = vec3(FACE_BVH_PADDING, FACE_BVH_PADDING, FACE_BVH_PADDING);
+	for (int i = 0; i < model.nFaces; i++) {
+		bvh.refit(i, modelFaceMaths[i].mins - pad, modelFaceMaths[i].maxs + pad);
+	}
 }
 
 void BspRenderer::refreshFace(int faceIdx) {
@@ -1064,15 +1223,19 @@ void BspRenderer::refreshFace(int faceIdx) {
 	faceMath.worldToLocal = worldToLocalTransform(plane_x, plane_y, plane_z);
 
 	faceMath.localVerts = vector<vec2>(allVerts.size());
+	faceMath.mins = vec3(9e99, 9e99, 9e99);
+	faceMath.maxs = vec3(-9e99, -9e99, -9e99);
 	for (int i = 0; i < allVerts.size(); i++) {
 		faceMath.localVerts[i] = (faceMath.worldToLocal * vec4(allVerts[i], 1)).xy();
+		expandBoundingBox(allVerts[i], faceMath.mins, faceMath.maxs);
 	}
 }
 
 BspRenderer::~BspRenderer() {
 	if (lightmapFuture.wait_for(chrono::milliseconds(0)) != future_status::ready ||
 		texturesFuture.wait_for(chrono::milliseconds(0)) != future_status::ready ||
-		clipnodesFuture.wait_for(chrono::milliseconds(0)) != future_status::ready) {
+		clipnodesFuture.wait_for(chrono::milliseconds(0)) != future_status::ready ||
+		faceBvhFuture.wait_for(chrono::milliseconds(0)) != future_status::ready) {
 		logf("ERROR: Deleted bsp renderer while it was loading\n");
 	}
 
@@ -1089,6 +1252,10 @@ BspRenderer::~BspRenderer() {
 	deleteTextures();
 	deleteLightmapTextures();
 	deleteRenderFaces();
+
+	for (int i = 0; i < wads.size(); i++) {
+		g_wads.releaseWad(wads[i]);
+	}
 	deleteRenderClipnodes();
 	deleteFaceMaths();
 
@@ -1147,6 +1314,10 @@ void BspRenderer::delayLoadData() {
 		clipnodesLoaded = true;
 		debugf("Loaded %d clipnode leaves\n", clipnodeLeafCount);
 	}
+
+	if (!faceBvhsLoaded && faceBvhFuture.wait_for(chrono::milliseconds(0)) == future_status::ready) {
+		faceBvhsLoaded = true;
+	}
 }
 
 bool BspRenderer::isFinishedLoading() {
@@ -1229,11 +1400,202 @@ uint BspRenderer::getFaceTextureId(int faceIdx) {
 	return glTextures[texinfo.iMiptex]->id;
 }
 
+bool BspRenderer::updateVis() {
+	if (!(g_render_flags & RENDER_VIS_CULLING) || map->visDataLength <= 0 || map->leafCount <= 1 || map->modelCount <= 0) {
+		return false;
+	}
+
+	if (entVisLeavesDirty) {
+		for (int i = 0; i < entInFrustum.size(); i++) {
+			updateEntVisLeaves(i);
+		}
+		entVisLeavesDirty = false;
+	}
+
+	vec3 localCamera = g_app->cameraOrigin - mapOffset;
+
+	vector<int> nodeBranch;
+	int leafIdx = -1;
+	int childIdx = -1;
+	map->pointContents(map->models[0].iHeadnodes[0], localCamera, 0, nodeBranch, leafIdx, childIdx);
+
+	if (leafIdx <= 0 || leafIdx >= map->leafCount || map->leaves[leafIdx].nVisOffset < 0
+		|| map->leaves[leafIdx].nVisOffset >= map->visDataLength) {
+		return false; // outside of the map, or in a leaf that can see everything
+	}
+
+	if (visDirty || leafIdx != visLeafIdx) {
+		calcVisRanges(leafIdx);
+	}
+
+	stats.visLeaf = visLeafIdx;
+	stats.visibleLeaves = visLeafCount;
+	stats.totalLeaves = map->leafCount - 1;
+	stats.visibleWorldFaces = visFaceCount;
+
+	return true;
+}
+
+void BspRenderer::calcVisRanges(int leafIdx) {
+	TraceSpan trace("calcVisRanges");
+	BSPMODEL& world = map->models[0];
+	RenderModel& worldRender = renderModels[0];
+
+	// leaf 0 is the shared solid leaf and has no bit in the vis rows
+	int visDataLeafCount = map->leafCount - 1;
+	int rowSize = ((visDataLeafCount + 63) & ~63) >> 3;
+	visRow.resize(rowSize);
+	memset(&visRow[0], 0, rowSize);
+	DecompressVis(map->visdata + map->leaves[leafIdx].nVisOffset, &visRow[0], rowSize, visDataLeafCount);
+
+	visLeaves.init(map->leafCount);
+	visLeaves.set(leafIdx);
+	visLeafCount = 1;
+	for (int i = 0; i < visDataLeafCount; i++) {
+		if (visRow[i >> 3] & (1 << (i & 7))) {
+			visLeafCount += !visLeaves.test_and_set(i + 1);
+		}
+	}
+
+	// faces of the visible leaves
+	vector<bool> visibleFaces(worldRender.renderFaceCount);
+	for (int i = 1; i < map->leafCount; i++) {
+		if (!visLeaves[i]) {
+			continue;
+		}
+		BSPLEAF& leaf = map->leaves[i];
+		for (int k = 0; k < leaf.nMarkSurfaces; k++) {
+			int markIdx = leaf.iFirstMarkSurface + k;
+			if (markIdx >= map->marksurfCount) {
+				break;
+			}
+			int faceIdx = map->marksurfs[markIdx] - world.iFirstFace;
+			if (faceIdx >= 0 && faceIdx < worldRender.renderFaceCount) {
+				visibleFaces[faceIdx] = true;
+			}
+		}
+	}
+
+	// faces are stored in order in each group buffer, so neighboring visible faces merge into one range
+	visGroupRanges.clear();
+	visWireframeRanges.clear();
+	visGroupRanges.resize(worldRender.groupCount);
+	visWireframeRanges.resize(worldRender.groupCount);
+	visFaceCount = 0;
+
+	for (int i = 0; i < worldRender.renderFaceCount; i++) {
+		if (!visibleFaces[i]) {
+			continue;
+		}
+		visFaceCount++;
+
+		RenderFace& face = worldRender.renderFaces[i];
+		RenderRanges& ranges = visGroupRanges[face.group];
+		RenderRanges& wireRanges = visWireframeRanges[face.group];
+
+		if (ranges.starts.size() && ranges.starts.back() + ranges.counts.back() == face.vertOffset) {
+			ranges.counts.back() += face.vertCount;
+		}
+		else {
+			ranges.starts.push_back(face.vertOffset);
+			ranges.counts.push_back(face.vertCount);
+		}
+
+		if (wireRanges.starts.size() && wireRanges.starts.back() + wireRanges.counts.back() == face.wireframeVertOffset) {
+			wireRanges.counts.back() += face.wireframeVertCount;
+		}
+		else {
+			wireRanges.starts.push_back(face.wireframeVertOffset);
+			wireRanges.counts.push_back(face.wireframeVertCount);
+		}
+	}
+
+	visLeafIdx = leafIdx;
+	visDirty = false;
+}
+
+bool BspRenderer::isEntVisible(int entIdx) {
+	vector<int>& entLeaves = renderEnts[entIdx].visLeaves;
+	if (entLeaves.empty()) {
+		return true;
+	}
+
+	for (int i = 0; i < entLeaves.size(); i++) {
+		if (entLeaves[i] < visLeaves.count && visLeaves[entLeaves[i]]) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void BspRenderer::cullEntsByFrustum() {
+	int entCount = entInFrustum.size();
+	if (entCount == 0) {
+		return;
+	}
+
+	vec3 cameraOrigin = g_app->cameraOrigin - mapOffset;
+	vec3 forward, right, up;
+	makeVectors(g_app->cameraAngles, forward, right, up);
+
+	float aspect = g_app->windowHeight > 0 ? (float)g_app->windowWidth / (float)g_app->windowHeight : 1.0f;
+	float tanY = tanf(g_app->fov * PI / 360.0f);
+	float tanX = tanY * aspect;
+
+	// inward facing planes: near, far, left, right, bottom, top
+	vec3 normals[6] = {
+		forward,
+		forward * -1.0f,
+		(right + forward * tanX).normalize(),
+		(right * -1.0f + forward * tanX).normalize(),
+		(up + forward * tanY).normalize(),
+		(up * -1.0f + forward * tanY).normalize()
+	};
+	float dists[6];
+	for (int p = 0; p < 6; p++) {
+		dists[p] = dotProduct(normals[p], cameraOrigin);
+	}
+	dists[0] += g_app->zNear;
+	dists[1] -= g_app->zFar;
+
+	byte* inside = &entInFrustum[0];
+	const float* cx = &entCenters[0][0];
+	const float* cy = &entCenters[1][0];
+	const float* cz = &entCenters[2][0];
+	const float* ex = &entExtents[0][0];
+	const float* ey = &entExtents[1][0];
+	const float* ez = &entExtents[2][0];
+
+	memset(inside, 1, entCount);
+
+	// branchless so the compiler can test several boxes at once
+	for (int p = 0; p < 6; p++) {
+		float nx = normals[p].x, ny = normals[p].y, nz = normals[p].z;
+		float ax = fabs(nx), ay = fabs(ny), az = fabs(nz);
+		float dist = dists[p];
+
+		for (int i = 0; i < entCount; i++) {
+			float maxDist = nx * cx[i] + ny * cy[i] + nz * cz[i] + ax * ex[i] + ay * ey[i] + az * ez[i];
+			inside[i] &= (byte)(maxDist >= dist);
+		}
+	}
+}
+
 void BspRenderer::render(int highlightEnt, bool highlightAlwaysOnTop, int clipnodeHull) {
 	BSPMODEL& world = map->models[0];
 	mapOffset = map->ents[0]->getOrigin();
 	vec3 renderOffset = mapOffset.flip();
 
+	memset(&stats, 0, sizeof(RenderStats));
+	stats.visLeaf = -1;
+	stats.totalWorldFaces = renderModels[0].renderFaceCount;
+	visCulling = updateVis();
+	if (!visCulling) {
+		stats.visibleWorldFaces = stats.totalWorldFaces;
+	}
+	cullEntsByFrustum();
+
 	ShaderProgram* activeShader = (g_render_flags & RENDER_LIGHTMAPS) ? bspShader : fullBrightBspShader;
 
 	activeShader->bind();
@@ -1266,6 +1628,16 @@ void BspRenderer::render(int highlightEnt, bool highlightAlwaysOnTop, int clipno
 
 		for (int i = 0, sz = map->ents.size(); i < sz; i++) {
 			if (renderEnts[i].modelIdx >= 0 && renderEnts[i].modelIdx < map->modelCount) {
+				if (i != highlightEnt && !entInFrustum[i]) {
+					stats.frustumCulledEnts += pass == 0;
+					continue;
+				}
+				if (visCulling && i != highlightEnt && !isEntVisible(i)) {
+					stats.visCulledEnts += pass == 0;
+					continue;
+				}
+				stats.drawnEnts += pass == 0;
+
 				activeShader->pushMatrix(MAT_MODEL);
 				*activeShader->modelMat = renderEnts[i].modelMat;
 				activeShader->modelMat->translate(renderOffset.x, renderOffset.y, renderOffset.z);
@@ -1296,6 +1668,9 @@ void BspRenderer::render(int highlightEnt, bool highlightAlwaysOnTop, int clipno
 					if (clipnodeHull == -1 && renderModels[renderEnts[i].modelIdx].groupCount > 0) {
 						continue; // skip rendering for models that have faces, if in auto mode
 					}
+					if (i != highlightEnt && (!entInFrustum[i] || (visCulling && !isEntVisible(i)))) {
+						continue;
+					}
 					colorShader->pushMatrix(MAT_MODEL);
 					*colorShader->modelMat = renderEnts[i].modelMat;
 					colorShader->modelMat->translate(renderOffset.x, renderOffset.y, renderOffset.z);
@@ -1337,6 +1712,8 @@ void BspRenderer::render(int highlightEnt, bool highlightAlwaysOnTop, int clipno
 		}
 	}
 
+	visCulling = false;
+
 	delayLoadData();
 }
 
@@ -1359,6 +1736,8 @@ void BspRenderer::drawModel(int modelIdx, bool transparent, bool highlight, bool
 		return;
 	}
 
+	bool visCulled = visCulling && modelIdx == 0 && visGroupRanges.size() == renderModels[0].groupCount;
+
 	for (int i = 0; i < renderModels[modelIdx].groupCount; i++) {
 		RenderGroup& rgroup = renderModels[modelIdx].renderGroups[i];
 
@@ -1390,7 +1769,13 @@ void BspRenderer::drawModel(int modelIdx, bool transparent, bool highlight, bool
 			glActiveTexture(GL_TEXTURE1);
 			whiteTex->bind();
 
-			rgroup.wireframeBuffer->draw(GL_LINES);
+			if (visCulled) {
+				RenderRanges& ranges = visWireframeRanges[i];
+				rgroup.wireframeBuffer->drawRanges(GL_LINES, ranges.starts.data(), ranges.counts.data(), ranges.starts.size());
+			}
+			else {
+				rgroup.wireframeBuffer->draw(GL_LINES);
+			}
 		}
 
 
@@ -1426,7 +1811,13 @@ void BspRenderer::drawModel(int modelIdx, bool transparent, bool highlight, bool
 			}
 		}
 
-		rgroup.buffer->draw(GL_TRIANGLES);
+		if (visCulled) {
+			RenderRanges& ranges = visGroupRanges[i];
+			rgroup.buffer->drawRanges(GL_TRIANGLES, ranges.starts.data(), ranges.counts.data(), ranges.starts.size());
+		}
+		else {
+			rgroup.buffer->draw(GL_TRIANGLES);
+		}
 	}
 }
 
@@ -1552,23 +1943,41 @@ bool BspRenderer::pickModelPoly(vec3 start, vec3 dir, vec3 offset, int modelIdx,
 	bool foundBetterPick = false;
 	bool skipSpecial = !(g_render_flags & RENDER_SPECIAL);
 
-	for (int k = 0; k < model.nFaces; k++) {
+	auto pickFace = [&](int k, float& bestDist) {
 		FaceMath& faceMath = faceMaths[model.iFirstFace + k];
 		BSPFACE& face = map->faces[model.iFirstFace + k];
-		
+
 		if (skipSpecial && modelIdx == 0) {
 			BSPTEXTUREINFO& info = map->texinfos[face.iTextureInfo];
 			if (info.nFlags & TEX_SPECIAL) {
-				continue;
+				return false;
 			}
 		}
 
-		float t = pickInfo.bestDist;
-		if (pickFaceMath(start, dir, faceMath, t)) {
+		if (pickFaceMath(start, dir, faceMath, bestDist)) {
 			foundBetterPick = true;
 			pickInfo.valid = true;
-			pickInfo.bestDist = t;
 			pickInfo.faceIdx = model.iFirstFace + k;
+			return true;
+		}
+		return false;
+	};
+
+	if (faceBvhsLoaded && modelIdx < numFaceBvhs && faceBvhs[modelIdx].itemCount() == model.nFaces) {
+		faceBvhs[modelIdx].traceRay(start, dir, pickInfo.bestDist, pickFace);
+	}
+	else if (!(skipSpecial && modelIdx == 0)) {
+		// the BVH is still being built or is out of date. Walk the node tree instead.
+		int faceIdx = map->traceRay(modelIdx, start, dir, pickInfo.bestDist);
+		if (faceIdx != -1) {
+			foundBetterPick = true;
+			pickInfo.valid = true;
+			pickInfo.faceIdx = faceIdx;
+		}
+	}
+	else {
+		for (int k = 0; k < model.nFaces; k++) {
+			pickFace(k, pickInfo.bestDist);
 		}
 	}
 
@@ -1581,15 +1990,24 @@ bool BspRenderer::pickModelPoly(vec3 start, vec3 dir, vec3 offset, int modelIdx,
 	}
 
 	if (clipnodesLoaded && (selectWorldClips || selectEntClips) && hullIdx != -1) {
-		for (int i = 0; i < renderClipnodes[modelIdx].faceMaths[hullIdx].size(); i++) {
-			FaceMath& faceMath = renderClipnodes[modelIdx].faceMaths[hullIdx][i];
+		RenderClipnodes& clip = renderClipnodes[modelIdx];
 
-			float t = pickInfo.bestDist;
-			if (pickFaceMath(start, dir, faceMath, t)) {
+		auto pickClipFace = [&](int i, float& bestDist) {
+			if (pickFaceMath(start, dir, clip.faceMaths[hullIdx][i], bestDist)) {
 				foundBetterPick = true;
 				pickInfo.valid = true;
-				pickInfo.bestDist = t;
 				pickInfo.faceIdx = -1;
+				return true;
+			}
+			return false;
+		};
+
+		if (clip.faceBvh[hullIdx]) {
+			clip.faceBvh[hullIdx]->traceRay(start, dir, pickInfo.bestDist, pickClipFace);
+		}
+		else {
+			for (int i = 0; i < clip.faceMaths[hullIdx].size(); i++) {
+				pickClipFace(i, pickInfo.bestDist);
 			}
 		}
 	}
@@ -8,6 +8,8 @@
 #include "VertexBuffer.h"
 #include "primitives.h"
 #include "PointEntRenderer.h"
+#include "bvh.h"
+#include "WadManager.h"
 
 #define LIGHTMAP_ATLAS_SIZE 512
 
@@ -22,7 +24,8 @@ enum RenderFlags {
 	RENDER_ORIGIN = 128,
 	RENDER_WORLD_CLIPNODES = 256,
 	RENDER_ENT_CLIPNODES = 512,
-	RENDER_ENT_CONNECTIONS = 1024
+	RENDER_ENT_CONNECTIONS = 1024,
+	RENDER_VIS_CULLING = 2048
 };
 
 struct LightmapInfo {
@@ -42,6 +45,7 @@ struct FaceMath {
 	vec3 normal;
 	float fdist;
 	vector<vec2> localVerts;
+	vec3 mins, maxs; // world bounds of the face verts
 };
 
 struct RenderEnt {
@@ -49,6 +53,7 @@ struct RenderEnt {
 	vec3 offset; // vertex transformations for picking
 	int modelIdx; // -1 = point entity
 	EntCube* pointEntCube;
+	vector<int> visLeaves; // world leaves the model bounds touch. Empty if there were too many to check.
 };
 
 struct RenderGroup {
@@ -67,6 +72,26 @@ struct RenderFace {
 	int group;
 	int vertOffset;
 	int vertCount;
+	int wireframeVertOffset;
+	int wireframeVertCount;
+};
+
+// vertex ranges to draw from a render group buffer
+struct RenderRanges {
+	vector<int> starts;
+	vector<int> counts;
+};
+
+// counts from the last frame
+struct RenderStats {
+	int visLeaf; // leaf the camera is in, or -1 if the whole map was drawn
+	int visibleLeaves;
+	int totalLeaves;
+	int visibleWorldFaces;
+	int totalWorldFaces;
+	int visCulledEnts;
+	int frustumCulledEnts;
+	int drawnEnts;
 };
 
 struct RenderModel {
@@ -80,6 +105,7 @@ struct RenderClipnodes {
 	VertexBuffer* clipnodeBuffer[MAX_MAP_HULLS];
 	VertexBuffer* wireframeClipnodeBuffer[MAX_MAP_HULLS];
 	vector<FaceMath> faceMaths[MAX_MAP_HULLS];
+	Bvh* faceBvh[MAX_MAP_HULLS]; // for picking faceMaths
 };
 
 struct PickInfo {
@@ -98,6 +124,7 @@ public:
 	Bsp* map;
 	PointEntRenderer* pointEntRenderer;
 	vec3 mapOffset;
+	RenderStats stats;
 
 	BspRenderer(Bsp* map, ShaderProgram* bspShader, ShaderProgram* fullBrightBspShader, ShaderProgram* colorShader, PointEntRenderer* fgd);
 	~BspRenderer();
@@ -112,7 +139,8 @@ public:
 	bool pickModelPoly(vec3 start, vec3 dir, vec3 offset, int modelIdx, int hullIdx, PickInfo& pickInfo);
 	bool pickFaceMath(vec3 start, vec3 dir, FaceMath& faceMath, float& bestDist);
 
-	void refreshEnt(int entIdx);
+	void refreshEnt(int entIdx, bool updateNameIndex=true); // preRenderEnts rebuilds the name index itself
+	void invalidateVis(); // call after the world geometry or VIS data changes
 	int refreshModel(int modelIdx, bool refreshClipnodes=true);
 	int refreshModelClipnodes(int modelIdx);
 	void refreshFace(int faceIdx);
@@ -151,16 +179,19 @@ private:
 	RenderModel* renderModels = NULL;
 	RenderClipnodes* renderClipnodes = NULL;
 	FaceMath* faceMaths = NULL;
+	Bvh* faceBvhs = NULL; // one per model, for picking faces without testing all of them
 	VertexBuffer* pointEnts = NULL;
 
 	// textures loaded in a separate thread
 	Texture** glTexturesSwap;
+	vector<Wad*> wads; // shared with other maps through g_wads
 
 	int numLightmapAtlases;
 	int numRenderModels;
 	int numRenderClipnodes;
 	int numRenderLightmapInfos;
 	int numFaceMaths;
+	int numFaceBvhs = 0;
 	int numPointEnts;
 	int numLoadedTextures = 0;
 
@@ -185,10 +216,41 @@ private:
 	int clipnodeLeafCount = 0;
 	future<void> clipnodesFuture;
 
+	bool faceBvhsLoaded = false;
+	future<void> faceBvhFuture;
+
+	// world faces in the PVS of the camera leaf. Rebuilt when the camera enters another leaf or the world changes.
+	bool visCulling = false; // true while rendering a frame that only draws the PVS
+	bool visDirty = true;
+	bool entVisLeavesDirty = false; // entity leaf lists were made with an old world node tree
+	int visLeafIdx = -1;
+	BITSET visLeaves;
+	vector<byte> visRow;
+	vector<RenderRanges> visGroupRanges; // per world render group
+	vector<RenderRanges> visWireframeRanges;
+	int visLeafCount = 0;
+	int visFaceCount = 0;
+
+	// entity model bounds split by axis so the frustum test can check many boxes per loop iteration.
+	// Entities without a model get infinite extents and are never culled.
+	vector<float> entCenters[3];
+	vector<float> entExtents[3];
+	vector<byte> entInFrustum;
+
 	void loadLightmaps();
 	void genRenderFaces(int& renderModelCount);
 	void loadClipnodes();
 	void generateClipnodeBuffer(int modelIdx);
+	void loadFaceBvhs();
+	void refitFaceBvh(int modelIdx);
+
+	// finds the camera leaf and updates the PVS if needed. Returns false if the whole map should be drawn.
+	bool updateVis();
+	void calcVisRanges(int leafIdx);
+	bool isEntVisible(int entIdx);
+	void updateEntVisLeaves(int entIdx);
+	void findTouchedLeaves(int iNode, vec3 mins, vec3 maxs, vector<int>& touchedLeaves);
+	void cullEntsByFrustum();
 	void deleteRenderModel(RenderModel* renderModel);
 	void deleteRenderModelClipnodes(RenderClipnodes* renderModel);
 	void deleteRenderClipnodes();
@@ -384,6 +384,7 @@ void Gui::draw3dContextMenus() {
 
 								if (ImGui::MenuItem(("Hull " + to_string(k)).c_str(), 0, false, isHullValid)) {
 									model.iHeadnodes[i] = model.iHeadnodes[k];
+									map->invalidate_model_usage();
 									app->mapRenderers[app->pickInfo.mapIdx]->refreshModelClipnodes(app->pickInfo.modelIdx);
 									checkValidHulls();
 									logf("Redirected hull %d to hull %d on model %d\n", i, k, app->pickInfo.modelIdx);
@@ -963,6 +964,35 @@ void Gui::drawDebugWidget() {
 			ImGui::Text("Angles: %d %d %d", (int)app->cameraAngles.x, (int)app->cameraAngles.y, (int)app->cameraAngles.z);
 		}
 
+		if (ImGui::CollapsingHeader("Rendering", ImGuiTreeNodeFlags_DefaultOpen))
+		{
+			RenderStats total;
+			memset(&total, 0, sizeof(RenderStats));
+			int culledMaps = 0;
+			for (int i = 0; i < app->mapRenderers.size(); i++) {
+				RenderStats& stats = app->mapRenderers[i]->stats;
+				culledMaps += stats.visLeaf != -1;
+				total.visibleLeaves += stats.visibleLeaves;
+				total.totalLeaves += stats.totalLeaves;
+				total.visibleWorldFaces += stats.visibleWorldFaces;
+				total.totalWorldFaces += stats.totalWorldFaces;
+				total.visCulledEnts += stats.visCulledEnts;
+				total.frustumCulledEnts += stats.frustumCulledEnts;
+				total.drawnEnts += stats.drawnEnts;
+			}
+
+			if (culledMaps > 0) {
+				ImGui::Text("VIS Leaves: %d / %d", total.visibleLeaves, total.totalLeaves);
+			}
+			else {
+				ImGui::Text("VIS Leaves: all (no camera leaf)");
+			}
+			ImGui::Text("World Faces: %d / %d", total.visibleWorldFaces, total.totalWorldFaces);
+			ImGui::Text("Entities Drawn: %d", total.drawnEnts);
+			ImGui::Text("Entities Hidden by VIS: %d", total.visCulledEnts);
+			ImGui::Text("Entities Outside View: %d", total.frustumCulledEnts);
+		}
+
 		if (app->pickInfo.valid) {
 			Bsp* map = app->pickInfo.map;
 			Entity* ent =app->pickInfo.ent;
@@ -1045,6 +1075,30 @@ void Gui::drawDebugWidget() {
 							ImGui::Text("Head Node: %d", headNode);
 							ImGui::Text("Depth: %d", nodeBranch.size());
 
+							// what's in front of the camera, from this hull's point of view
+							const float traceDist = 8192.0f;
+							TraceResult trace;
+							map->traceHull(app->pickInfo.modelIdx, i, localCamera, localCamera + app->cameraForward * traceDist, trace);
+							if (trace.startSolid) {
+								ImGui::Text("Forward Trace: starts solid");
+							}
+							else if (trace.fraction < 1.0f) {
+								ImGui::Text("Forward Trace: %.1f units", trace.fraction * traceDist);
+							}
+							else {
+								ImGui::Text("Forward Trace: no hit");
+							}
+							if (i == 0) {
+								float faceDist = traceDist;
+								int faceIdx = map->traceRay(app->pickInfo.modelIdx, localCamera, app->cameraForward, faceDist);
+								if (faceIdx != -1) {
+									ImGui::Text("Forward Face: %d (%.1f units)", faceIdx, faceDist);
+								}
+								else {
+									ImGui::Text("Forward Face: none");
+								}
+							}
+
 							ImGui::Unindent();
 							ImGui::TreePop();
 						}
@@ -1088,7 +1142,7 @@ void Gui::drawKeyvalueEditor() {
 			Entity* ent = app->pickInfo.ent;
 			BSPMODEL& model = map->models[app->pickInfo.modelIdx];
 			BSPFACE& face = map->faces[app->pickInfo.faceIdx];
-			string cname = ent->keyvalues["classname"];
+			string cname = ent->getKeyvalue("classname");
 			FgdClass* fgdClass = app->fgd->getFgdClass(cname);
 
 			ImGui::PushFont(largeFont);
@@ -1180,7 +1234,7 @@ void Gui::drawKeyvalueEditor() {
 }
 
 void Gui::drawKeyvalueEditor_SmartEditTab(Entity* ent) {
-	string cname = ent->keyvalues["classname"];
+	string cname = ent->getKeyvalue("classname");
 	FgdClass* fgdClass = app->fgd->getFgdClass(cname);
 	ImGuiStyle& style = ImGui::GetStyle();
 
@@ -1217,7 +1271,7 @@ void Gui::drawKeyvalueEditor_SmartEditTab(Entity* ent) {
 			if (key == "spawnflags") {
 				continue;
 			}
-			string value = ent->keyvalues[key];
+			string value = ent->getKeyvalue(key);
 			string niceName = keyvalue.description;
 
 			if (value.empty() && keyvalue.defaultValue.length()) {
@@ -1329,8 +1383,8 @@ void Gui::drawKeyvalueEditor_SmartEditTab(Entity* ent) {
 void Gui::drawKeyvalueEditor_FlagsTab(Entity* ent) {
 	ImGui::BeginChild("FlagsWindow");
 
-	uint spawnflags = strtoul(ent->keyvalues["spawnflags"].c_str(), NULL, 10);
-	FgdClass* fgdClass = app->fgd->getFgdClass(ent->keyvalues["classname"]);
+	uint spawnflags = strtoul(ent->getKeyvalue("spawnflags").c_str(), NULL, 10);
+	FgdClass* fgdClass = app->fgd->getFgdClass(ent->getKeyvalue("classname"));
 
 	ImGui::Columns(2, "keyvalcols", true);
 
@@ -1416,7 +1470,7 @@ void Gui::drawKeyvalueEditor_RawEditTab(Entity* ent) {
 			InputData* inputData = (InputData*)data->UserData;
 			Entity* ent = inputData->entRef;
 
-			string key = ent->keyOrder[inputData->idx];
+			string key = ent->getKey(inputData->idx);
 			if (key != data->Buf) {
 				ent->renameKey(inputData->idx, data->Buf);
 				inputData->bspRenderer->refreshEnt(inputData->entIdx);
@@ -1433,9 +1487,9 @@ void Gui::drawKeyvalueEditor_RawEditTab(Entity* ent) {
 		static int keyValueChanged(ImGuiInputTextCallbackData* data) {
 			InputData* inputData = (InputData*)data->UserData;
 			Entity* ent = inputData->entRef;
-			string key = ent->keyOrder[inputData->idx];
+			string key = ent->getKey(inputData->idx);
 
-			if (ent->keyvalues[key] != data->Buf) {
+			if (ent->getValue(inputData->idx) != data->Buf) {
 				ent->setOrAddKeyvalue(key, data->Buf);
 				inputData->bspRenderer->refreshEnt(inputData->entIdx);
 				if (key == "model") {
@@ -1482,7 +1536,7 @@ void Gui::drawKeyvalueEditor_RawEditTab(Entity* ent) {
 	bool keyDragging = false;
 
 	float startY = 0;
-	for (int i = 0; i < ent->keyOrder.size() && i < MAX_KEYS_PER_ENT; i++) {
+	for (int i = 0; i < ent->keyCount() && i < MAX_KEYS_PER_ENT; i++) {
 		const char* item = dragIds[i];
 
 		{
@@ -1508,14 +1562,12 @@ void Gui::drawKeyvalueEditor_RawEditTab(Entity* ent) {
 			if (ImGui::IsItemActive() && !ImGui::IsItemHovered())
 			{
 				int n_next = (ImGui::GetMousePos().y - startY) / (ImGui::GetItemRectSize().y + style.FramePadding.y * 2);
-				if (n_next >= 0 && n_next < ent->keyOrder.size() && n_next < 128)
+				if (n_next >= 0 && n_next < ent->keyCount() && n_next < 128)
 				{
 					dragIds[i] = dragIds[n_next];
 					dragIds[n_next] = item;
 
-					string temp = ent->keyOrder[i];
-					ent->keyOrder[i] = ent->keyOrder[n_next];
-					ent->keyOrder[n_next] = temp;
+					ent->swapKeys(i, n_next);
 
 					// fix false-positive error highlight
 					ignoreErrors = 2;
@@ -1527,8 +1579,8 @@ void Gui::drawKeyvalueEditor_RawEditTab(Entity* ent) {
 			ImGui::NextColumn();
 		}
 
-		string key = ent->keyOrder[i];
-		string value = ent->keyvalues[key];
+		string key = ent->getKey(i);
+		string value = ent->getValue(i);
 
 		{
 			bool invalidKey = ignoreErrors == 0 && lastPickCount == app->pickCount && key != keyNames[i];
@@ -1674,7 +1726,7 @@ void Gui::drawTransformWidget() {
 					z = fz = last_fz = activeAxes.origin.z;
 				}
 				else {
-					vec3 ori = ent->hasKey("origin") ? parseVector(ent->keyvalues["origin"]) : vec3();
+					vec3 ori = ent->hasKey("origin") ? parseVector(ent->getKeyvalue("origin")) : vec3();
 					if (app->originSelected) {
 						ori = app->transformedOrigin;
 					}
@@ -2145,6 +2197,7 @@ void Gui::drawSettings() {
 			bool renderWorldClipnodes = g_render_flags & RENDER_WORLD_CLIPNODES;
 			bool renderEntClipnodes = g_render_flags & RENDER_ENT_CLIPNODES;
 			bool renderEntConnections = g_render_flags & RENDER_ENT_CONNECTIONS;
+			bool renderVisCulling = g_render_flags & RENDER_VIS_CULLING;
 
 			ImGui::Text("Render Flags:");
 
@@ -2185,6 +2238,9 @@ void Gui::drawSettings() {
 			if (ImGui::Checkbox("Special World Faces", &renderSpecial)) {
 				g_render_flags ^= RENDER_SPECIAL;
 			}
+			if (ImGui::Checkbox("VIS Culling", &renderVisCulling)) {
+				g_render_flags ^= RENDER_VIS_CULLING;
+			}
 			
 
 			ImGui::Columns(1);
@@ -2443,22 +2499,22 @@ void Gui::drawLimitTab(Bsp* map, int sortMode) {
 	}
 
 	if (!loadedLimit[sortMode]) {
-		vector<STRUCTUSAGE*> modelInfos = map->get_sorted_model_infos(sortMode);
+		vector<MODELUSAGE> modelInfos = map->get_sorted_model_infos(sortMode);
+		map->update_model_ent_index();
 
 		limitModels[sortMode].clear();
 		for (int i = 0; i < modelInfos.size(); i++) {
 
 			int val;
 			switch (sortMode) {
-			case SORT_VERTS:		val = modelInfos[i]->sum.verts; break;
-			case SORT_NODES:		val = modelInfos[i]->sum.nodes; break;
-			case SORT_CLIPNODES:	val = modelInfos[i]->sum.clipnodes; break;
-			case SORT_FACES:		val = modelInfos[i]->sum.faces; break;
+			case SORT_VERTS:		val = modelInfos[i].sum.verts; break;
+			case SORT_NODES:		val = modelInfos[i].sum.nodes; break;
+			case SORT_CLIPNODES:	val = modelInfos[i].sum.clipnodes; break;
+			case SORT_FACES:		val = modelInfos[i].sum.faces; break;
 			}
 
-			ModelInfo stat = calcModelStat(map, modelInfos[i], val, maxCount, false);
+			ModelInfo stat = calcModelStat(map, &modelInfos[i], val, maxCount, false);
 			limitModels[sortMode].push_back(stat);
-			delete modelInfos[i];
 		}
 		loadedLimit[sortMode] = true;
 	}
@@ -2576,7 +2632,7 @@ void Gui::drawEntityReport() {
 				visibleEnts.clear();
 				for (int i = 1; i < map->ents.size(); i++) {
 					Entity* ent = map->ents[i];
-					string cname = ent->keyvalues["classname"];
+					string cname = ent->getKeyvalue("classname");
 
 					bool visible = true;
 
@@ -2591,12 +2647,12 @@ void Gui::drawEntityReport() {
 							string searchKey = trimSpaces(toLowerCase(keyFilter[k]));
 
 							bool foundKey = false;
-							string actualKey;
-							for (int c = 0; c < ent->keyOrder.size(); c++) {
-								string key = toLowerCase(ent->keyOrder[c]);
+							int actualKey = -1;
+							for (int c = 0; c < ent->keyCount(); c++) {
+								string key = toLowerCase(ent->getKey(c));
 								if (key == searchKey || (partialMatches && key.find(searchKey) != string::npos)) {
 									foundKey = true;
-									actualKey = key;
+									actualKey = c;
 									break;
 								}
 							}
@@ -2607,8 +2663,8 @@ void Gui::drawEntityReport() {
 
 							string searchValue = trimSpaces(toLowerCase(valueFilter[k]));
 							if (!searchValue.empty()) {
-								if ((partialMatches && ent->keyvalues[actualKey].find(searchValue) == string::npos) ||
-									(!partialMatches && ent->keyvalues[actualKey] != searchValue)) {
+								if ((partialMatches && ent->getValue(actualKey).find(searchValue) == string::npos) ||
+									(!partialMatches && ent->getValue(actualKey) != searchValue)) {
 									visible = false;
 									break;
 								}
@@ -2617,8 +2673,8 @@ void Gui::drawEntityReport() {
 						else if (strlen(valueFilter[k]) > 0) {
 							string searchValue = trimSpaces(toLowerCase(valueFilter[k]));
 							bool foundMatch = false;
-							for (int c = 0; c < ent->keyOrder.size(); c++) {
-								string val = toLowerCase(ent->keyvalues[ent->keyOrder[c]]);
+							for (int c = 0; c < ent->keyCount(); c++) {
+								string val = toLowerCase(ent->getValue(c));
 								if (val == searchValue || (partialMatches && val.find(searchValue) != string::npos)) {
 									foundMatch = true;
 									break;
@@ -2652,7 +2708,7 @@ void Gui::drawEntityReport() {
 					int i = line;
 					int entIdx = visibleEnts[i];
 					Entity* ent = map->ents[entIdx];
-					string cname = ent->keyvalues["classname"];
+					string cname = ent->getKeyvalue("classname");
 
 					if (ImGui::Selectable((cname + "##ent" + to_string(i)).c_str(), selectedItems[i], ImGuiSelectableFlags_AllowDoubleClick)) {
 						if (expected_key_mod_flags & ImGuiKeyModFlags_Ctrl) {
@@ -2744,7 +2800,7 @@ void Gui::drawEntityReport() {
 
 					for (int i = 1; i < map->ents.size(); i++) {
 						Entity* ent = map->ents[i];
-						string cname = ent->keyvalues["classname"];
+						string cname = ent->getKeyvalue("classname");
 
 						if (uniqueClasses.find(cname) == uniqueClasses.end()) {
 							usedClasses.push_back(cname);
@@ -3006,8 +3062,10 @@ void Gui::drawTextureTool() {
 					texinfo->nFlags = isSpecial ? TEX_SPECIAL : 0;
 				}
 				if ((textureChanged || toggledFlags) && validTexture) {
-					if (textureChanged)
+					if (textureChanged) {
 						texinfo->iMiptex = newMiptex;
+						map->invalidate_model_usage();
+					}
 					modelRefreshes.insert(map->get_model_from_face(faceIdx));
 				}
 				mapRenderer->updateFaceUVs(faceIdx);
@@ -3099,17 +3157,17 @@ StatInfo Gui::calcStat(string name, uint val, uint max, bool isMem) {
 	return stat;
 }
 
-ModelInfo Gui::calcModelStat(Bsp* map, STRUCTUSAGE* modelInfo, uint val, uint max, bool isMem) {
+ModelInfo Gui::calcModelStat(Bsp* map, MODELUSAGE* modelInfo, uint val, uint max, bool isMem) {
 	ModelInfo stat;
 
 	string classname = modelInfo->modelIdx == 0 ? "worldspawn" : "???";
 	string targetname = modelInfo->modelIdx == 0 ? "" : "???";
-	for (int k = 0; k < map->ents.size(); k++) {
-		if (map->ents[k]->getBspModelIdx() == modelInfo->modelIdx) {
-			targetname = map->ents[k]->keyvalues["targetname"];
-			classname = map->ents[k]->keyvalues["classname"];
-			stat.entIdx = k;
-		}
+	vector<int> modelEnts = map->get_model_ent_indexes(modelInfo->modelIdx);
+	if (!modelEnts.empty()) {
+		int entIdx = modelEnts.back();
+		targetname = map->ents[entIdx]->getKeyvalue("targetname");
+		classname = map->ents[entIdx]->getKeyvalue("classname");
+		stat.entIdx = entIdx;
 	}
 
 	stat.classname = classname;
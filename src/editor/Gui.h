@@ -119,7 +119,7 @@ private:
 	void drawLimitTab(Bsp* map, int sortMode);
 	void drawEntityReport();
 	StatInfo calcStat(string name, uint val, uint max, bool isMem);
-	ModelInfo calcModelStat(Bsp* map, STRUCTUSAGE* modelInfo, uint val, uint max, bool isMem);
+	ModelInfo calcModelStat(Bsp* map, MODELUSAGE* modelInfo, uint val, uint max, bool isMem);
 	void checkValidHulls();
 	void reloadLimits();
 
@@ -4,6 +4,7 @@
 #include "VertexBuffer.h"
 #include "shaders.h"
 #include "Gui.h"
+#include "trace.h"
 #include <algorithm>
 #include <map>
 
@@ -96,6 +97,7 @@ void AppSettings::load() {
 			else if (key == "move_speed") { g_settings.moveSpeed = atof(val.c_str()); }
 			else if (key == "rot_speed") { g_settings.rotSpeed = atof(val.c_str()); }
 			else if (key == "render_flags") { g_settings.render_flags = atoi(val.c_str()); }
+			else if (key == "vis_culling") { g_settings.vis_culling = atoi(val.c_str()) != 0; }
 			else if (key == "font_size") { g_settings.fontSize = atoi(val.c_str()); }
 			else if (key == "undo_levels") { g_settings.undoLevels = atoi(val.c_str()); }
 			else if (key == "gamedir") { g_settings.gamedir = val; }
@@ -146,6 +148,7 @@ void AppSettings::save() {
 	file << "move_speed=" << g_settings.moveSpeed << endl;
 	file << "rot_speed=" << g_settings.rotSpeed << endl;
 	file << "render_flags=" << g_settings.render_flags << endl;
+	file << "vis_culling=" << g_settings.vis_culling << endl;
 	file << "font_size=" << g_settings.fontSize << endl;
 	file << "undo_levels=" << g_settings.undoLevels << endl;
 }
@@ -226,7 +229,7 @@ Renderer::Renderer() {
 
 	g_render_flags = RENDER_TEXTURES | RENDER_LIGHTMAPS | RENDER_SPECIAL 
 		| RENDER_ENTS | RENDER_SPECIAL_ENTS | RENDER_POINT_ENTS | RENDER_WIREFRAME | RENDER_ENT_CONNECTIONS
-		| RENDER_ENT_CLIPNODES;
+		| RENDER_ENT_CLIPNODES | RENDER_VIS_CULLING;
 	
 	pickInfo.valid = false;
 
@@ -309,7 +312,12 @@ void Renderer::renderLoop() {
 	float lastFrameTime = glfwGetTime();
 	while (!glfwWindowShouldClose(window))
 	{
-		glfwPollEvents();
+		TraceSpan frameTrace("frame");
+
+		{
+			TraceSpan trace("poll_events");
+			glfwPollEvents();
+		}
 
 		float frameDelta = glfwGetTime() - lastFrameTime;
 		frameTimeScale = 0.05f / frameDelta;
@@ -333,15 +341,18 @@ void Renderer::renderLoop() {
 		drawEntConnections();
 
 		isLoading = reloading;
-		for (int i = 0; i < mapRenderers.size(); i++) {
-			int highlightEnt = -1;
-			if (pickInfo.valid && pickInfo.mapIdx == i && pickMode == PICK_OBJECT) {
-				highlightEnt = pickInfo.entIdx;
-			}
-			mapRenderers[i]->render(highlightEnt, transformTarget == TRANSFORM_VERTEX, clipnodeRenderHull);
+		{
+			TraceSpan trace("render_maps");
+			for (int i = 0; i < mapRenderers.size(); i++) {
+				int highlightEnt = -1;
+				if (pickInfo.valid && pickInfo.mapIdx == i && pickMode == PICK_OBJECT) {
+					highlightEnt = pickInfo.entIdx;
+				}
+				mapRenderers[i]->render(highlightEnt, transformTarget == TRANSFORM_VERTEX, clipnodeRenderHull);
 
-			if (!mapRenderers[i]->isFinishedLoading()) {
-				isLoading = true;
+				if (!mapRenderers[i]->isFinishedLoading()) {
+					isLoading = true;
+				}
 			}
 		}
 
@@ -412,12 +423,20 @@ void Renderer::renderLoop() {
 		makeVectors(cameraAngles, forward, right, up);
 		//logf("DRAW %.1f %.1f %.1f -> %.1f %.1f %.1f\n", pickStart.x, pickStart.y, pickStart.z, pickDir.x, pickDir.y, pickDir.z);
 
-		if (!g_app->hideGui)
+		if (!g_app->hideGui) {
+			TraceSpan trace("gui");
 			gui->draw();
+		}
 
-		controls();
+		{
+			TraceSpan trace("controls");
+			controls();
+		}
 
-		glfwSwapBuffers(window);
+		{
+			TraceSpan trace("swap_buffers");
+			glfwSwapBuffers(window);
+		}
 
 		if (reloading && fgdFuture.wait_for(chrono::milliseconds(0)) == future_status::ready) {
 			delete pointEntRenderer;
@@ -491,6 +510,7 @@ void Renderer::saveSettings() {
 	g_settings.zfar = zFar;
 	g_settings.fov = fov;
 	g_settings.render_flags = g_render_flags;
+	g_settings.vis_culling = (g_render_flags & RENDER_VIS_CULLING) != 0;
 	g_settings.fontSize = gui->fontSize;
 	g_settings.undoLevels = undoLevels;
 	g_settings.moveSpeed = moveSpeed;
@@ -523,7 +543,10 @@ void Renderer::loadSettings() {
 	g_verbose = g_settings.verboseLogs;
 	zFar = g_settings.zfar;
 	fov = g_settings.fov;
-	g_render_flags = g_settings.render_flags;
+	g_render_flags = g_settings.render_flags & ~RENDER_VIS_CULLING;
+	if (g_settings.vis_culling) {
+		g_render_flags |= RENDER_VIS_CULLING;
+	}
 	gui->fontSize = g_settings.fontSize;
 	undoLevels = g_settings.undoLevels;
 	rotationSpeed = g_settings.rotSpeed;
@@ -1546,7 +1569,7 @@ void Renderer::drawNodes(Bsp* map, int iNode, int& currentPlane, int activePlane
 }
 
 vec3 Renderer::getEntOrigin(Bsp* map, Entity* ent) {
-	vec3 origin = ent->hasKey("origin") ? parseVector(ent->keyvalues["origin"]) : vec3(0, 0, 0);
+	vec3 origin = ent->hasKey("origin") ? parseVector(ent->getKeyvalue("origin")) : vec3(0, 0, 0);
 	return origin + getEntOffset(map, ent);
 }
 
@@ -1583,7 +1606,7 @@ void Renderer::updateDragAxes() {
 
 			scaleAxes.origin = modelOrigin;
 			if (ent->hasKey("origin")) {
-				scaleAxes.origin += parseVector(ent->keyvalues["origin"]);
+				scaleAxes.origin += parseVector(ent->getKeyvalue("origin"));
 			}
 		}
 	}
@@ -1877,27 +1900,34 @@ void Renderer::updateEntConnections() {
 		vector<Entity*> callerAndTarget; // both a target and a caller
 		string thisName;
 		if (pickInfo.ent->hasKey("targetname")) {
-			thisName = pickInfo.ent->keyvalues["targetname"];
+			thisName = pickInfo.ent->getKeyvalue("targetname");
 		}
 
-		for (int k = 0; k < map->ents.size(); k++) {
+		// ents that are a target or caller of the picked ent, from the map's name indexes
+		set<int> targetIdxs;
+		set<int> callerIdxs;
+		for (int i = 0; i < targetNames.size(); i++) {
+			if (targetNames[i].empty())
+				continue;
+			vector<int> named = map->get_named_ents(targetNames[i]);
+			targetIdxs.insert(named.begin(), named.end());
+		}
+		if (thisName.length()) {
+			vector<int> named = map->get_caller_ents(thisName);
+			callerIdxs.insert(named.begin(), named.end());
+		}
+
+		set<int> linkedIdxs = targetIdxs;
+		linkedIdxs.insert(callerIdxs.begin(), callerIdxs.end());
+
+		for (int k : linkedIdxs) {
 			Entity* ent = map->ents[k];
 
 			if (k == pickInfo.entIdx)
 				continue;
-			
-			bool isTarget = false;
-			if (ent->hasKey("targetname")) {
-				string tname = ent->keyvalues["targetname"];
-				for (int i = 0; i < targetNames.size(); i++) {
-					if (tname == targetNames[i]) {
-						isTarget = true;
-						break;
-					}
-				}
-			}
 
-			bool isCaller = thisName.length() && ent->hasTarget(thisName);
+			bool isTarget = targetIdxs.count(k) != 0;
+			bool isCaller = callerIdxs.count(k) != 0;
 
 			if (isTarget && isCaller) {
 				callerAndTarget.push_back(ent);
@@ -2671,17 +2701,17 @@ void Renderer::pushEntityUndoState(string actionDesc) {
 	}
 
 	bool anythingToUndo = true;
-	if (undoEntityState->keyOrder.size() == pickInfo.ent->keyOrder.size()) {
+	if (undoEntityState->keyCount() == pickInfo.ent->keyCount()) {
 		bool keyvaluesDifferent = false;
-		for (int i = 0; i < undoEntityState->keyOrder.size(); i++) {
-			string oldKey = undoEntityState->keyOrder[i];
-			string newKey = pickInfo.ent->keyOrder[i];
+		for (int i = 0; i < undoEntityState->keyCount(); i++) {
+			const string& oldKey = undoEntityState->getKey(i);
+			const string& newKey = pickInfo.ent->getKey(i);
 			if (oldKey != newKey) {
 				keyvaluesDifferent = true;
 				break;
 			}
-			string oldVal = undoEntityState->keyvalues[oldKey];
-			string newVal = pickInfo.ent->keyvalues[oldKey];
+			const string& oldVal = undoEntityState->getValue(i);
+			const string& newVal = pickInfo.ent->getValue(i);
 			if (oldVal != newVal) {
 				keyvaluesDifferent = true;
 				break;
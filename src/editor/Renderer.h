@@ -67,6 +67,7 @@ struct AppSettings {
 	float moveSpeed;
 	float rotSpeed;
 	int render_flags;
+	bool vis_culling = true; // separate from render_flags so configs saved before the flag existed enable it
 	bool vsync;
 	bool show_transform_axes;
 
@@ -91,6 +92,7 @@ class Renderer {
 	friend class EditBspModelCommand;
 	friend class CleanMapCommand;
 	friend class OptimizeMapCommand;
+	friend class BspRenderer;
 
 public:
 	vector<BspRenderer*> mapRenderers;
@@ -0,0 +1,122 @@
+#include "WadManager.h"
+#include "util.h"
+
+WadManager g_wads;
+
+WadManager::~WadManager() {
+	// textures are owned by the renderers that acquired them, and GL is gone by now
+	for (auto it = wads.begin(); it != wads.end(); ++it) {
+		delete it->second.wad;
+	}
+}
+
+Wad* WadManager::acquireWad(const string& path) {
+	lock_guard<mutex> lock(cacheMutex);
+
+	auto it = wads.find(path);
+	if (it != wads.end()) {
+		it->second.refs++;
+		return it->second.wad;
+	}
+
+	logf("Loading WAD %s\n", path.c_str());
+	Wad* wad = new Wad(path);
+	if (!wad->readInfo()) {
+		delete wad;
+		return NULL;
+	}
+
+	SharedWad shared;
+	shared.wad = wad;
+	shared.refs = 1;
+	wads[path] = shared;
+
+	return wad;
+}
+
+void WadManager::releaseWad(Wad* wad) {
+	lock_guard<mutex> lock(cacheMutex);
+
+	auto it = wads.find(wad->filename);
+	if (it == wads.end() || it->second.wad != wad) {
+		logf("Released unknown WAD %s\n", wad->filename.c_str());
+		return;
+	}
+
+	if (--it->second.refs <= 0) {
+		delete it->second.wad;
+		wads.erase(it);
+	}
+}
+
+Texture* WadManager::acquireTexture(Wad* wad, const string& texName) {
+	int dirIndex = wad->findTexture(texName);
+	if (dirIndex == -1) {
+		return NULL;
+	}
+
+	// decoded while locked so that two maps loading at once don't decode the same texture twice
+	lock_guard<mutex> lock(cacheMutex);
+
+	string key = wad->filename + "/" + toLowerCase(texName);
+	auto it = textures.find(key);
+	if (it != textures.end()) {
+		it->second.refs++;
+		return it->second.texture;
+	}
+
+	Texture* tex = decodeTexture(wad, dirIndex);
+	if (!tex) {
+		return NULL;
+	}
+
+	SharedTexture shared;
+	shared.texture = tex;
+	shared.refs = 1;
+	textures[key] = shared;
+	textureKeys[tex] = key;
+
+	return tex;
+}
+
+bool WadManager::releaseTexture(Texture* tex) {
+	lock_guard<mutex> lock(cacheMutex);
+
+	auto keyIt = textureKeys.find(tex);
+	if (keyIt == textureKeys.end()) {
+		return false;
+	}
+
+	auto it = textures.find(keyIt->second);
+	if (--it->second.refs <= 0) {
+		delete it->second.texture;
+		textures.erase(it);
+		textureKeys.erase(keyIt);
+	}
+
+	return true;
+}
+
+Texture* WadManager::decodeTexture(Wad* wad, int dirIndex) {
+	WADTEX* wadTex = wad->readTexture(dirIndex);
+	if (!wadTex) {
+		return NULL;
+	}
+
+	int sz = wadTex->nWidth * wadTex->nHeight;
+	int mipSize = sz + sz / 4 + sz / 16 + sz / 64;
+	COLOR3* palette = (COLOR3*)(wadTex->data + mipSize + 2);
+	byte* src = wadTex->data;
+
+	COLOR3* imageData = new COLOR3[sz];
+	for (int k = 0; k < sz; k++) {
+		imageData[k] = palette[src[k]];
+	}
+
+	Texture* tex = new Texture(wadTex->nWidth, wadTex->nHeight, imageData);
+
+	delete[] wadTex->data;
+	delete wadTex;
+
+	return tex;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "Wad.h"
+#include "Texture.h"
+#include <unordered_map>
+#include <mutex>
+
+// WADs and decoded WAD textures shared by every loaded map. Each WAD is read once and stays loaded
+// while any map uses it. Textures are decoded on first use and deleted when the last map releases them.
+// Safe to call from the texture loading threads.
+class WadManager {
+public:
+	~WadManager();
+
+	// loads the WAD if no other map is using it. Returns NULL if it can't be read.
+	Wad* acquireWad(const string& path);
+	void releaseWad(Wad* wad);
+
+	// returns NULL if the WAD doesn't have the texture. The texture is uploaded by whoever draws it first.
+	Texture* acquireTexture(Wad* wad, const string& texName);
+
+	// returns false if the texture didn't come from acquireTexture
+	bool releaseTexture(Texture* tex);
+
+private:
+	struct SharedWad {
+		Wad* wad;
+		int refs;
+	};
+
+	struct SharedTexture {
+		Texture* texture;
+		int refs;
+	};
+
+	mutex cacheMutex;
+	unordered_map<string, SharedWad> wads; // keyed by path
+	unordered_map<string, SharedTexture> textures; // keyed by WAD path + lowercase texture name
+	unordered_map<Texture*, string> textureKeys;
+
+	Texture* decodeTexture(Wad* wad, int dirIndex);
+};
+
+extern WadManager g_wads;
@@ -195,7 +195,7 @@ void VertexBuffer::deleteBuffer() {
 	vboId = -1;
 }
 
-void VertexBuffer::drawRange( int primitive, int start, int end )
+void VertexBuffer::beginDraw()
 {
 	shaderProgram->bind();
 	bindAttributes();
@@ -218,16 +218,10 @@ void VertexBuffer::drawRange( int primitive, int start, int end )
 			glVertexAttribPointer(a.handle, a.numValues, a.valueType, a.normalized != 0, elementSize, ptr);
 		}
 	}
+}
 
-	if (start < 0 || start > numVerts)
-		logf("Invalid start index: %d\n", start);
-	else if (end > numVerts || end < 0)
-		logf("Invalid end index: %d\n", end);
-	else if (end - start <= 0)
-		logf("Invalid draw range: %d -> %d\n", start, end);
-	else
-		glDrawArrays(primitive, start, end-start);
-
+void VertexBuffer::endDraw()
+{
 	if (vboId != -1) {
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 	}
@@ -241,6 +235,32 @@ void VertexBuffer::drawRange( int primitive, int start, int end )
 	}
 }
 
+void VertexBuffer::drawRange( int primitive, int start, int end )
+{
+	beginDraw();
+
+	if (start < 0 || start > numVerts)
+		logf("Invalid start index: %d\n", start);
+	else if (end > numVerts || end < 0)
+		logf("Invalid end index: %d\n", end);
+	else if (end - start <= 0)
+		logf("Invalid draw range: %d -> %d\n", start, end);
+	else
+		glDrawArrays(primitive, start, end-start);
+
+	endDraw();
+}
+
+void VertexBuffer::drawRanges(int primitive, const int* starts, const int* counts, int rangeCount)
+{
+	if (rangeCount <= 0)
+		return;
+
+	beginDraw();
+	glMultiDrawArrays(primitive, starts, counts, rangeCount);
+	endDraw();
+}
+
 void VertexBuffer::draw( int primitive )
 {
 	drawRange(primitive, 0, numVerts);
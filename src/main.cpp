@@ -1,10 +1,13 @@
 #include "util.h"
 #include "BspMerger.h"
+#include "BspGenerator.h"
 #include <string>
 #include <algorithm>
 #include <iostream>
+#include <chrono>
 #include "CommandLine.h"
 #include "remap.h"
+#include "trace.h"
 #include "Renderer.h"
 
 // super todo:
@@ -110,6 +113,10 @@ void remove_unused_data(Bsp* map) {
 	}
 }
 
+double elapsed_ms(chrono::steady_clock::time_point since) {
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - since).count();
+}
+
 #ifdef WIN32
 #include <Windows.h>
 #endif
@@ -133,54 +140,260 @@ void start_viewer(string map) {
 	renderer.renderLoop();
 }
 
-int test() {
-	//start_viewer("hl_c09.bsp");
-	//return 0;
+struct BenchStage {
+	string name;
+	vector<double> times; // one per run (milliseconds)
+	double peakMem; // peak RSS of the whole process after the stage last ran (MB), not of the stage alone
+};
 
-	vector<Bsp*> maps;
-	
-	for (int i = 1; i < 22; i++) {
-		Bsp* map = new Bsp("2nd/saving_the_2nd_amendment" + (i > 1 ? to_string(i) : "") + ".bsp");
-		maps.push_back(map);
-	}
+// value below which the given fraction of the sorted times fall (nearest rank)
+double percentile(const vector<double>& sorted, float fraction) {
+	int rank = (int)ceil(fraction * sorted.size());
+	return sorted[max(0, min(rank, (int)sorted.size()) - 1)];
+}
 
-	//maps.push_back(new Bsp("op4/of1a1.bsp"));
-	//maps.push_back(new Bsp("op4/of1a2.bsp"));
-	//maps.push_back(new Bsp("op4/of1a3.bsp"));
-	//maps.push_back(new Bsp("op4/of1a4.bsp"));
+double median(const vector<double>& sorted) {
+	int n = sorted.size();
+	return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) * 0.5;
+}
 
-	STRUCTCOUNT removed;
-	memset(&removed, 0, sizeof(removed));
+int bench(CommandLine& cli) {
+	vector<string> mapPaths;
+	mapPaths.push_back(cli.bspfile);
+	if (cli.hasOption("-maps")) {
+		vector<string> extra = cli.getOptionList("-maps");
+		mapPaths.insert(mapPaths.end(), extra.begin(), extra.end());
+	}
 
-	g_verbose = true;
-	for (int i = 0; i < maps.size(); i++) {
-		if (!maps[i]->valid) {
+	int runs = cli.hasOption("-n") ? cli.getOptionInt("-n") : 5;
+	if (runs < 1) {
+		logf("ERROR: -n must be at least 1\n");
+		return 1;
+	}
+
+	for (int i = 0; i < mapPaths.size(); i++) {
+		if (!fileExists(mapPaths[i])) {
+			logf("ERROR: File not found: %s\n", mapPaths[i].c_str());
 			return 1;
 		}
-		if (!maps[i]->validate()) {
-			logf("");
+	}
+
+	const char* stageNames[] = { "load", "remove_unused", "delete_unused_hulls", "move", "write", "merge", "merge_vis" };
+	enum { LOAD, CLEAN, HULLS, MOVE, WRITE, MERGE, MERGE_VIS, STAGE_COUNT };
+	bool canMerge = mapPaths.size() > 1;
+
+	vector<BenchStage> stages(STAGE_COUNT);
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		stages[i].name = stageNames[i];
+		stages[i].peakMem = 0;
+	}
+
+	// CSV/JSON printed to the console should be parseable as-is
+	string format = cli.hasOption("-json") ? "json" : cli.hasOption("-csv") ? "csv" : "table";
+	if (format == "table" || cli.hasOption("-o")) {
+		logf("Benchmarking %d map(s), %d runs", (int)mapPaths.size(), runs);
+		logf(canMerge ? "\n" : " (merge skipped, needs -maps)\n");
+	}
+
+	// the stages' own output would drown out the results
+	bool wasHidden = g_progress.hide;
+	g_progress.hide = true;
+	string stageLog;
+	string* oldCapture = setThreadLogCapture(&stageLog);
+
+	auto timeStage = [&](int stage, const function<void()>& func) {
+		auto start = chrono::steady_clock::now();
+		func();
+		stages[stage].times.push_back(elapsed_ms(start));
+		stages[stage].peakMem = getPeakMemoryUsage() / (1024.0 * 1024.0);
+	};
+
+	bool failed = false;
+	for (int r = 0; r < runs && !failed; r++) {
+		vector<Bsp*> maps(mapPaths.size());
+
+		timeStage(LOAD, [&]() {
+			for (int i = 0; i < mapPaths.size(); i++)
+				maps[i] = new Bsp(mapPaths[i]);
+		});
+
+		for (int i = 0; i < maps.size(); i++) {
+			if (!maps[i]->valid) {
+				setThreadLogCapture(oldCapture);
+				logf("%s", stageLog.c_str());
+				logf("ERROR: Failed to load %s\n", mapPaths[i].c_str());
+				failed = true;
+			}
+		}
+		if (failed) {
+			for (int i = 0; i < maps.size(); i++)
+				delete maps[i];
+			break;
 		}
-		logf("Preprocess %s\n", maps[i]->name.c_str());
-		maps[i]->delete_hull(2, 1);
-		//removed.add(maps[i]->delete_unused_hulls());
-		removed.add(maps[i]->remove_unused_model_structures());
 
-		if (!maps[i]->validate())
-			logf("");
+		timeStage(CLEAN, [&]() {
+			for (int i = 0; i < maps.size(); i++)
+				maps[i]->remove_unused_model_structures();
+		});
+		timeStage(HULLS, [&]() {
+			for (int i = 0; i < maps.size(); i++)
+				maps[i]->delete_unused_hulls(true);
+		});
+		timeStage(MOVE, [&]() {
+			for (int i = 0; i < maps.size(); i++)
+				maps[i]->move(vec3(64, 64, 64));
+		});
+		timeStage(WRITE, [&]() {
+			for (int i = 0; i < maps.size(); i++)
+				maps[i]->write(mapPaths[i] + ".bench.bsp");
+		});
+		for (int i = 0; i < maps.size(); i++) {
+			remove((mapPaths[i] + ".bench.bsp").c_str());
+		}
+
+		if (canMerge) {
+			BspMerger merger;
+			Bsp* merged = NULL;
+			timeStage(MERGE, [&]() {
+				merged = merger.merge(maps, vec3(0, 0, 0), "bench", true, true, false);
+			});
+
+			if (!merged) {
+				// the merge was aborted (e.g. it would overflow), so its timings would be meaningless
+				setThreadLogCapture(oldCapture);
+				logf("%s", stageLog.c_str());
+				logf("ERROR: Failed to merge the maps\n");
+				failed = true;
+				for (int i = 0; i < maps.size(); i++)
+					delete maps[i];
+				break;
+			}
+			stages[MERGE_VIS].times.push_back(merger.visMergeTime);
+			stages[MERGE_VIS].peakMem = stages[MERGE].peakMem;
+		}
+
+		for (int i = 0; i < maps.size(); i++)
+			delete maps[i];
+		stageLog.clear();
 	}
 
-	removed.print_delete_stats(1);
+	setThreadLogCapture(oldCapture);
+	g_progress.hide = wasHidden;
 
-	BspMerger merger;
-	Bsp* result = merger.merge(maps, vec3(1, 1, 1), "yabma_move", false, false);
-	logf("\n");
-	if (result != NULL) {
-		result->write("yabma_move.bsp");
-		result->write("D:/Steam/steamapps/common/Sven Co-op/svencoop_addon/maps/yabma_move.bsp");
-		result->print_info(false, 0, false);
+	if (failed)
+		return 1;
+
+	string report;
+
+	if (format == "json") {
+		report += "{\n  \"maps\": [";
+		for (int i = 0; i < mapPaths.size(); i++) {
+			appendf(report, "%s\"%s\"", i ? ", " : "", escapeJson(mapPaths[i]).c_str());
+		}
+		appendf(report, "],\n  \"runs\": %d,\n  \"stages\": [\n", runs);
+	}
+	else if (format == "csv") {
+		report += "stage,runs,median_ms,p95_ms,min_ms,max_ms,process_peak_rss_mb\n";
+	}
+	else {
+		report += "\n Stage                    Median ms     P95 ms     Min ms     Max ms  Process Peak RSS MB\n";
+		report += "-----------------------  ----------  ---------  ---------  ---------  -------------------\n";
+	}
+
+	bool firstRow = true;
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		BenchStage& stage = stages[i];
+		if (stage.times.empty())
+			continue;
+
+		vector<double> sorted = stage.times;
+		sort(sorted.begin(), sorted.end());
+		double med = median(sorted);
+		double p95 = percentile(sorted, 0.95f);
+
+		if (format == "json") {
+			appendf(report, "%s    {\"name\": \"%s\", \"runs\": %d, \"median_ms\": %.3f, \"p95_ms\": %.3f, "
+				"\"min_ms\": %.3f, \"max_ms\": %.3f, \"process_peak_rss_mb\": %.1f}", firstRow ? "" : ",\n",
+				stage.name.c_str(), (int)sorted.size(), med, p95, sorted.front(), sorted.back(), stage.peakMem);
+		}
+		else if (format == "csv") {
+			appendf(report, "%s,%d,%.3f,%.3f,%.3f,%.3f,%.1f\n", stage.name.c_str(), (int)sorted.size(),
+				med, p95, sorted.front(), sorted.back(), stage.peakMem);
+		}
+		else {
+			appendf(report, " %-23s %10.1f %10.1f %10.1f %10.1f %20.1f\n", stage.name.c_str(),
+				med, p95, sorted.front(), sorted.back(), stage.peakMem);
+		}
+		firstRow = false;
+	}
+
+	double peakMem = getPeakMemoryUsage() / (1024.0 * 1024.0);
+	if (format == "json") {
+		appendf(report, "\n  ],\n  \"peak_rss_mb\": %.1f\n}\n", peakMem);
+	}
+	else if (format == "table") {
+		appendf(report, "\nPeak RSS: %.1f MB\n", peakMem);
+	}
+
+	if (cli.hasOption("-o")) {
+		ofstream fout(cli.getOption("-o").c_str(), ios::out | ios::trunc);
+		fout.write(report.c_str(), report.size());
+		logf("Wrote %s\n", cli.getOption("-o").c_str());
+	}
+	else {
+		printLogBlock(report);
+	}
+
+	return 0;
+}
+
+int generate(CommandLine& cli) {
+	float fill = cli.hasOption("-fill") ? atof(cli.getOption("-fill").c_str()) : 0.5f;
+	if (fill <= 0 || fill > 1) {
+		logf("ERROR: -fill must be greater than 0 and no more than 1\n");
+		return 1;
+	}
+
+	GENERATE_OPTIONS opts = BspGenerator::get_fill_options(fill);
+	if (cli.hasOption("-ents"))
+		opts.brushEnts = cli.getOptionInt("-ents");
+	if (cli.hasOption("-faces"))
+		opts.worldFaces = cli.getOptionInt("-faces");
+	if (cli.hasOption("-leaves"))
+		opts.leaves = cli.getOptionInt("-leaves");
+	if (cli.hasOption("-textures"))
+		opts.textures = cli.getOptionInt("-textures");
+	if (cli.hasOption("-seed"))
+		opts.seed = cli.getOptionInt("-seed");
+
+	string outPath = cli.bspfile;
+	if (outPath.size() < 4 || outPath.rfind(".bsp") != outPath.size() - 4) {
+		outPath += ".bsp";
+	}
+
+	auto start = chrono::steady_clock::now();
+
+	BspGenerator generator;
+	Bsp* map = generator.generate(opts);
+	if (!map)
+		return 1;
+
+	map->path = outPath;
+	map->name = stripExt(basename(outPath));
+
+	if (!map->validate() || !map->isValid()) {
+		logf("ERROR: The generated map is invalid or overflows a limit. Try smaller counts.\n\n");
+		map->print_info(false, 0, 0);
+		delete map;
+		return 1;
 	}
 
-	start_viewer("yabma_move.bsp");
+	logf("Generated %d brush entities, %d world faces, %d leaves, and %d textures in %.0f ms\n",
+		opts.brushEnts, map->models[0].nFaces, map->models[0].nVisLeafs, map->textureCount, elapsed_ms(start));
+
+	map->write(outPath);
+
+	delete map;
 
 	return 0;
 }
@@ -229,7 +442,19 @@ int merge_maps(CommandLine& cli) {
 	string output_name = cli.hasOption("-o") ? cli.getOption("-o") : cli.bspfile;
 
 	BspMerger merger;
-	Bsp* result = merger.merge(maps, gap, output_name, cli.hasOption("-noripent"), cli.hasOption("-noscript"));
+
+	if (cli.hasOption("-dryrun")) {
+		int ret = merger.estimate(maps, gap) ? 0 : 1;
+		for (int i = 0; i < maps.size(); i++) {
+			delete maps[i];
+		}
+		return ret;
+	}
+
+	Bsp* result = merger.merge(maps, gap, output_name, cli.hasOption("-noripent"), cli.hasOption("-noscript"), cli.hasOption("-force"));
+	if (!result) {
+		return 1;
+	}
 
 	logf("\n");
 	if (result->isValid()) result->write(output_name);
@@ -244,9 +469,22 @@ int merge_maps(CommandLine& cli) {
 }
 
 int print_info(CommandLine& cli) {
+	// keep load warnings out of the JSON output, and report them inside it instead
+	bool json = cli.hasOption("-json");
+	string loadLog;
+	string* oldCapture = json ? setThreadLogCapture(&loadLog) : NULL;
+
+	auto loadStart = chrono::steady_clock::now();
 	Bsp* map = new Bsp(cli.bspfile);
-	if (!map->valid)
+	double loadTime = elapsed_ms(loadStart);
+
+	if (json)
+		setThreadLogCapture(oldCapture);
+
+	if (!map->valid) {
+		logf("%s", loadLog.c_str());
 		return 1;
+	}
 
 	bool limitMode = false;
 	int listLength = 10;
@@ -277,6 +515,12 @@ int print_info(CommandLine& cli) {
 		listLength = 32768; // should be more than enough
 	}
 
+	if (json) {
+		map->print_info_json(sortMode, loadTime, loadLog);
+		delete map;
+		return 0;
+	}
+
 	map->print_info(limitMode, listLength, sortMode);
 
 	delete map;
@@ -284,11 +528,11 @@ int print_info(CommandLine& cli) {
 	return 0;
 }
 
-int noclip(CommandLine& cli) {
-	Bsp* map = new Bsp(cli.bspfile);
-	if (!map->valid)
-		return 1;
+// Operations that can be run on their own or chained with the "run" command. They edit the map in
+// place and leave unused structures behind, so the caller decides when to clean up and write.
+// Each returns false if its options are invalid.
 
+bool noclip_op(Bsp* map, CommandLine& cli) {
 	int model = -1;
 	int hull = -1;
 	int redirect = 0;
@@ -298,35 +542,33 @@ int noclip(CommandLine& cli) {
 
 		if (hull < 0 || hull >= MAX_MAP_HULLS) {
 			logf("ERROR: hull number must be 0-3\n");
-			return 1;
+			return false;
 		}
 	}
 
 	if (cli.hasOption("-redirect")) {
 		if (!cli.hasOption("-hull")) {
 			logf("ERROR: -redirect must be used with -hull\n");
-			return 1;
+			return false;
 		}
 		redirect = cli.getOptionInt("-redirect");
 
 		if (redirect < 1 || redirect >= MAX_MAP_HULLS) {
 			logf("ERROR: redirect hull number must be 1-3\n");
-			return 1;
+			return false;
 		}
 		if (redirect == hull) {
 			logf("ERROR: Can't redirect hull to itself\n");
-			return 1;
+			return false;
 		}
 	}
 
-	remove_unused_data(map);
-
 	if (cli.hasOption("-model")) {
 		model = cli.getOptionInt("-model");
 
 		if (model < 0 || model >= map->modelCount) {
 			logf("ERROR: model number must be 0 - %d\n", map->modelCount);
-			return 1;
+			return false;
 		}
 
 		if (hull != -1) {
@@ -347,7 +589,7 @@ int noclip(CommandLine& cli) {
 	else {
 		if (hull == 0) {
 			logf("HULL 0 can't be stripped globally. The entire map would be invisible!\n");
-			return 0;
+			return false;
 		}
 
 		if (hull != -1) {
@@ -365,34 +607,15 @@ int noclip(CommandLine& cli) {
 		}
 	}
 
-	STRUCTCOUNT removed = map->remove_unused_model_structures();
-
-	if (!removed.allZero())
-		removed.print_delete_stats(1);
-	else if (redirect == 0)
-		logf("    Model hull(s) was previously deleted or redirected.");
-	logf("\n");
-
-	if (map->isValid()) map->write(cli.hasOption("-o") ? cli.getOption("-o") : map->path);
-	logf("\n");
-
-	map->print_info(false, 0, 0);
-
-	delete map;
-
-	return 0;
+	return true;
 }
 
-int simplify(CommandLine& cli) {
-	Bsp* map = new Bsp(cli.bspfile);
-	if (!map->valid)
-		return 1;
-
+bool simplify_op(Bsp* map, CommandLine& cli) {
 	int hull = 0;
 
 	if (!cli.hasOption("-model")) {
 		logf("ERROR: -model is required\n");
-		return 1;
+		return false;
 	}
 
 	if (cli.hasOption("-hull")) {
@@ -400,19 +623,15 @@ int simplify(CommandLine& cli) {
 
 		if (hull < 1 || hull >= MAX_MAP_HULLS) {
 			logf("ERROR: hull number must be 1-3\n");
-			return 1;
+			return false;
 		}
 	}
 
 	int modelIdx = cli.getOptionInt("-model");
 
-	remove_unused_data(map);
-
-	STRUCTCOUNT oldCounts(map);
-
 	if (modelIdx < 0 || modelIdx >= map->modelCount) {
 		logf("ERROR: model number must be 0 - %d\n", map->modelCount);
-		return 1;
+		return false;
 	}
 
 	if (hull != 0) {
@@ -424,6 +643,102 @@ int simplify(CommandLine& cli) {
 
 	map->simplify_model_collision(modelIdx, hull);
 
+	return true;
+}
+
+bool delete_op(Bsp* map, CommandLine& cli) {
+	if (cli.hasOption("-model")) {
+		int modelIdx = cli.getOptionInt("-model");
+
+		if (modelIdx < 0 || modelIdx >= map->modelCount) {
+			logf("ERROR: model number must be 0 - %d\n", map->modelCount);
+			return false;
+		}
+
+		logf("Deleting model %d:\n", modelIdx);
+		map->delete_model(modelIdx);
+		map->update_ent_lump();
+	}
+
+	return true;
+}
+
+bool transform_op(Bsp* map, CommandLine& cli) {
+	if (cli.hasOptionVector("-move")) {
+		vec3 move = cli.getOptionVector("-move");
+
+		logf("Applying offset (%.2f, %.2f, %.2f)\n",
+			move.x, move.y, move.z);
+
+		map->move(move);
+	}
+	else {
+		logf("ERROR: at least one transformation option is required\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool dedup_clipnodes_op(Bsp* map, CommandLine& cli) {
+	logf("Merging duplicate clipnode subtrees:\n");
+	STRUCTCOUNT removed = map->dedup_clipnodes();
+
+	if (!removed.allZero())
+		removed.print_delete_stats(1);
+	else
+		logf("    No duplicate clipnodes found.\n");
+
+	return true;
+}
+
+bool unembed_op(Bsp* map, CommandLine& cli) {
+	int deleted = map->delete_embedded_textures();
+	logf("Deleted %d embedded textures\n", deleted);
+
+	return true;
+}
+
+int noclip(CommandLine& cli) {
+	Bsp* map = new Bsp(cli.bspfile);
+	if (!map->valid)
+		return 1;
+
+	remove_unused_data(map);
+
+	if (!noclip_op(map, cli))
+		return 1;
+
+	STRUCTCOUNT removed = map->remove_unused_model_structures();
+
+	if (!removed.allZero())
+		removed.print_delete_stats(1);
+	else if (!cli.hasOption("-redirect"))
+		logf("    Model hull(s) was previously deleted or redirected.");
+	logf("\n");
+
+	if (map->isValid()) map->write(cli.hasOption("-o") ? cli.getOption("-o") : map->path);
+	logf("\n");
+
+	map->print_info(false, 0, 0);
+
+	delete map;
+
+	return 0;
+}
+
+int simplify(CommandLine& cli) {
+	Bsp* map = new Bsp(cli.bspfile);
+	if (!map->valid)
+		return 1;
+
+	remove_unused_data(map);
+
+	STRUCTCOUNT oldCounts(map);
+
+	if (!simplify_op(map, cli))
+		return 1;
+
 	map->remove_unused_model_structures();
 
 	STRUCTCOUNT newCounts(map);
@@ -453,12 +768,10 @@ int deleteCmd(CommandLine& cli) {
 
 	remove_unused_data(map);
 
-	if (cli.hasOption("-model")) {
-		int modelIdx = cli.getOptionInt("-model");
+	if (!delete_op(map, cli))
+		return 1;
 
-		logf("Deleting model %d:\n", modelIdx);
-		map->delete_model(modelIdx);
-		map->update_ent_lump();
+	if (cli.hasOption("-model")) {
 		STRUCTCOUNT removed = map->remove_unused_model_structures();
 
 		if (!removed.allZero())
@@ -481,21 +794,29 @@ int transform(CommandLine& cli) {
 	if (!map->valid)
 		return 1;
 
-	vec3 move;
+	if (!transform_op(map, cli))
+		return 1;
+	
+	if (map->isValid()) map->write(cli.hasOption("-o") ? cli.getOption("-o") : map->path);
+	logf("\n");
 
-	if (cli.hasOptionVector("-move")) {
-		move = cli.getOptionVector("-move");
+	map->print_info(false, 0, 0);
 
-		logf("Applying offset (%.2f, %.2f, %.2f)\n",
-			move.x, move.y, move.z);
+	delete map;
 
-		map->move(move);
-	}
-	else {
-		logf("ERROR: at least one transformation option is required\n");
+	return 0;
+}
+
+int dedupClipnodes(CommandLine& cli) {
+	Bsp* map = new Bsp(cli.bspfile);
+	if (!map->valid)
 		return 1;
-	}
-	
+
+	remove_unused_data(map);
+
+	dedup_clipnodes_op(map, cli);
+	logf("\n");
+
 	if (map->isValid()) map->write(cli.hasOption("-o") ? cli.getOption("-o") : map->path);
 	logf("\n");
 
@@ -511,15 +832,392 @@ int unembed(CommandLine& cli) {
 	if (!map->valid)
 		return 1;
 
-	int deleted = map->delete_embedded_textures();
-	logf("Deleted %d embedded textures\n", deleted);
+	unembed_op(map, cli);
+
+	if (map->isValid()) map->write(cli.hasOption("-o") ? cli.getOption("-o") : map->path);
+	logf("\n");
+
+	delete map;
+
+	return 0;
+}
+
+// splits an operation into its command and options. Quoted args can contain spaces.
+vector<string> split_op_args(const string& op) {
+	vector<string> args;
+	string arg;
+	bool inQuotes = false;
+	bool hasArg = false;
+
+	for (int i = 0; i < op.size(); i++) {
+		char c = op[i];
+		if (c == '"') {
+			inQuotes = !inQuotes;
+			hasArg = true;
+		}
+		else if (!inQuotes && (c == ' ' || c == '\t')) {
+			if (hasArg)
+				args.push_back(arg);
+			arg.clear();
+			hasArg = false;
+		}
+		else {
+			arg += c;
+			hasArg = true;
+		}
+	}
+	if (hasArg)
+		args.push_back(arg);
+
+	return args;
+}
+
+// operations are separated by semicolons or new lines. Everything after a '#' on a line is ignored.
+vector<string> parse_op_list(const string& text) {
+	vector<string> ops;
+	vector<string> lines = splitString(text, "\r\n");
+
+	for (int i = 0; i < lines.size(); i++) {
+		string line = lines[i];
+		size_t comment = line.find('#');
+		if (comment != string::npos)
+			line = line.substr(0, comment);
+
+		vector<string> lineOps = splitString(line, ";");
+		for (int k = 0; k < lineOps.size(); k++) {
+			string op = trimSpaces(lineOps[k]);
+			if (!op.empty())
+				ops.push_back(op);
+		}
+	}
+
+	return ops;
+}
+
+bool is_run_op(const string& command) {
+	return command == "noclip" || command == "simplify" || command == "delete" || command == "transform"
+		|| command == "dedup-clipnodes" || command == "unembed";
+}
+
+bool run_op(Bsp* map, CommandLine& opCli) {
+	if (opCli.command == "noclip") {
+		return noclip_op(map, opCli);
+	}
+	else if (opCli.command == "simplify") {
+		return simplify_op(map, opCli);
+	}
+	else if (opCli.command == "delete") {
+		return delete_op(map, opCli);
+	}
+	else if (opCli.command == "transform") {
+		return transform_op(map, opCli);
+	}
+	else if (opCli.command == "dedup-clipnodes") {
+		return dedup_clipnodes_op(map, opCli);
+	}
+	else if (opCli.command == "unembed") {
+		return unembed_op(map, opCli);
+	}
+
+	return false;
+}
+
+int run(CommandLine& cli) {
+	string opText;
+
+	if (cli.hasOption("-ops")) {
+		opText = cli.getOption("-ops");
+	}
+	else if (cli.hasOption("-opsfile")) {
+		int len;
+		char* data = loadFile(cli.getOption("-opsfile"), len);
+		if (data == NULL) {
+			logf("ERROR: failed to read ops file %s\n", cli.getOption("-opsfile").c_str());
+			return 1;
+		}
+		opText = string(data, len);
+		delete[] data;
+	}
+	else {
+		logf("ERROR: -ops or -opsfile is required\n");
+		return 1;
+	}
+
+	vector<string> ops = parse_op_list(opText);
+	if (ops.empty()) {
+		logf("ERROR: no operations given\n");
+		return 1;
+	}
+
+	// parse every op before loading the map, so a typo doesn't waste a load
+	vector<CommandLine> opClis;
+	for (int i = 0; i < ops.size(); i++) {
+		vector<string> args = split_op_args(ops[i]);
+
+		// same layout as the real command line, so the ops share option parsing with the commands
+		vector<char*> argv;
+		string exeName = "bspguy";
+		argv.push_back((char*)exeName.c_str());
+		argv.push_back((char*)args[0].c_str());
+		argv.push_back((char*)cli.bspfile.c_str());
+		for (int k = 1; k < args.size(); k++) {
+			argv.push_back((char*)args[k].c_str());
+		}
+
+		opClis.push_back(CommandLine(argv.size(), &argv[0]));
+		if (!is_run_op(opClis[i].command)) {
+			logf("ERROR: '%s' can't be used with the run command\n", args[0].c_str());
+			return 1;
+		}
+		if (opClis[i].askingForHelp) {
+			logf("ERROR: invalid operation '%s'\n", ops[i].c_str());
+			return 1;
+		}
+	}
+
+	auto totalStart = chrono::steady_clock::now();
+
+	Bsp* map = new Bsp(cli.bspfile);
+	if (!map->valid)
+		return 1;
+	double loadTime = elapsed_ms(totalStart);
+
+	remove_unused_data(map);
+
+	STRUCTCOUNT oldCounts(map);
+	vector<double> opTimes;
+
+	for (int i = 0; i < ops.size(); i++) {
+		logf("[%d/%d] %s\n", i + 1, (int)ops.size(), ops[i].c_str());
+
+		auto opStart = chrono::steady_clock::now();
+		if (!run_op(map, opClis[i])) {
+			logf("ERROR: operation %d failed. Nothing was written.\n", i + 1);
+			delete map;
+			return 1;
+		}
+		opTimes.push_back(elapsed_ms(opStart));
+		logf("\n");
+	}
 
+	auto cleanStart = chrono::steady_clock::now();
+	map->remove_unused_model_structures();
+	double cleanTime = elapsed_ms(cleanStart);
+
+	STRUCTCOUNT newCounts(map);
+	STRUCTCOUNT change = oldCounts;
+	change.sub(newCounts);
+
+	if (!change.allZero()) {
+		logf("Total change:\n");
+		change.print_delete_stats(1);
+		logf("\n");
+	}
+
+	auto writeStart = chrono::steady_clock::now();
 	if (map->isValid()) map->write(cli.hasOption("-o") ? cli.getOption("-o") : map->path);
+	double writeTime = elapsed_ms(writeStart);
 	logf("\n");
 
+	logf("Timings:\n");
+	logf("    %10.1f ms  load\n", loadTime);
+	for (int i = 0; i < ops.size(); i++) {
+		logf("    %10.1f ms  %s\n", opTimes[i], ops[i].c_str());
+	}
+	logf("    %10.1f ms  remove unused data\n", cleanTime);
+	logf("    %10.1f ms  write\n", writeTime);
+	logf("    %10.1f ms  total\n\n", elapsed_ms(totalStart));
+
+	map->print_info(false, 0, 0);
+
+	delete map;
+
+	return 0;
+}
+
+int run_command(CommandLine& cli) {
+	if (cli.command == "info") {
+		return print_info(cli);
+	}
+	else if (cli.command == "noclip") {
+		return noclip(cli);
+	}
+	else if (cli.command == "simplify") {
+		return simplify(cli);
+	}
+	else if (cli.command == "delete") {
+		return deleteCmd(cli);
+	}
+	else if (cli.command == "transform") {
+		return transform(cli);
+	}
+	else if (cli.command == "merge") {
+		return merge_maps(cli);
+	}
+	else if (cli.command == "dedup-clipnodes") {
+		return dedupClipnodes(cli);
+	}
+	else if (cli.command == "unembed") {
+		return unembed(cli);
+	}
+	else if (cli.command == "run") {
+		return run(cli);
+	}
+	else if (cli.command == "bench") {
+		return bench(cli);
+	}
+	else if (cli.command == "generate") {
+		return generate(cli);
+	}
+	else {
+		logf("unrecognized command: %d\n", cli.command.c_str());
+	}
+
 	return 0;
 }
 
+bool is_batch_command(const string& command) {
+	return command == "info" || command == "run" || is_run_op(command);
+}
+
+int get_file_size(const string& path) {
+	ifstream fin(path.c_str(), ios::binary | ios::ate);
+	return fin ? (int)fin.tellg() : 0;
+}
+
+struct BatchResult {
+	string log;
+	int exitCode;
+	double time;
+	int oldSize;
+	int newSize;
+};
+
+int batch(CommandLine& cli) {
+	string command = cli.bspfile; // bspguy batch <command> <dir|glob> [options]
+
+	if (!is_batch_command(command)) {
+		logf("ERROR: '%s' can't be used with the batch command\n", command.c_str());
+		return 1;
+	}
+	if (cli.options.empty() || cli.options[0][0] == '-') {
+		logf("ERROR: no map folder or file pattern specified\n");
+		return 1;
+	}
+	if (cli.hasOption("-o")) {
+		logf("ERROR: -o can't be used with batch. Each map is overwritten.\n");
+		return 1;
+	}
+
+	string target = cli.options[0];
+	string dir = target;
+	string pattern = "*.bsp";
+	if (!dirExists(target)) {
+		size_t lastSlash = target.find_last_of("\\/");
+		dir = lastSlash != string::npos ? target.substr(0, lastSlash) : ".";
+		pattern = lastSlash != string::npos ? target.substr(lastSlash + 1) : target;
+	}
+
+	vector<string> files = getDirFiles(dir, pattern);
+	if (files.empty()) {
+		logf("ERROR: no maps found matching %s\n", target.c_str());
+		return 1;
+	}
+
+	int threads = cli.hasOption("-j") ? cli.getOptionInt("-j") : getThreadCount();
+	if (threads < 1) {
+		logf("ERROR: -j must be at least 1\n");
+		return 1;
+	}
+	bool quiet = cli.hasOption("-q");
+
+	// everything else is passed on to the command
+	vector<string> commandOpts;
+	for (int i = 1; i < cli.options.size(); i++) {
+		string opt = toLowerCase(cli.options[i]);
+		if (opt == "-j") {
+			i++;
+			continue;
+		}
+		if (opt == "-q") {
+			continue;
+		}
+		commandOpts.push_back(cli.options[i]);
+	}
+
+	logf("Running '%s' on %d maps with %d threads\n\n", command.c_str(), (int)files.size(), threads);
+
+	// the meter can't show several maps at once, and would garble their logs
+	bool wasHidden = g_progress.hide;
+	g_progress.hide = true;
+
+	vector<BatchResult> results(files.size());
+	atomic<int> finished(0);
+	auto batchStart = chrono::steady_clock::now();
+
+	parallelFor(files.size(), [&](int i, int threadIdx) {
+		BatchResult& result = results[i];
+		result.oldSize = get_file_size(files[i]);
+
+		vector<char*> argv;
+		string exeName = "bspguy";
+		argv.push_back((char*)exeName.c_str());
+		argv.push_back((char*)command.c_str());
+		argv.push_back((char*)files[i].c_str());
+		for (int k = 0; k < commandOpts.size(); k++) {
+			argv.push_back((char*)commandOpts[k].c_str());
+		}
+		CommandLine mapCli(argv.size(), &argv[0]);
+		mapCli.bspfile = files[i]; // CommandLine lowercases it
+
+		setThreadLogCapture(&result.log);
+		auto start = chrono::steady_clock::now();
+		result.exitCode = run_command(mapCli);
+		result.time = elapsed_ms(start);
+		setThreadLogCapture(NULL);
+
+		result.newSize = get_file_size(files[i]);
+
+		char header[512];
+		snprintf(header, 512, "[%d/%d] %s: %s (%.0f ms)\n", ++finished, (int)files.size(), files[i].c_str(),
+			result.exitCode ? "FAILED" : "ok", result.time);
+
+		if (quiet && result.exitCode == 0) {
+			printLogBlock(header);
+		}
+		else {
+			printLogBlock(string(header) + result.log + "\n\n");
+		}
+	}, false, 1, threads);
+
+	double totalTime = elapsed_ms(batchStart);
+	g_progress.hide = wasHidden;
+
+	int failed = 0;
+	double workTime = 0;
+	int oldTotal = 0;
+	int newTotal = 0;
+
+	logf("\n Map                              Result       Time    Size (KB)\n");
+	logf("-------------------------------- ------  ----------  -----------------\n");
+	for (int i = 0; i < files.size(); i++) {
+		BatchResult& result = results[i];
+		logf(" %-32s %-6s  %7.0f ms  %7d -> %d\n", basename(files[i]).c_str(), result.exitCode ? "FAILED" : "ok",
+			result.time, result.oldSize / 1024, result.newSize / 1024);
+
+		failed += result.exitCode != 0;
+		workTime += result.time;
+		oldTotal += result.oldSize / 1024;
+		newTotal += result.newSize / 1024;
+	}
+	logf("-------------------------------- ------  ----------  -----------------\n");
+	logf(" %-32s %-6s  %7.0f ms  %7d -> %d\n\n", "total", failed ? "FAILED" : "ok", totalTime, oldTotal, newTotal);
+
+	logf("%d maps, %d failed. %.1fs of work done in %.1fs.\n", (int)files.size(), failed, workTime / 1000.0, totalTime / 1000.0);
+
+	return failed ? 1 : 0;
+}
+
 void print_help(string command) {
 	if (command == "merge") {
 		logf(
@@ -546,6 +1244,11 @@ void print_help(string command) {
 			"                 entities, and some ents might not spawn properly. The benefit\n"
 			"                 to this flag is that you don't have deal with script setup.\n"
 			"  -gap \"X,Y,Z\" : Amount of extra space to add between each map\n"
+			"  -dryrun      : Predict the size of each merge step and report the first BSP\n"
+			"                 limit it overflows, without merging or writing anything.\n"
+			"                 This check also runs automatically before a real merge.\n"
+			"  -force       : Merge even if the limit check predicts an overflow. The visdata\n"
+			"                 prediction ignores duplicate rows, so it can be a little high.\n"
 			"  -v           : Verbose console output.\n"
 			);
 	}
@@ -560,6 +1263,9 @@ void print_help(string command) {
 			"  -limit <name> : List the models contributing most to the named limit.\n"
 			"                  <name> can be one of: [clipnodes, nodes, faces, vertexes]\n"
 			"  -all          : Show the full list of models when using -limit.\n"
+			"  -json         : Print lump sizes, limits, per-model structure counts, and\n"
+			"                  load/analysis times as JSON. Models are sorted by the -limit\n"
+			"                  type (clipnodes by default).\n"
 			);
 	}
 	else if (command == "noclip") {
@@ -624,6 +1330,17 @@ void print_help(string command) {
 			"  -o <file>     : Output file. By default, <mapname> is overwritten.\n"
 			);
 	}
+	else if (command == "dedup-clipnodes") {
+		logf(
+			"dedup-clipnodes - Merges identical clipnode subtrees so they're stored once\n\n"
+
+			"Usage:   bspguy dedup-clipnodes <mapname> [options]\n"
+			"Example: bspguy dedup-clipnodes merged.bsp\n"
+
+			"\n[Options]\n"
+			"  -o <file> : Output file. By default, <mapname> is overwritten.\n"
+			);
+	}
 	else if (command == "unembed") {
 	logf(
 		"unembed - Deletes embedded texture data, so that they reference WADs instead.\n\n"
@@ -632,6 +1349,86 @@ void print_help(string command) {
 		"Example: bspguy unembed c1a0.bsp\n"
 	);
 	}
+	else if (command == "bench") {
+		logf(
+			"bench - Times the main processing stages, for tracking performance\n\n"
+
+			"Usage:   bspguy bench <mapname> [options]\n"
+			"Example: bspguy bench svencoop1.bsp -maps \"svencoop2, svencoop3\" -n 10 -csv -o bench.csv\n"
+
+			"\nEach run loads the maps, removes unused data and hulls, moves them, writes them\n"
+			"to temporary files, and merges them (when there's more than one map). The time\n"
+			"for a stage is the total over all maps. The input maps are not modified.\n"
+			"merge_vis is the wall time spent merging vis data, which runs in parallel\n"
+			"for independent merge steps. Process peak RSS is the peak of the whole\n"
+			"process after the stage, so it only ever grows.\n"
+
+			"\n[Options]\n"
+			"  -maps \"a, b\" : More maps to include. Required for the merge stages.\n"
+			"  -n #         : Number of runs. Default is 5.\n"
+			"  -csv         : Print results as CSV.\n"
+			"  -json        : Print results as JSON.\n"
+			"  -o <file>    : Write results to a file instead of the console.\n"
+			);
+	}
+	else if (command == "generate") {
+		logf(
+			"generate - Creates a synthetic map for benchmarking\n\n"
+
+			"Usage:   bspguy generate <mapname> [options]\n"
+			"Example: bspguy generate bench_full.bsp -fill 0.9 -seed 3\n"
+
+			"\nThe map is made of boxes: world boxes on a grid of leaves with lightmaps and\n"
+			"vis data, and func_wall entities floating above them. Counts default to a share\n"
+			"of the BSP limits set by -fill, and any count given overrides its share.\n"
+			"The same options and seed always produce the same file.\n"
+
+			"\n[Options]\n"
+			"  -fill #     : Fraction of the BSP limits to use (0-1). Default is 0.5.\n"
+			"  -ents #     : Number of brush entities.\n"
+			"  -faces #    : Number of world faces. Rounded up to a multiple of 6.\n"
+			"  -leaves #   : Number of world leaves. Rounded up to fill a grid.\n"
+			"  -textures # : Number of embedded textures.\n"
+			"  -seed #     : Random seed. Default is 1.\n"
+			);
+	}
+	else if (command == "batch") {
+		logf(
+			"batch - Runs a command on every map in a folder, several maps at a time\n\n"
+
+			"Usage:   bspguy batch <command> <folder|pattern> [options] [command options]\n"
+			"Example: bspguy batch info maps/\n"
+			"         bspguy batch noclip \"maps/ba_*.bsp\" -j 4 -hull 2 -redirect 1\n"
+
+			"\n<command> can be info, noclip, simplify, delete, transform, dedup-clipnodes,\n"
+			"unembed, or run. A folder means every .bsp file in it. Maps are overwritten.\n"
+			"Each map's output is printed in one piece when it finishes, followed by a\n"
+			"summary of all maps at the end.\n"
+
+			"\n[Options]\n"
+			"  -j #  : Number of maps to process at once. Defaults to the CPU thread count.\n"
+			"  -q    : Only print the full output of maps that failed.\n"
+			);
+	}
+	else if (command == "run") {
+		logf(
+			"run - Applies several commands to a map, loading and writing it only once\n\n"
+
+			"Usage:   bspguy run <mapname> -ops \"<command> [options]; <command> [options]; ...\"\n"
+			"Example: bspguy run svencoop1.bsp -ops \"noclip -hull 2 -redirect 1; simplify -model 12; unembed\"\n"
+
+			"\nOperations use the same options as the standalone commands and run in the order given.\n"
+			"Supported: noclip, simplify, delete, transform, dedup-clipnodes, unembed.\n"
+			"Unused data is removed once after the last operation. If any operation fails,\n"
+			"nothing is written.\n"
+
+			"\n[Options]\n"
+			"  -ops \"...\"      : Operations separated by semicolons.\n"
+			"  -opsfile <file> : Read operations from a file instead. One or more per line,\n"
+			"                    separated by semicolons. Text after a '#' is ignored.\n"
+			"  -o <file>       : Output file. By default, <mapname> is overwritten.\n"
+			);
+	}
 	else {
 		logf("%s\n\n", g_version_string);
 		logf(
@@ -645,23 +1442,38 @@ void print_help(string command) {
 			"  delete    : Delete BSP models\n"
 			"  simplify  : Simplify BSP models\n"
 			"  transform : Apply 3D transformations to the BSP\n"
+			"  dedup-clipnodes : Merge identical clipnode subtrees\n"
 			"  unembed   : Deletes embedded texture data\n"
+			"  run       : Apply several of the above commands with one load and write\n"
+			"  batch     : Run a command on every map in a folder\n"
+			"  bench     : Time the main processing stages\n"
+			"  generate  : Create a synthetic map for benchmarking\n"
 
 			"\nRun 'bspguy <command> help' to read about a specific command.\n"
+			"\nAdd '--trace <file>' to any command to save a timing trace of its main stages.\n"
+			"Open the file with chrome://tracing or ui.perfetto.dev.\n"
 			"\nTo launch the 3D editor. Drag and drop a .bsp file onto the executable,\n"
 			"or run 'bspguy <mapname>'"
 			);
 	}
 }
 
-int main(int argc, char* argv[])
-{
-	#ifdef WIN32
-		::ShowWindow(::GetConsoleWindow(), SW_SHOW);
-	#endif
-
-	//return test();
+// removes "--trace <file>" from the arguments so it works with any command, including the viewer
+string pop_trace_option(int& argc, char* argv[]) {
+	for (int i = 1; i < argc - 1; i++) {
+		if (toLowerCase(argv[i]) == "--trace") {
+			string path = argv[i + 1];
+			for (int k = i + 2; k < argc; k++) {
+				argv[k - 2] = argv[k];
+			}
+			argc -= 2;
+			return path;
+		}
+	}
+	return "";
+}
 
+int run_main(int argc, char* argv[]) {
 	CommandLine cli(argc, argv);
 
 	if (cli.askingForHelp) {
@@ -686,31 +1498,30 @@ int main(int argc, char* argv[])
 		g_verbose = true;
 	}
 
-	if (cli.command == "info") {
-		return print_info(cli);
-	}
-	else if (cli.command == "noclip") {
-		return noclip(cli);
-	}
-	else if (cli.command == "simplify") {
-		return simplify(cli);
+	if (cli.command == "batch") {
+		return batch(cli);
 	}
-	else if (cli.command == "delete") {
-		return deleteCmd(cli);
-	}
-	else if (cli.command == "transform") {
-		return transform(cli);
-	}
-	else if (cli.command == "merge") {
-		return merge_maps(cli);
-	}
-	else if (cli.command == "unembed") {
-		return unembed(cli);
+
+	return run_command(cli);
+}
+
+int main(int argc, char* argv[])
+{
+	#ifdef WIN32
+		::ShowWindow(::GetConsoleWindow(), SW_SHOW);
+	#endif
+
+	string tracePath = pop_trace_option(argc, argv);
+	if (!tracePath.empty()) {
+		startTrace();
 	}
-	else {
-		logf("unrecognized command: %d\n", cli.command.c_str());
+
+	int ret = run_main(argc, argv);
+
+	if (!tracePath.empty()) {
+		writeTrace(tracePath);
 	}
 
-	return 0;
+	return ret;
 }
 
@@ -1,5 +1,6 @@
 #include "vis.h"
 #include "Bsp.h"
+#include <unordered_map>
 
 bool g_debug_shift = false;
 
@@ -25,116 +26,172 @@ void printVisRow(byte* vis, int len, int offsetLeaf, int mask) {
 	logf("\n");
 }
 
-bool shiftVis(byte* vis, int len, int offsetLeaf, int shift) {
-	if (shift == 0)
-		return false;
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VIS_USE_SSE2
+#endif
+
+static inline int popcount64(uint64_t v) {
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((v * 0x0101010101010101ULL) >> 56);
+}
 
-	byte bitsPerStep = 8;
-	byte offsetBit = offsetLeaf % bitsPerStep;
-	byte mask = 0; // part of the byte that shouldn't be shifted
-	for (int i = 0; i < offsetBit; i++) {
-		mask |= 1 << i;
-	}
+// mask of the bits in word k that fall inside the bit range [start, end)
+static inline uint64_t rangeMask64(int k, int start, int end) {
+	int lo = max(start - k * 64, 0);
+	int hi = min(end - k * 64, 64);
+	if (hi <= lo)
+		return 0;
+	uint64_t hiMask = hi == 64 ? ~0ULL : (1ULL << hi) - 1;
+	return hiMask & ~((1ULL << lo) - 1);
+}
 
-	int byteShifts = abs(shift) / 8;
-	int bitShifts = abs(shift) % 8;
+static int countBits64(const uint64_t* words, int start, int end) {
+	int count = 0;
+	for (int k = start / 64; k * 64 < end; k++) {
+		count += popcount64(words[k] & rangeMask64(k, start, end));
+	}
+	return count;
+}
 
-	// shift until offsetLeaf isn't sharing a byte with the leaves that come before it
-	// then we can do a much faster memcpy on the section that needs to be shifted
-	if ((offsetLeaf % 8) + bitShifts < 8 && byteShifts > 0) {
-		byteShifts -= 1;
-		bitShifts += 8;
+// out[k] = in shifted up by (wordShift*64 + bitShift) bits. in must have one padding word
+// before index 0 (in[-1] == 0), so the carry from the previous word can be read unconditionally.
+static void shiftWordsUp(const uint64_t* in, uint64_t* out, int numWords, int wordShift, int bitShift) {
+	int k = wordShift;
+	if (bitShift == 0) {
+		memcpy(out + k, in, (numWords - k) * sizeof(uint64_t));
+		return;
+	}
+#if defined(__AVX2__)
+	__m128i cnt = _mm_cvtsi32_si128(bitShift);
+	__m128i rcnt = _mm_cvtsi32_si128(64 - bitShift);
+	for (; k + 4 <= numWords; k += 4) {
+		__m256i cur = _mm256_loadu_si256((const __m256i*)(in + k - wordShift));
+		__m256i prev = _mm256_loadu_si256((const __m256i*)(in + k - wordShift - 1));
+		__m256i v = _mm256_or_si256(_mm256_sll_epi64(cur, cnt), _mm256_srl_epi64(prev, rcnt));
+		_mm256_storeu_si256((__m256i*)(out + k), v);
 	}
+#elif defined(VIS_USE_SSE2)
+	__m128i cnt = _mm_cvtsi32_si128(bitShift);
+	__m128i rcnt = _mm_cvtsi32_si128(64 - bitShift);
+	for (; k + 2 <= numWords; k += 2) {
+		__m128i cur = _mm_loadu_si128((const __m128i*)(in + k - wordShift));
+		__m128i prev = _mm_loadu_si128((const __m128i*)(in + k - wordShift - 1));
+		__m128i v = _mm_or_si128(_mm_sll_epi64(cur, cnt), _mm_srl_epi64(prev, rcnt));
+		_mm_storeu_si128((__m128i*)(out + k), v);
+	}
+#endif
+	for (; k < numWords; k++) {
+		const uint64_t* src = in + k - wordShift;
+		out[k] = (src[0] << bitShift) | (src[-1] >> (64 - bitShift));
+	}
+}
 
-	if (shift < 0) {
-		// TODO: memcpy for negative shifts
-		bitShifts += byteShifts * 8;
-		byteShifts = 0;
+// out[k] = in shifted down by (wordShift*64 + bitShift) bits. in must have one padding word
+// after the last index (in[numWords] == 0).
+static void shiftWordsDown(const uint64_t* in, uint64_t* out, int numWords, int wordShift, int bitShift) {
+	int count = numWords - wordShift;
+	int k = 0;
+	if (bitShift == 0) {
+		memcpy(out, in + wordShift, count * sizeof(uint64_t));
+		return;
+	}
+#if defined(__AVX2__)
+	__m128i cnt = _mm_cvtsi32_si128(bitShift);
+	__m128i rcnt = _mm_cvtsi32_si128(64 - bitShift);
+	for (; k + 4 <= count; k += 4) {
+		__m256i cur = _mm256_loadu_si256((const __m256i*)(in + k + wordShift));
+		__m256i next = _mm256_loadu_si256((const __m256i*)(in + k + wordShift + 1));
+		__m256i v = _mm256_or_si256(_mm256_srl_epi64(cur, cnt), _mm256_sll_epi64(next, rcnt));
+		_mm256_storeu_si256((__m256i*)(out + k), v);
+	}
+#elif defined(VIS_USE_SSE2)
+	__m128i cnt = _mm_cvtsi32_si128(bitShift);
+	__m128i rcnt = _mm_cvtsi32_si128(64 - bitShift);
+	for (; k + 2 <= count; k += 2) {
+		__m128i cur = _mm_loadu_si128((const __m128i*)(in + k + wordShift));
+		__m128i next = _mm_loadu_si128((const __m128i*)(in + k + wordShift + 1));
+		__m128i v = _mm_or_si128(_mm_srl_epi64(cur, cnt), _mm_sll_epi64(next, rcnt));
+		_mm_storeu_si128((__m128i*)(out + k), v);
 	}
+#endif
+	for (; k < count; k++) {
+		const uint64_t* src = in + k + wordShift;
+		out[k] = (src[0] >> bitShift) | (src[1] << (64 - bitShift));
+	}
+}
 
-	if (g_debug_shift) {
-		logf("\nSHIFT\n");
+int shiftBits(byte* data, int len, int offsetBit, int shift) {
+	int numBits = len * 8;
+	if (shift == 0 || len <= 0 || offsetBit >= numBits)
+		return 0;
+	offsetBit = max(offsetBit, 0);
+
+	// Work on a zero-padded copy made of 64-bit words (bit i = byte i/8, bit i%8 on little-endian).
+	// The extra word on each side lets the shift loops read neighbours without bounds checks.
+	int numWords = (len + 7) / 8;
+	static thread_local vector<uint64_t> buffer;
+	buffer.assign((numWords + 2) * 2, 0);
+	uint64_t* in = &buffer[1];
+	uint64_t* out = &buffer[numWords + 3];
+
+	memcpy(in, data, len);
+
+	// bits below the offset stay where they are, so keep them out of the shift
+	int offsetWord = offsetBit / 64;
+	uint64_t keepMask = (1ULL << (offsetBit % 64)) - 1;
+	uint64_t keptBits = in[offsetWord] & keepMask;
+	memset(in, 0, offsetWord * sizeof(uint64_t));
+	in[offsetWord] &= ~keepMask;
+
+	int dist = abs(shift);
+	int overflow;
+	if (shift > 0) {
+		overflow = countBits64(in, max(numBits - dist, offsetBit), numBits);
+	}
+	else {
+		overflow = countBits64(in, offsetBit, min(offsetBit + dist, numBits));
 	}
 
-	int overflow = 0;
-	for (int k = 0; k < bitShifts; k++) {
+	if (dist < numBits) {
+		if (shift > 0)
+			shiftWordsUp(in, out, numWords, dist / 64, dist % 64);
+		else
+			shiftWordsDown(in, out, numWords, dist / 64, dist % 64);
+	}
 
-		if (g_debug_shift) {
-			logf("%2d = ", k);
-			printVisRow(vis, len, offsetLeaf, mask);
-		}
+	// anything shifted below the offset is dropped. Words before the offset word are left untouched.
+	out[offsetWord] = (out[offsetWord] & ~keepMask) | keptBits;
 
-		if (shift > 0) {
-			bool carry = 0;
-			for (int i = 0; i < len; i++) {
-				uint oldCarry = carry;
-				carry = (vis[i] & 0x80) != 0;
-
-				if (offsetBit != 0 && i * bitsPerStep < offsetLeaf && i * bitsPerStep + bitsPerStep > offsetLeaf) {
-					vis[i] = (vis[i] & mask) | ((vis[i] & ~mask) << 1);
-				}
-				else if (i >= offsetLeaf / bitsPerStep) {
-					vis[i] = (vis[i] << 1) + oldCarry;
-				}
-				else {
-					carry = 0;
-				}
-			}
+	int firstByte = offsetWord * 8;
+	memcpy(data + firstByte, (byte*)out + firstByte, len - firstByte);
 
-			if (carry) {
-				overflow++;
-			}
-		}
-		else {
-			bool carry = 0;
-			for (int i = len-1; i >= 0; i--) {
-				uint oldCarry = carry;
-				carry = (vis[i] & 0x01) != 0;
-
-				if (offsetBit != 0 && i * bitsPerStep < offsetLeaf && i * bitsPerStep + bitsPerStep > offsetLeaf) {
-					vis[i] = (vis[i] & mask) | ((vis[i] >> 1) & ~mask) | (oldCarry << 7);
-				}
-				else if (i >= offsetLeaf / bitsPerStep) {
-					vis[i] = (vis[i] >> 1) + (oldCarry << 7);
-				}
-				else {
-					carry = 0;
-				}
-			}
+	return overflow;
+}
 
-			if (carry) {
-				overflow++;
-			}
-		}
+bool shiftVis(byte* vis, int len, int offsetLeaf, int shift) {
+	if (shift == 0)
+		return false;
 
-		if (g_debug_shift && k == bitShifts-1) {
-			logf("%2d = ", k+1);
-			printVisRow(vis, len, offsetLeaf, mask);
-		}
+	if (g_debug_shift) {
+		logf("\nSHIFT\n");
+		printVisRow(vis, len, offsetLeaf, 0);
 	}
-	if (overflow)
-		logf("OVERFLOWED %d VIS LEAVES WHILE SHIFTING\n", overflow);
-
 
-	if (byteShifts > 0) {
-		// TODO: detect overflows here too
-		static byte temp[MAX_MAP_LEAVES / 8];
+	int overflow = shiftBits(vis, len, offsetLeaf, shift);
 
-		if (shift > 0) {
-			int startByte = (offsetLeaf + bitShifts) / 8;
-			int moveSize = len - (startByte + byteShifts);
-
-			memcpy(temp, (byte*)vis + startByte, moveSize);
-			memset((byte*)vis + startByte, 0, byteShifts);
-			memcpy((byte*)vis + startByte + byteShifts, temp, moveSize);
-		}
-		else {
-			// TODO LOL
-		}
-		
+	if (g_debug_shift) {
+		printVisRow(vis, len, offsetLeaf, 0);
 	}
 
-	return overflow;
+	if (overflow)
+		logf("OVERFLOWED %d VIS LEAVES WHILE SHIFTING\n", overflow);
+
+	return overflow != 0;
 }
 
 // decompress this map's vis data into arrays of bits where each bit indicates if a leaf is visible or not
@@ -144,10 +201,8 @@ bool shiftVis(byte* vis, int len, int offsetLeaf, int shift) {
 void decompress_vis_lump(BSPLEAF* leafLump, byte* visLump, byte* output,
 	int iterationLeaves, int visDataLeafCount, int newNumLeaves)
 {
-	byte* dest;
 	uint oldVisRowSize = ((visDataLeafCount + 63) & ~63) >> 3;
 	uint newVisRowSize = ((newNumLeaves + 63) & ~63) >> 3;
-	int len = 0;
 
 	// calculate which bits of an uncompressed visibility row are used/unused
 	byte lastChunkMask = 0;
@@ -156,15 +211,14 @@ void decompress_vis_lump(BSPLEAF* leafLump, byte* visLump, byte* output,
 		lastChunkMask = lastChunkMask | (1 << k);
 	}
 
-	for (int i = 0; i < iterationLeaves; i++)
-	{
-		g_progress.tick();
-		dest = output + i * newVisRowSize;
+	// rows are independent of each other
+	parallelFor(iterationLeaves, [&](int i, int threadIdx) {
+		byte* dest = output + i * newVisRowSize;
 
 		if (leafLump[i + 1].nVisOffset < 0) {
 			memset(dest, 255, lastUsedIdx);
 			dest[lastUsedIdx] |= lastChunkMask;
-			continue;
+			return;
 		}
 
 		DecompressVis((const byte*)(visLump + leafLump[i + 1].nVisOffset), dest, oldVisRowSize, visDataLeafCount);
@@ -177,10 +231,9 @@ void decompress_vis_lump(BSPLEAF* leafLump, byte* visLump, byte* output,
 		}
 		if (lastUsedIdx < newVisRowSize) {
 			int sz = newVisRowSize - (lastUsedIdx + 1);
-			int last = lastUsedIdx + 1 + sz;
 			memset(dest + lastUsedIdx + 1, 0, sz);
 		}
-	}
+	}, true);
 }
 
 //
@@ -277,57 +330,80 @@ int CompressVis(const byte* const src, const unsigned int src_length, byte* dest
 
 int CompressAll(BSPLEAF* leafs, byte* uncompressed, byte* output, int numLeaves, int iterLeaves, int bufferSize)
 {
-	int x = 0;
-	byte* dest;
-	byte* src;
-	byte compressed[MAX_MAP_LEAVES / 8];
 	uint g_bitbytes = ((numLeaves + 63) & ~63) >> 3;
 
-	byte* vismap_p = output;
+	// Rows with identical contents share the compressed data of the first one.
+	// Hashes are computed in parallel, then matched in order so the first row always wins.
+	vector<uint64_t> rowHashes(iterLeaves);
+	parallelFor(iterLeaves, [&](int i, int threadIdx) {
+		rowHashes[i] = hashBytes(uncompressed + i * g_bitbytes, g_bitbytes);
+	}, true);
 
 	int* sharedRows = new int[iterLeaves];
+	unordered_multimap<uint64_t, int> uniqueRows;
+	uniqueRows.reserve(iterLeaves);
 	for (int i = 0; i < iterLeaves; i++) {
 		byte* src = uncompressed + i * g_bitbytes;
 
 		sharedRows[i] = i;
-		for (int k = 0; k < i; k++) {
-			if (sharedRows[k] != k) {
-				continue; // already compared in an earlier row
-			}
-			byte* previous = uncompressed + k * g_bitbytes;
+		auto range = uniqueRows.equal_range(rowHashes[i]);
+		for (auto it = range.first; it != range.second; ++it) {
+			byte* previous = uncompressed + it->second * g_bitbytes;
 			if (memcmp(src, previous, g_bitbytes) == 0) {
-				sharedRows[i] = k;
+				sharedRows[i] = it->second;
 				break;
 			}
 		}
-		g_progress.tick();
+		if (sharedRows[i] == i) {
+			uniqueRows.insert(make_pair(rowHashes[i], i));
+		}
 	}
 
-	for (int i = 0; i < iterLeaves; i++)
-	{
+	// compress unique rows into per-thread buffers
+	int numThreads = getThreadCount();
+	vector<vector<byte>> threadOutput(numThreads);
+	vector<int> rowThread(iterLeaves);
+	vector<int> rowOffset(iterLeaves);
+	vector<int> rowLength(iterLeaves);
+
+	parallelFor(iterLeaves, [&](int i, int threadIdx) {
 		if (sharedRows[i] != i) {
-			leafs[i + 1].nVisOffset = leafs[sharedRows[i] + 1].nVisOffset;
-			continue;
+			return;
 		}
-
+		byte compressed[MAX_MAP_LEAVES / 8];
 		memset(&compressed, 0, sizeof(compressed));
 
-		src = uncompressed + i * g_bitbytes;
+		byte* src = uncompressed + i * g_bitbytes;
+		int x = CompressVis(src, g_bitbytes, compressed, sizeof(compressed));
 
-		// Compress all leafs into global compression buffer
-		x = CompressVis(src, g_bitbytes, compressed, sizeof(compressed));
+		vector<byte>& dest = threadOutput[threadIdx];
+		rowThread[i] = threadIdx;
+		rowOffset[i] = dest.size();
+		rowLength[i] = x;
+		dest.insert(dest.end(), compressed, compressed + x);
+	});
 
-		dest = vismap_p;
-		vismap_p += x;
+	// assign offsets in row order and concatenate the rows
+	byte* vismap_p = output;
 
-		if (vismap_p > output + bufferSize)
+	for (int i = 0; i < iterLeaves; i++)
+	{
+		if (sharedRows[i] != i) {
+			leafs[i + 1].nVisOffset = leafs[sharedRows[i] + 1].nVisOffset;
+			continue;
+		}
+
+		int x = rowLength[i];
+		if (vismap_p + x > output + bufferSize)
 		{
 			logf("Vismap expansion overflow\n");
+			break;
 		}
 
-		leafs[i + 1].nVisOffset = dest - output;            // leaf 0 is a common solid
+		leafs[i + 1].nVisOffset = vismap_p - output;            // leaf 0 is a common solid
 
-		memcpy(dest, compressed, x);
+		memcpy(vismap_p, &threadOutput[rowThread[i]][rowOffset[i]], x);
+		vismap_p += x;
 	}
 
 	delete[] sharedRows;
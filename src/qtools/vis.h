@@ -2,6 +2,12 @@
 
 class BSPLEAF;
 
+// shifts the bits at index >= offsetBit by the given amount (positive = towards higher indexes).
+// Bits below offsetBit are left as-is and vacated bits are cleared.
+// Returns the number of set bits that were pushed out of the range [offsetBit, len*8)
+int shiftBits(byte* data, int len, int offsetBit, int shift);
+
+// shifts the visibility bits for leaves >= offsetLeaf. Returns true if any visible leaves were lost
 bool shiftVis(byte* vis, int len, int offsetLeaf, int shift);
 
 // decompress the given vis data into arrays of bits where each bit indicates if a leaf is visible or not
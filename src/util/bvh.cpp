@@ -0,0 +1,197 @@
+#include "bvh.h"
+#include <algorithm>
+
+#define BVH_LEAF_ITEMS 4
+
+// returns the distance where the ray enters the box, if it does so before maxDist
+static bool rayEntersBox(const float* start, const float* invDir, const float* mins, const float* maxs,
+	float maxDist, float& enterDist) {
+	float tmin = 0;
+	float tmax = maxDist;
+
+	for (int i = 0; i < 3; i++) {
+		if (invDir[i] == 0) {
+			// parallel to this axis (the inverse of a zero direction is stored as 0)
+			if (start[i] < mins[i] || start[i] > maxs[i])
+				return false;
+			continue;
+		}
+
+		float t1 = (mins[i] - start[i]) * invDir[i];
+		float t2 = (maxs[i] - start[i]) * invDir[i];
+		if (t1 > t2)
+			swap(t1, t2);
+
+		tmin = max(tmin, t1);
+		tmax = min(tmax, t2);
+		if (tmin > tmax)
+			return false;
+	}
+
+	enterDist = tmin;
+	return true;
+}
+
+void Bvh::setItems(const vector<vec3>& mins, const vector<vec3>& maxs) {
+	itemMins = mins;
+	itemMaxs = maxs;
+	nodes.clear();
+	items.clear();
+	itemLeaves.clear();
+}
+
+void Bvh::build() {
+	nodes.clear();
+	items.resize(itemMins.size());
+	itemLeaves.resize(itemMins.size());
+
+	if (items.empty())
+		return;
+
+	for (int i = 0; i < items.size(); i++) {
+		items[i] = i;
+	}
+
+	nodes.reserve((items.size() / BVH_LEAF_ITEMS) * 2 + 1);
+	build_node(-1, 0, items.size());
+}
+
+int Bvh::build_node(int parent, int firstItem, int itemCount) {
+	int nodeIdx = nodes.size();
+	nodes.push_back(BvhNode());
+
+	BvhNode node;
+	node.parent = parent;
+	node.children[0] = node.children[1] = -1;
+	node.firstItem = firstItem;
+	node.itemCount = itemCount;
+
+	// split at the median center along the longest axis of the item centers
+	vec3 centerMins(9e99, 9e99, 9e99);
+	vec3 centerMaxs(-9e99, -9e99, -9e99);
+	for (int i = firstItem; i < firstItem + itemCount; i++) {
+		expandBoundingBox((itemMins[items[i]] + itemMaxs[items[i]]) * 0.5f, centerMins, centerMaxs);
+	}
+	vec3 size = centerMaxs - centerMins;
+	int axis = size.x >= size.y && size.x >= size.z ? 0 : (size.y >= size.z ? 1 : 2);
+
+	if (itemCount <= BVH_LEAF_ITEMS || ((float*)&size)[axis] <= 0) {
+		for (int i = firstItem; i < firstItem + itemCount; i++) {
+			itemLeaves[items[i]] = nodeIdx;
+		}
+		nodes[nodeIdx] = node;
+		update_bounds(nodeIdx);
+		return nodeIdx;
+	}
+
+	int half = itemCount / 2;
+	nth_element(items.begin() + firstItem, items.begin() + firstItem + half, items.begin() + firstItem + itemCount,
+		[&](int a, int b) {
+			return ((float*)&itemMins[a])[axis] + ((float*)&itemMaxs[a])[axis] <
+				((float*)&itemMins[b])[axis] + ((float*)&itemMaxs[b])[axis];
+		});
+
+	node.itemCount = 0;
+	nodes[nodeIdx] = node;
+
+	int left = build_node(nodeIdx, firstItem, half);
+	int right = build_node(nodeIdx, firstItem + half, itemCount - half);
+	nodes[nodeIdx].children[0] = left;
+	nodes[nodeIdx].children[1] = right;
+	update_bounds(nodeIdx);
+
+	return nodeIdx;
+}
+
+void Bvh::update_bounds(int nodeIdx) {
+	BvhNode& node = nodes[nodeIdx];
+	node.mins = vec3(9e99, 9e99, 9e99);
+	node.maxs = vec3(-9e99, -9e99, -9e99);
+
+	if (node.children[0] == -1) {
+		for (int i = node.firstItem; i < node.firstItem + node.itemCount; i++) {
+			expandBoundingBox(itemMins[items[i]], node.mins, node.maxs);
+			expandBoundingBox(itemMaxs[items[i]], node.mins, node.maxs);
+		}
+		return;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		BvhNode& child = nodes[node.children[i]];
+		expandBoundingBox(child.mins, node.mins, node.maxs);
+		expandBoundingBox(child.maxs, node.mins, node.maxs);
+	}
+}
+
+void Bvh::refit(int item, vec3 mins, vec3 maxs) {
+	if (item < 0 || item >= itemMins.size())
+		return;
+
+	itemMins[item] = mins;
+	itemMaxs[item] = maxs;
+
+	if (nodes.empty())
+		return;
+
+	for (int nodeIdx = itemLeaves[item]; nodeIdx != -1; nodeIdx = nodes[nodeIdx].parent) {
+		update_bounds(nodeIdx);
+	}
+}
+
+bool Bvh::traceRay(vec3 start, vec3 dir, float& bestDist, const function<bool(int item, float& bestDist)>& hitItem) {
+	if (nodes.empty())
+		return false;
+
+	float invDir[3];
+	float* dirf = (float*)&dir;
+	for (int i = 0; i < 3; i++) {
+		invDir[i] = dirf[i] != 0 ? 1.0f / dirf[i] : 0;
+	}
+	float* startf = (float*)&start;
+
+	float enterDist;
+	if (!rayEntersBox(startf, invDir, (float*)&nodes[0].mins, (float*)&nodes[0].maxs, bestDist, enterDist))
+		return false;
+
+	bool hitAny = false;
+
+	// nodes to visit, paired with the distance to their box
+	vector<pair<int, float>> stack;
+	stack.reserve(64);
+	stack.push_back(make_pair(0, enterDist));
+
+	while (!stack.empty()) {
+		pair<int, float> next = stack.back();
+		stack.pop_back();
+
+		if (next.second > bestDist)
+			continue; // a closer hit was found since this was pushed
+
+		BvhNode& node = nodes[next.first];
+
+		if (node.children[0] == -1) {
+			for (int i = node.firstItem; i < node.firstItem + node.itemCount; i++) {
+				if (hitItem(items[i], bestDist))
+					hitAny = true;
+			}
+			continue;
+		}
+
+		float dist[2];
+		bool hit[2];
+		for (int i = 0; i < 2; i++) {
+			BvhNode& child = nodes[node.children[i]];
+			hit[i] = rayEntersBox(startf, invDir, (float*)&child.mins, (float*)&child.maxs, bestDist, dist[i]);
+		}
+
+		// the nearer child is pushed last so it's visited first
+		int nearChild = (hit[0] && hit[1]) ? (dist[0] <= dist[1] ? 0 : 1) : (hit[0] ? 0 : 1);
+		int farChild = 1 - nearChild;
+		if (hit[farChild])
+			stack.push_back(make_pair(node.children[farChild], dist[farChild]));
+		if (hit[nearChild])
+			stack.push_back(make_pair(node.children[nearChild], dist[nearChild]));
+	}
+
+	return hitAny;
+}
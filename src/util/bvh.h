@@ -0,0 +1,42 @@
+#pragma once
+#include "util.h"
+
+struct BvhNode {
+	vec3 mins, maxs;
+	int children[2]; // -1 for leaves
+	int parent;
+	int firstItem, itemCount; // range in the item list (leaves only)
+};
+
+// Bounding volume hierarchy over a list of boxes, for finding the nearest of many objects hit by a ray.
+// Items keep their original indexes. Bounds can be refit after an item changes, but the tree
+// isn't rebalanced, so a rebuild is better if most items move.
+class Bvh {
+public:
+	// copies the bounds of every item. Call build() before tracing.
+	void setItems(const vector<vec3>& mins, const vector<vec3>& maxs);
+
+	// builds the tree for the current items
+	void build();
+
+	bool isBuilt() { return !nodes.empty(); }
+	int itemCount() { return itemMins.size(); }
+
+	// updates an item's bounds and grows/shrinks the boxes above it to match
+	void refit(int item, vec3 mins, vec3 maxs);
+
+	// Visits the items whose boxes the ray hits, nearest box first. The callback tests the item itself
+	// and lowers bestDist if it's hit closer. Boxes farther than bestDist are skipped, so most items
+	// behind the closest hit are never visited. Returns true if any callback returned true.
+	bool traceRay(vec3 start, vec3 dir, float& bestDist, const function<bool(int item, float& bestDist)>& hitItem);
+
+private:
+	vector<BvhNode> nodes;
+	vector<int> items; // item indexes, ordered so each leaf covers a contiguous range
+	vector<int> itemLeaves; // leaf node of each item
+	vector<vec3> itemMins;
+	vector<vec3> itemMaxs;
+
+	int build_node(int parent, int firstItem, int itemCount);
+	void update_bounds(int nodeIdx);
+};
@@ -0,0 +1,84 @@
+#include "trace.h"
+#include "util.h"
+#include <chrono>
+#include <mutex>
+
+bool g_tracing = false;
+
+struct TRACE_EVENT {
+	const char* name;
+	int64_t start;
+	int64_t duration;
+};
+
+// spans are kept per thread so recording doesn't need a lock
+struct TRACE_THREAD {
+	int id;
+	vector<TRACE_EVENT> events;
+};
+
+static chrono::steady_clock::time_point g_trace_start;
+static mutex g_trace_mutex;
+static vector<TRACE_THREAD*> g_trace_threads;
+static thread_local TRACE_THREAD* t_trace_thread = NULL;
+
+static TRACE_THREAD* get_trace_thread() {
+	if (!t_trace_thread) {
+		lock_guard<mutex> lock(g_trace_mutex);
+		t_trace_thread = new TRACE_THREAD();
+		t_trace_thread->id = g_trace_threads.size() + 1;
+		g_trace_threads.push_back(t_trace_thread);
+	}
+	return t_trace_thread;
+}
+
+void startTrace() {
+	g_trace_start = chrono::steady_clock::now();
+	get_trace_thread(); // main thread is always tid 1
+	g_tracing = true;
+}
+
+int64_t traceTime() {
+	return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - g_trace_start).count();
+}
+
+void addTraceSpan(const char* name, int64_t start, int64_t end) {
+	TRACE_EVENT evt = { name, start, end - start };
+	get_trace_thread()->events.push_back(evt);
+}
+
+bool writeTrace(const string& path) {
+	lock_guard<mutex> lock(g_trace_mutex);
+
+	FILE* file = fopen(path.c_str(), "w");
+	if (!file) {
+		logf("ERROR: Failed to write trace file %s\n", path.c_str());
+		return false;
+	}
+
+	int spanCount = 0;
+	string json = "{\"traceEvents\":[\n";
+	json += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"bspguy\"}}";
+
+	for (int i = 0; i < g_trace_threads.size(); i++) {
+		TRACE_THREAD* thread = g_trace_threads[i];
+
+		string threadName = thread->id == 1 ? "main" : "worker " + to_string(thread->id - 1);
+		appendf(json, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			thread->id, threadName.c_str());
+
+		for (int k = 0; k < thread->events.size(); k++) {
+			TRACE_EVENT& evt = thread->events[k];
+			appendf(json, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%d}",
+				escapeJson(evt.name).c_str(), (long long)evt.start, (long long)evt.duration, thread->id);
+		}
+		spanCount += thread->events.size();
+	}
+
+	json += "\n]}\n";
+	fwrite(json.c_str(), 1, json.size(), file);
+	fclose(file);
+
+	logf("Wrote %d trace spans to %s\n", spanCount, path.c_str());
+	return true;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <string>
+#include <stdint.h>
+
+// Scoped timing spans, saved as a Chrome trace (open with chrome://tracing or ui.perfetto.dev).
+// Spans on the same thread nest by time. When tracing is off, a span is just a flag check.
+
+extern bool g_tracing;
+
+// start recording spans. The calling thread is labeled as the main thread.
+void startTrace();
+
+// writes every span recorded so far. Threads that record spans should be finished first.
+bool writeTrace(const std::string& path);
+
+// microseconds since startTrace
+int64_t traceTime();
+
+void addTraceSpan(const char* name, int64_t start, int64_t end);
+
+// records the time from construction to destruction. name is not copied, so use a string literal.
+class TraceSpan {
+public:
+	TraceSpan(const char* name) : name(name), start(g_tracing ? traceTime() : -1) {}
+	~TraceSpan() {
+		if (start >= 0)
+			addTraceSpan(name, start, traceTime());
+	}
+
+private:
+	const char* name;
+	int64_t start;
+};
@@ -7,46 +7,106 @@
 #include <string.h>
 #include "Wad.h"
 #include <stdarg.h>
+#include <climits>
 
 ProgressMeter g_progress;
 int g_render_flags;
 vector<string> g_log_buffer;
 mutex g_log_mutex;
 
-static char log_line[4096];
+static thread_local string* t_log_capture = NULL;
+
+static void print_log_line(const char* line) {
+	if (t_log_capture) {
+		*t_log_capture += line;
+		return;
+	}
 
-void logf(const char* format, ...) {
 	g_log_mutex.lock();
+	printf("%s", line);
+	g_log_buffer.push_back(line);
+	g_log_mutex.unlock();
+}
+
+void logf(const char* format, ...) {
+	char log_line[4096];
 
 	va_list vl;
 	va_start(vl, format);
 	vsnprintf(log_line, 4096, format, vl);
 	va_end(vl);
 
-	printf(log_line);
-	g_log_buffer.push_back(log_line);
-
-	g_log_mutex.unlock();
+	print_log_line(log_line);
 }
 
 void debugf(const char* format, ...) {
 	if (!g_verbose) {
 		return;
 	}
-	
-	g_log_mutex.lock();
+
+	char log_line[4096];
 
 	va_list vl;
 	va_start(vl, format);
 	vsnprintf(log_line, 4096, format, vl);
 	va_end(vl);
 
-	printf(log_line);
-	g_log_buffer.push_back(log_line);
+	print_log_line(log_line);
+}
+
+string* setThreadLogCapture(string* buffer) {
+	string* old = t_log_capture;
+	t_log_capture = buffer;
+	return old;
+}
 
+bool isThreadLogCaptured() {
+	return t_log_capture != NULL;
+}
+
+void printLogBlock(const string& text) {
+	if (t_log_capture) {
+		*t_log_capture += text;
+		return;
+	}
+
+	g_log_mutex.lock();
+	fwrite(text.c_str(), 1, text.size(), stdout);
+	g_log_buffer.push_back(text);
 	g_log_mutex.unlock();
 }
 
+void appendf(string& out, const char* format, ...) {
+	char line[4096];
+
+	va_list vl;
+	va_start(vl, format);
+	vsnprintf(line, 4096, format, vl);
+	va_end(vl);
+
+	out += line;
+}
+
+string escapeJson(const string& s) {
+	string out;
+	for (int i = 0; i < s.size(); i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		}
+		else if (c < 0x20) {
+			char code[8];
+			snprintf(code, 8, "\\u%04x", c);
+			out += code;
+		}
+		else {
+			out += c;
+		}
+	}
+	return out;
+}
+
 bool fileExists(const string& fileName)
 {
 	if (FILE *file = fopen(fileName.c_str(), "r"))
@@ -76,21 +136,14 @@ char * loadFile( const string& fileName, int& length)
 vector<string> splitString(string str, const char* delimitters)
 {
 	vector<string> split;
-	if (str.size() == 0)
-		return split;
-
-	// somehow plain assignment doesn't create a copy and even modifies the parameter that was passed by value (WTF!?!)
-	//string copy = str; 
-	string copy;
-	for (int i = 0; i < str.length(); i++)
-		copy += str[i];
-
-	char* tok = strtok((char*)copy.c_str(), delimitters);
 
-	while (tok != NULL)
+	// same tokens strtok would give (empty ones are skipped), but safe to call from any thread
+	size_t start = str.find_first_not_of(delimitters);
+	while (start != string::npos)
 	{
-		split.push_back(tok);
-		tok = strtok(NULL, delimitters);
+		size_t end = str.find_first_of(delimitters, start);
+		split.push_back(str.substr(start, end - start));
+		start = str.find_first_not_of(delimitters, end);
 	}
 	return split;
 }
@@ -634,12 +687,85 @@ bool pointInsidePolygon(vector<vec2>& poly, vec2 p) {
 	return inside;
 }
 
+int getThreadCount() {
+	static int threadCount = max((int)thread::hardware_concurrency(), 1);
+	return threadCount;
+}
+
+static thread_local bool t_inParallelFor = false;
+
+void parallelFor(int count, const function<void(int i, int threadIdx)>& func, bool tickProgress, int minItemsPerThread, int maxThreads) {
+	minItemsPerThread = max(minItemsPerThread, 1);
+	const int chunkSize = min(minItemsPerThread, 16);
+
+	int numThreads = min(maxThreads > 0 ? maxThreads : getThreadCount(), (count + minItemsPerThread - 1) / minItemsPerThread);
+	if (t_inParallelFor) {
+		numThreads = 1; // the outer loop already uses every core
+	}
+
+	if (numThreads <= 1) {
+		for (int i = 0; i < count; i++) {
+			func(i, 0);
+			if (tickProgress)
+				g_progress.tick();
+		}
+		return;
+	}
+
+	atomic<int> nextItem(0);
+	atomic<int> finishedItems(0);
+
+	vector<thread> workers;
+	for (int t = 0; t < numThreads; t++) {
+		workers.push_back(thread([&, t]() {
+			t_inParallelFor = true;
+			int start;
+			while ((start = nextItem.fetch_add(chunkSize)) < count) {
+				int end = min(start + chunkSize, count);
+				for (int i = start; i < end; i++) {
+					func(i, t);
+				}
+				finishedItems += end - start;
+			}
+		}));
+	}
+
+	if (tickProgress) {
+		int ticked = 0;
+		while (ticked < count) {
+			int finished = finishedItems.load();
+			for (; ticked < finished; ticked++) {
+				g_progress.tick();
+			}
+			if (ticked < count)
+				this_thread::sleep_for(chrono::milliseconds(5));
+		}
+	}
+
+	for (int t = 0; t < numThreads; t++) {
+		workers[t].join();
+	}
+}
+
+uint64_t hashBytes(const void* data, size_t len) {
+	const byte* bytes = (const byte*)data;
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
 #ifdef WIN32
 #include <Windows.h>
 #include <Shlobj.h>
+#include <Psapi.h>
 
 void print_color(int colors)
 {
+	if (isThreadLogCaptured())
+		return; // the console color would apply to whatever another thread is printing
 	HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
 	colors = colors ? colors : (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
 	SetConsoleTextAttribute(console, (WORD)colors);
@@ -675,10 +801,81 @@ bool createDir(const string& dirName)
 	return true;
 }
 
+byte* mapFile(const string& fileName, int& length, void*& handle)
+{
+	length = 0;
+	handle = NULL;
+
+	HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || size.QuadPart > INT_MAX) {
+		CloseHandle(file);
+		return NULL;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(file); // the mapping keeps its own reference to the file
+	if (!mapping)
+		return NULL;
+
+	byte* data = (byte*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	if (!data) {
+		CloseHandle(mapping);
+		return NULL;
+	}
+
+	length = (int)size.QuadPart;
+	handle = mapping;
+	return data;
+}
+
+void unmapFile(byte* data, int length, void* handle)
+{
+	if (data)
+		UnmapViewOfFile(data);
+	if (handle)
+		CloseHandle((HANDLE)handle);
+}
+
+vector<string> getDirFiles(const string& dir, const string& pattern)
+{
+	vector<string> files;
+
+	WIN32_FIND_DATAA findData;
+	HANDLE find = FindFirstFileA((dir + "\\" + pattern).c_str(), &findData);
+	if (find == INVALID_HANDLE_VALUE)
+		return files;
+
+	do {
+		if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			files.push_back(dir + "\\" + findData.cFileName);
+	} while (FindNextFileA(find, &findData));
+	FindClose(find);
+
+	sort(files.begin(), files.end());
+	return files;
+}
+
+size_t getPeakMemoryUsage()
+{
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PeakWorkingSetSize;
+}
+
 #else
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/resource.h>
 
 void print_color(int colors)
 {
@@ -726,4 +923,67 @@ bool createDir(const string& dirName)
 	}
 	return true;
 }
+
+byte* mapFile(const string& fileName, int& length, void*& handle)
+{
+	length = 0;
+	handle = NULL;
+
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct stat sb;
+	if (fstat(fd, &sb) != 0 || sb.st_size == 0 || sb.st_size > INT_MAX) {
+		close(fd);
+		return NULL;
+	}
+
+	void* data = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd); // the mapping keeps its own reference to the file
+	if (data == MAP_FAILED)
+		return NULL;
+
+	length = (int)sb.st_size;
+	return (byte*)data;
+}
+
+void unmapFile(byte* data, int length, void* handle)
+{
+	if (data)
+		munmap(data, length);
+}
+
+vector<string> getDirFiles(const string& dir, const string& pattern)
+{
+	vector<string> files;
+
+	DIR* d = opendir(dir.c_str());
+	if (!d)
+		return files;
+
+	struct dirent* entry;
+	while ((entry = readdir(d)) != NULL) {
+		string path = dir + "/" + entry->d_name;
+		struct stat sb;
+		if (fnmatch(pattern.c_str(), entry->d_name, 0) == 0 && stat(path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode))
+			files.push_back(path);
+	}
+	closedir(d);
+
+	sort(files.begin(), files.end());
+	return files;
+}
+
+size_t getPeakMemoryUsage()
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return (size_t)usage.ru_maxrss; // bytes on macOS
+#else
+	return (size_t)usage.ru_maxrss * 1024; // kilobytes on linux
+#endif
+}
 #endif
@@ -6,8 +6,11 @@
 #include <iostream>
 #include <fstream>
 #include <cmath>
+#include <string.h>
 #include <thread>
 #include <future>
+#include <atomic>
+#include <functional>
 #include "ProgressMeter.h"
 #include "bsptypes.h"
 
@@ -38,10 +41,35 @@ void logf(const char* format, ...);
 
 void debugf(const char* format, ...);
 
+// While set, logf/debugf calls from this thread append to the buffer instead of printing (NULL to stop).
+// Lets parallel jobs keep their output apart. printLogBlock prints a captured log without interleaving.
+// Returns the previous buffer, so captures can be nested.
+string* setThreadLogCapture(string* buffer);
+bool isThreadLogCaptured();
+void printLogBlock(const string& text);
+
+// appends printf-style formatted text (up to 4096 chars per call)
+void appendf(string& out, const char* format, ...);
+
+// escapes quotes, backslashes, and control characters for use in a JSON string
+string escapeJson(const string& s);
+
 bool fileExists(const string& fileName);
 
 char * loadFile( const string& fileName, int& length);
 
+// maps a file into memory as a private copy-on-write view (writes are never flushed to disk).
+// Returns NULL on failure. The mapping must be released with unmapFile.
+byte* mapFile(const string& fileName, int& length, void*& handle);
+
+void unmapFile(byte* data, int length, void* handle);
+
+// files in dir whose names match the pattern ('*' and '?' wildcards), sorted by path
+vector<string> getDirFiles(const string& dir, const string& pattern);
+
+// highest amount of physical memory this process has used so far, in bytes
+size_t getPeakMemoryUsage();
+
 vector<string> splitString(string str, const char* delimitters);
 
 string basename(string path);
@@ -105,3 +133,26 @@ vector<int> getSortedPlanarVertOrder(vector<vec3>& verts);
 vector<vec3> getSortedPlanarVerts(vector<vec3>& verts);
 
 bool pointInsidePolygon(vector<vec2>& poly, vec2 p);
+
+// number of worker threads used by parallelFor
+int getThreadCount();
+
+// calls func(i, threadIdx) for every i in [0, count) on worker threads, and blocks until all are done.
+// threadIdx is in [0, getThreadCount()), for indexing per-thread buffers.
+// A thread is started for every minItemsPerThread items, so small counts run on the calling thread.
+// Calls made from inside another parallelFor also run on the calling thread, so nested loops
+// (e.g. vis compression during concurrent merges) don't start more threads than there are cores.
+// If tickProgress is set, g_progress is ticked once per finished item (from the calling thread).
+// maxThreads limits the worker count (0 = getThreadCount()).
+void parallelFor(int count, const function<void(int i, int threadIdx)>& func, bool tickProgress=false, int minItemsPerThread=64, int maxThreads=0);
+
+// 64-bit FNV-1a hash
+uint64_t hashBytes(const void* data, size_t len);
+
+// hash map functors for deduplicating structs by their raw bytes (same result as a memcmp search)
+template<class T> struct RawBytesHash {
+	size_t operator()(const T& v) const { return (size_t)hashBytes(&v, sizeof(T)); }
+};
+template<class T> struct RawBytesEqual {
+	bool operator()(const T& a, const T& b) const { return memcmp(&a, &b, sizeof(T)) == 0; }
+};